@@ -22,26 +22,68 @@ static inline float op_div(float a, float b) {
     return a / b;
 }
 
+// plain f32 loops, vectorized by the compiler
+template <float (*op)(float, float)>
+static inline void vec_binary_op_f32(const int64_t n, float * z, const float * x, const float * y) {
+    for (int64_t i = 0; i < n; i++) {
+        z[i] = op(x[i], y[i]);
+    }
+}
+
+template <float (*op)(float, float)>
+static inline void vec_binary_op_scalar_f32(const int64_t n, float * z, const float * x, const float y) {
+    for (int64_t i = 0; i < n; i++) {
+        z[i] = op(x[i], y);
+    }
+}
+
 template <float (*op)(float, float), typename src0_t, typename src1_t, typename dst_t>
 static inline void vec_binary_op_contiguous(const int64_t n, dst_t * z, const src0_t * x, const src1_t * y) {
-    constexpr auto src0_to_f32 = type_conversion_table<src0_t>::to_f32;
-    constexpr auto src1_to_f32 = type_conversion_table<src1_t>::to_f32;
-    constexpr auto f32_to_dst  = type_conversion_table<dst_t >::from_f32;
+    if constexpr (std::is_same_v<src0_t, float> && std::is_same_v<src1_t, float> && std::is_same_v<dst_t, float>) {
+        vec_binary_op_f32<op>(n, z, x, y);
+    } else {
+        float x_tile[GGML_ELEMENTWISE_TILE];
+        float y_tile[GGML_ELEMENTWISE_TILE];
+        float z_tile[GGML_ELEMENTWISE_TILE];
+
+        for (int64_t i0 = 0; i0 < n; i0 += GGML_ELEMENTWISE_TILE) {
+            const int64_t nt = MIN(GGML_ELEMENTWISE_TILE, n - i0);
 
-    for (int i = 0; i < n; i++) {
-        z[i] = f32_to_dst(op(src0_to_f32(x[i]), src1_to_f32(y[i])));
+            float * zf = tile_f32_dst(z + i0, z_tile);
+            vec_binary_op_f32<op>(nt, zf, tile_to_f32(x + i0, x_tile, nt), tile_to_f32(y + i0, y_tile, nt));
+            tile_from_f32(zf, z + i0, nt);
+        }
     }
 }
 
+// src1 is a single value broadcast over the row
+template <float (*op)(float, float), typename src0_t, typename dst_t>
+static inline void vec_binary_op_scalar(const int64_t n, dst_t * z, const src0_t * x, const float y) {
+    if constexpr (std::is_same_v<src0_t, float> && std::is_same_v<dst_t, float>) {
+        vec_binary_op_scalar_f32<op>(n, z, x, y);
+    } else {
+        float x_tile[GGML_ELEMENTWISE_TILE];
+        float z_tile[GGML_ELEMENTWISE_TILE];
+
+        for (int64_t i0 = 0; i0 < n; i0 += GGML_ELEMENTWISE_TILE) {
+            const int64_t nt = MIN(GGML_ELEMENTWISE_TILE, n - i0);
+
+            float * zf = tile_f32_dst(z + i0, z_tile);
+            vec_binary_op_scalar_f32<op>(nt, zf, tile_to_f32(x + i0, x_tile, nt), y);
+            tile_from_f32(zf, z + i0, nt);
+        }
+    }
+}
+
+// src1 has the same shape as src0 but strided rows
 template <float (*op)(float, float), typename src0_t, typename src1_t, typename dst_t>
-static inline void vec_binary_op_non_contiguous(const int64_t n, const int64_t ne10, const int64_t nb10, dst_t * z, const src0_t * x, const src1_t * y) {
+static inline void vec_binary_op_non_contiguous(const int64_t n, const int64_t nb10, dst_t * z, const src0_t * x, const src1_t * y) {
     constexpr auto src0_to_f32 = type_conversion_table<src0_t>::to_f32;
     constexpr auto src1_to_f32 = type_conversion_table<src1_t>::to_f32;
     constexpr auto f32_to_dst  = type_conversion_table<dst_t >::from_f32;
 
-    for (int i = 0; i < n; i++) {
-        int i10 = i % ne10;
-        const src1_t * y_ptr = (const src1_t *)((const char *)y + i10*nb10);
+    for (int64_t i = 0; i < n; i++) {
+        const src1_t * y_ptr = (const src1_t *)((const char *)y + i*nb10);
         z[i] = f32_to_dst(op(src0_to_f32(x[i]), src1_to_f32(*y_ptr)));
     }
 }
@@ -81,20 +123,26 @@ static void apply_binary_op(const ggml_compute_params * params, ggml_tensor * ds
     }
 #endif
 
+    // the same src1 row for every row of src0 (bias, norm weight): no index math per row
+    const bool src1_is_row = ne11 == 1 && ne12 == 1 && ne13 == 1;
+
     for (int64_t ir = ir0; ir < ir1; ++ir) {
         const int64_t i03 = ir/(ne02*ne01);
         const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
         const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-        const int64_t i13 = i03 % ne13;
-        const int64_t i12 = i02 % ne12;
-        const int64_t i11 = i01 % ne11;
+        const int64_t i13 = src1_is_row ? 0 : i03 % ne13;
+        const int64_t i12 = src1_is_row ? 0 : i02 % ne12;
+        const int64_t i11 = src1_is_row ? 0 : i01 % ne11;
 
         dst_t        * dst_ptr  = (dst_t  *)       ((char *)       dst->data  + i03*nb3  + i02*nb2  + i01*nb1 );
         const src0_t * src0_ptr = (const src0_t *) ((const char *) src0->data + i03*nb03 + i02*nb02 + i01*nb01);
         const src1_t * src1_ptr = (const src1_t *) ((const char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11);
 
-        if (is_src1_contiguous) {
+        if (is_src1_contiguous && ne10 == 1) {
+            // a single src1 value per row
+            vec_binary_op_scalar<op>(ne00, dst_ptr, src0_ptr, type_conversion_table<src1_t>::to_f32(*src1_ptr));
+        } else if (is_src1_contiguous) {
             // src1 is broadcastable across src0 and dst in i1, i2, i3
             const int64_t nr0 = ne00 / ne10;
 
@@ -110,7 +158,7 @@ static void apply_binary_op(const ggml_compute_params * params, ggml_tensor * ds
                 vec_binary_op_contiguous<op>(ne10, dst_ptr + r*ne10, src0_ptr + r*ne10, src1_ptr);
             }
         } else {
-            vec_binary_op_non_contiguous<op>(ne0, ne10, nb10, dst_ptr, src0_ptr, src1_ptr);
+            vec_binary_op_non_contiguous<op>(ne0, nb10, dst_ptr, src0_ptr, src1_ptr);
         }
     }
 }
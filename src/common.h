@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ggml.h"
+#include "ggml-cpu.h"
 #include "traits.h"
 #include "ggml-cpu-impl.h"
 #include "ggml-impl.h"
@@ -8,6 +9,8 @@
 
 #ifdef __cplusplus
 
+#include <cstring>
+#include <type_traits>
 #include <utility>
 
 // convenience functions/macros for use in template calls
@@ -40,6 +43,10 @@ static inline float f32_to_f32(float x) {
     return x;
 }
 
+static inline void f32_to_f32_row(const float * x, float * y, int64_t n) {
+    memcpy(y, x, n*sizeof(float));
+}
+
 // TODO - merge this into the traits table, after using row-based conversions
 template <class T>
 struct type_conversion_table;
@@ -48,18 +55,24 @@ template <>
 struct type_conversion_table<ggml_fp16_t> {
     static constexpr float (*to_f32)(ggml_fp16_t) = f16_to_f32;
     static constexpr ggml_fp16_t (*from_f32)(float) = f32_to_f16;
+    static constexpr void (*row_to_f32)(const ggml_fp16_t *, float *, int64_t) = ggml_cpu_fp16_to_fp32;
+    static constexpr void (*row_from_f32)(const float *, ggml_fp16_t *, int64_t) = ggml_cpu_fp32_to_fp16;
 };
 
 template <>
 struct type_conversion_table<float> {
     static constexpr float (*to_f32)(float) = f32_to_f32;
     static constexpr float (*from_f32)(float) = f32_to_f32;
+    static constexpr void (*row_to_f32)(const float *, float *, int64_t) = f32_to_f32_row;
+    static constexpr void (*row_from_f32)(const float *, float *, int64_t) = f32_to_f32_row;
 };
 
 template <>
 struct type_conversion_table<ggml_bf16_t> {
     static constexpr float (*to_f32)(ggml_bf16_t) = bf16_to_f32;
     static constexpr ggml_bf16_t (*from_f32)(float) = f32_to_bf16;
+    static constexpr void (*row_to_f32)(const ggml_bf16_t *, float *, int64_t) = ggml_cpu_bf16_to_fp32;
+    static constexpr void (*row_from_f32)(const float *, ggml_bf16_t *, int64_t) = ggml_cpu_fp32_to_bf16;
 };
 
 template <>
@@ -68,6 +81,46 @@ struct type_conversion_table<int32_t> {
     static constexpr int32_t (*from_f32)(float) = f32_to_i32;
 };
 
+// elementwise ops on f16/bf16 convert tiles of this many elements with the (SIMD) row converters
+// and run the f32 math on the tile, which the compiler can vectorize
+static constexpr int64_t GGML_ELEMENTWISE_TILE = 256;
+
+// returns x converted to f32 in tmp, or x itself when it is already f32
+template <typename T>
+static inline const float * tile_to_f32(const T * x, float * tmp, int64_t n) {
+    if constexpr (std::is_same_v<T, float>) {
+        GGML_UNUSED(tmp);
+        GGML_UNUSED(n);
+        return x;
+    } else {
+        type_conversion_table<T>::row_to_f32(x, tmp, n);
+        return tmp;
+    }
+}
+
+// returns the f32 buffer to compute a tile of y into: y itself when it is f32, tmp otherwise (see tile_from_f32)
+template <typename T>
+static inline float * tile_f32_dst(T * y, float * tmp) {
+    if constexpr (std::is_same_v<T, float>) {
+        GGML_UNUSED(tmp);
+        return y;
+    } else {
+        GGML_UNUSED(y);
+        return tmp;
+    }
+}
+
+template <typename T>
+static inline void tile_from_f32(const float * tmp, T * y, int64_t n) {
+    if constexpr (std::is_same_v<T, float>) {
+        GGML_UNUSED(tmp);
+        GGML_UNUSED(y);
+        GGML_UNUSED(n);
+    } else {
+        type_conversion_table<T>::row_from_f32(tmp, y, n);
+    }
+}
+
 static std::pair<int64_t, int64_t> get_thread_range(const struct ggml_compute_params * params, const struct ggml_tensor * src0) {
     const int64_t ith = params->ith;
     const int64_t nth = params->nth;
@@ -1829,6 +1829,14 @@ size_t ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backe
     return ggml_gallocr_get_buffer_size(sched->galloc, backend_index);
 }
 
+size_t ggml_backend_sched_get_buffer_hugepage_size(ggml_backend_sched_t sched, ggml_backend_t backend) {
+    GGML_ASSERT(sched);
+    int backend_index = ggml_backend_sched_backend_id(sched, backend);
+    GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
+
+    return ggml_gallocr_get_buffer_hugepage_size(sched->galloc, backend_index);
+}
+
 void ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend) {
     GGML_ASSERT(sched);
     int backend_index = ggml_backend_sched_backend_id(sched, backend);
@@ -2158,6 +2166,48 @@ static const struct ggml_backend_buffer_i ggml_backend_cpu_buffer_from_ptr_i = {
     /* .reset           = */ NULL,
 };
 
+// CPU buffer backed by huge pages
+
+struct ggml_backend_cpu_hugepage_buffer_context {
+    void * data;
+    size_t mapped_size;
+};
+
+static void * ggml_backend_cpu_hugepage_buffer_get_base(ggml_backend_buffer_t buffer) {
+    return ((ggml_backend_cpu_hugepage_buffer_context *) buffer->context)->data;
+}
+
+static void ggml_backend_cpu_hugepage_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    GGML_ASSERT(buffer);
+    auto * ctx = (ggml_backend_cpu_hugepage_buffer_context *) buffer->context;
+    ggml_hugepage_free(ctx->data, ctx->mapped_size);
+    delete ctx;
+}
+
+static void ggml_backend_cpu_hugepage_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
+    GGML_ASSERT(buffer);
+    memset(ggml_backend_cpu_hugepage_buffer_get_base(buffer), value, buffer->size);
+}
+
+static const struct ggml_backend_buffer_i ggml_backend_cpu_hugepage_buffer_i = {
+    /* .free_buffer     = */ ggml_backend_cpu_hugepage_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_cpu_hugepage_buffer_get_base,
+    /* .init_tensor     = */ NULL, // no initialization required
+    /* .memset_tensor   = */ ggml_backend_cpu_buffer_memset_tensor,
+    /* .set_tensor      = */ ggml_backend_cpu_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_cpu_buffer_get_tensor,
+    /* .cpy_tensor      = */ ggml_backend_cpu_buffer_cpy_tensor,
+    /* .clear           = */ ggml_backend_cpu_hugepage_buffer_clear,
+    /* .reset           = */ NULL,
+};
+
+size_t ggml_backend_cpu_buffer_hugepage_size(ggml_backend_buffer_t buffer) {
+    if (!ggml_backend_buffer_is_host(buffer) || buffer->size == 0) {
+        return 0;
+    }
+    return ggml_hugepage_bytes(ggml_backend_buffer_get_base(buffer), buffer->size);
+}
+
 // CPU backend buffer type
 
 // this buffer type is defined here to make it available to all backends
@@ -2169,6 +2219,12 @@ static const char * ggml_backend_cpu_buffer_type_get_name(ggml_backend_buffer_ty
 }
 
 static ggml_backend_buffer_t ggml_backend_cpu_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    size_t mapped_size = 0;
+    if (void * hp_data = ggml_hugepage_malloc(size, &mapped_size)) {
+        auto * ctx = new ggml_backend_cpu_hugepage_buffer_context { hp_data, mapped_size };
+        return ggml_backend_buffer_init(buft, ggml_backend_cpu_hugepage_buffer_i, ctx, size);
+    }
+
     void * data = ggml_aligned_malloc(size);
 
     if (data == NULL) {
@@ -36,6 +36,8 @@
 #include <signal.h>
 #if defined(__gnu_linux__)
 #include <syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 #endif
 
 #ifdef GGML_USE_OPENMP
@@ -440,6 +442,33 @@ typedef pthread_mutex_t    ggml_mutex_t;
 
 #endif
 
+// Arrival counter of one node of the combining-tree barrier
+struct GGML_CACHE_ALIGN ggml_barrier_node {
+    atomic_int count;
+};
+
+// Range of chunks [next, end) owned by one thread
+// The owner takes chunks from the front, idle threads steal from the same end once their own range is drained
+struct GGML_CACHE_ALIGN ggml_chunk_queue {
+    atomic_int next;
+    int        end;
+};
+
+// Unit of the level schedule: a node together with the nodes fused into it
+// It runs on threads [ith0, ith0 + nth) of the pool
+struct ggml_cpu_unit {
+    int node_n;
+    int n_fused;
+    int ith0;
+    int nth;
+};
+
+// Level of the level schedule: units [unit_start, unit_end) touch disjoint memory and run concurrently
+struct ggml_cpu_level {
+    int unit_start;
+    int unit_end;
+};
+
 // Threadpool def
 struct ggml_threadpool {
     ggml_mutex_t mutex;       // mutex for cond.var
@@ -453,6 +482,25 @@ struct ggml_threadpool {
     atomic_int GGML_CACHE_ALIGN n_barrier;
     atomic_int GGML_CACHE_ALIGN n_barrier_passed;
     atomic_int GGML_CACHE_ALIGN current_chunk; // currently processing chunk during Mat_Mul, shared between all the threads.
+    atomic_int GGML_CACHE_ALIGN n_barrier_sleepers; // threads sleeping in ggml_barrier (GGML_CPU_BARRIER_WAIT=hybrid)
+    atomic_int barrier_spin;  // current spin budget of ggml_barrier before sleeping, adapted at runtime
+
+    struct ggml_barrier_node * barrier_nodes; // arrival counters of the combining tree (GGML_CPU_BARRIER=tree)
+    struct ggml_chunk_queue  * chunk_queues;  // per-thread chunk ranges (GGML_CPU_CHUNK_SCHED=steal)
+
+    // mul_mat src1 currently quantized in the shared region of the work buffer (see ggml_cplan.work_size_mm)
+    // sibling mul_mats with the same src1 and vec_dot_type (e.g. Q/K/V, gate/up) reuse it instead of quantizing again
+    const struct ggml_tensor * mm_src1;
+    enum ggml_type             mm_src1_type;
+
+    // level schedule of the current graph (see ggml_graph_compute_levels), rebuilt by ggml_graph_compute
+    struct ggml_cpu_level * levels;
+    struct ggml_cpu_unit  * units;
+    int    n_levels;          // 0 - run the nodes one by one
+    int    levels_cap;        // capacity of levels and units, in nodes
+    size_t level_wslice;      // bytes of the work buffer owned by each thread within a level
+    uint64_t levels_graph_id; // ggml_cplan.graph_id the schedule was built for, 0 - none
+    int    levels_n_threads;
 
     // these are atomic as an annotation for thread-sanitizer
     atomic_bool stop;         // Used for stopping the threadpool altogether
@@ -523,12 +571,150 @@ struct ggml_numa_nodes {
 // ggml state
 //
 
+enum ggml_cpu_barrier_type {
+    GGML_CPU_BARRIER_COUNTER, // single shared arrival counter
+    GGML_CPU_BARRIER_TREE,    // combining tree of arrival counters
+};
+
+enum ggml_cpu_chunk_sched {
+    GGML_CPU_CHUNK_SCHED_SHARED, // all threads take chunks from tp->current_chunk
+    GGML_CPU_CHUNK_SCHED_STEAL,  // each thread owns a range of chunks, idle threads steal from the others
+};
+
 struct ggml_state {
     struct ggml_numa_nodes numa;
+
+    bool disable_fusion;
+
+    enum ggml_cpu_barrier_type barrier;
+    enum ggml_cpu_chunk_sched  chunk_sched;
+    bool barrier_sleep; // sleep in ggml_barrier after spinning for tp->barrier_spin rounds
+    int  barrier_spin;  // initial spin budget
+    bool levels;        // run independent nodes concurrently on disjoint groups of threads
 };
 
 static struct ggml_state g_state = {0};
 
+#define GGML_BARRIER_TREE_FANIN 4
+#define GGML_BARRIER_SPIN_MIN   (1 << 8)
+#define GGML_BARRIER_SPIN_MAX   (1 << 20)
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define GGML_THREAD_LOCAL __declspec(thread)
+#else
+#define GGML_THREAD_LOCAL _Thread_local
+#endif
+
+// index of the calling thread in the threadpool, used to find its leaf in the combining-tree barrier
+static GGML_THREAD_LOCAL int ggml_barrier_ith = 0;
+
+#if defined(__gnu_linux__)
+static void ggml_futex_wait(atomic_int * addr, int val) {
+    syscall(SYS_futex, (int *) addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void ggml_futex_wake_all(atomic_int * addr) {
+    syscall(SYS_futex, (int *) addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#else
+// no futex: sleeping threads yield their time slice and poll again
+static void ggml_futex_wait(atomic_int * addr, int val) {
+    UNUSED(addr);
+    UNUSED(val);
+    sched_yield();
+}
+
+static void ggml_futex_wake_all(atomic_int * addr) {
+    UNUSED(addr);
+}
+#endif
+
+// returns true for the last thread to arrive
+static bool ggml_barrier_counter_arrive(struct ggml_threadpool * tp, int n_threads) {
+    // enter barrier (full seq-cst fence)
+    int n_barrier = atomic_fetch_add_explicit(&tp->n_barrier, 1, memory_order_seq_cst);
+
+    if (n_barrier == (n_threads - 1)) {
+        // last thread
+        atomic_store_explicit(&tp->n_barrier, 0, memory_order_relaxed);
+        return true;
+    }
+
+    return false;
+}
+
+// threads arrive in groups of GGML_BARRIER_TREE_FANIN, the last one of each group moves up a level
+// so no counter is ever shared by more than GGML_BARRIER_TREE_FANIN threads
+static bool ggml_barrier_tree_arrive(struct ggml_threadpool * tp, int n_threads) {
+    int idx  = ggml_barrier_ith; // index within the current level
+    int n    = n_threads;        // number of arrivals at the current level
+    int base = 0;                // first node of the current level
+
+    while (n > 1) {
+        const int node     = idx / GGML_BARRIER_TREE_FANIN;
+        const int n_nodes  = (n + GGML_BARRIER_TREE_FANIN - 1) / GGML_BARRIER_TREE_FANIN;
+        const int n_arrive = MIN(GGML_BARRIER_TREE_FANIN, n - node*GGML_BARRIER_TREE_FANIN);
+
+        atomic_int * count = &tp->barrier_nodes[base + node].count;
+
+        if (atomic_fetch_add_explicit(count, 1, memory_order_seq_cst) != n_arrive - 1) {
+            return false;
+        }
+
+        // last of the group: nobody touches this node again until the barrier is released
+        atomic_store_explicit(count, 0, memory_order_relaxed);
+
+        base += n_nodes;
+        idx   = node;
+        n     = n_nodes;
+    }
+
+    return true;
+}
+
+static void ggml_barrier_release(struct ggml_threadpool * tp) {
+    // exit barrier (fill seq-cst fence)
+    atomic_fetch_add_explicit(&tp->n_barrier_passed, 1, memory_order_seq_cst);
+
+    if (g_state.barrier_sleep && atomic_load_explicit(&tp->n_barrier_sleepers, memory_order_seq_cst) > 0) {
+        ggml_futex_wake_all(&tp->n_barrier_passed);
+    }
+}
+
+static void ggml_barrier_wait(struct ggml_threadpool * tp, int n_passed) {
+    if (!g_state.barrier_sleep) {
+        while (atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed) == n_passed) {
+            ggml_thread_cpu_relax();
+        }
+        return;
+    }
+
+    // spin first, the budget grows when the barrier is released late in the spin and shrinks when we end up sleeping
+    const int n_spin = atomic_load_explicit(&tp->barrier_spin, memory_order_relaxed);
+
+    for (int i = 0; i < n_spin; i++) {
+        if (atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed) != n_passed) {
+            if (i > n_spin/2 && n_spin < GGML_BARRIER_SPIN_MAX) {
+                atomic_store_explicit(&tp->barrier_spin, n_spin*2, memory_order_relaxed);
+            }
+            return;
+        }
+        ggml_thread_cpu_relax();
+    }
+
+    if (n_spin > GGML_BARRIER_SPIN_MIN) {
+        atomic_store_explicit(&tp->barrier_spin, n_spin/2, memory_order_relaxed);
+    }
+
+    atomic_fetch_add_explicit(&tp->n_barrier_sleepers, 1, memory_order_seq_cst);
+
+    while (atomic_load_explicit(&tp->n_barrier_passed, memory_order_seq_cst) == n_passed) {
+        ggml_futex_wait(&tp->n_barrier_passed, n_passed);
+    }
+
+    atomic_fetch_add_explicit(&tp->n_barrier_sleepers, -1, memory_order_seq_cst);
+}
+
 void ggml_barrier(struct ggml_threadpool * tp) {
     int n_threads = atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed);
     if (n_threads == 1) {
@@ -540,22 +726,17 @@ void ggml_barrier(struct ggml_threadpool * tp) {
 #else
     int n_passed = atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed);
 
-    // enter barrier (full seq-cst fence)
-    int n_barrier = atomic_fetch_add_explicit(&tp->n_barrier, 1, memory_order_seq_cst);
-
-    if (n_barrier == (n_threads - 1)) {
-        // last thread
-        atomic_store_explicit(&tp->n_barrier, 0, memory_order_relaxed);
+    const bool last = g_state.barrier == GGML_CPU_BARRIER_TREE
+        ? ggml_barrier_tree_arrive(tp, n_threads)
+        : ggml_barrier_counter_arrive(tp, n_threads);
 
-        // exit barrier (fill seq-cst fence)
-        atomic_fetch_add_explicit(&tp->n_barrier_passed, 1, memory_order_seq_cst);
+    if (last) {
+        ggml_barrier_release(tp);
         return;
     }
 
     // wait for other threads
-    while (atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed) == n_passed) {
-        ggml_thread_cpu_relax();
-    }
+    ggml_barrier_wait(tp, n_passed);
 
     // exit barrier (full seq-cst fence)
     // TSAN doesn't support standalone fence yet, we use a dummy read-modify-write instead
@@ -575,6 +756,55 @@ int ggml_threadpool_chunk_add(struct ggml_threadpool * tp, int value) {
     return atomic_fetch_add_explicit(&tp->current_chunk, value, memory_order_relaxed);
 }
 
+// Chunk scheduling for the mul_mat loops
+// ggml_chunk_sched_init must be called by every thread before the barrier that precedes the first ggml_chunk_sched_next
+static void ggml_chunk_sched_init(struct ggml_threadpool * tp, int ith, int nth, int n_chunks) {
+    if (g_state.chunk_sched == GGML_CPU_CHUNK_SCHED_STEAL) {
+        struct ggml_chunk_queue * q = &tp->chunk_queues[ith];
+
+        atomic_store_explicit(&q->next, (int) (((int64_t) n_chunks*ith)/nth), memory_order_relaxed);
+        q->end = (int) (((int64_t) n_chunks*(ith + 1))/nth);
+    } else if (ith == 0) {
+        // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
+        atomic_store_explicit(&tp->current_chunk, nth, memory_order_relaxed);
+    }
+}
+
+// returns the next chunk for thread ith, or -1 when all chunks have been taken
+// *state must be 0 on the first call
+static int ggml_chunk_sched_next(struct ggml_threadpool * tp, int ith, int nth, int n_chunks, int * state) {
+    if (g_state.chunk_sched == GGML_CPU_CHUNK_SCHED_STEAL) {
+        // drain our own range first, then the ranges of the threads that follow us
+        for (; *state < nth; (*state)++) {
+            struct ggml_chunk_queue * q = &tp->chunk_queues[(ith + *state) % nth];
+
+            if (atomic_load_explicit(&q->next, memory_order_relaxed) >= q->end) {
+                continue;
+            }
+
+            const int chunk = atomic_fetch_add_explicit(&q->next, 1, memory_order_relaxed);
+            if (chunk < q->end) {
+                return chunk;
+            }
+        }
+        return -1;
+    }
+
+    int chunk;
+
+    if (*state == 0) {
+        // The first chunk comes from our thread_id, the rest will get auto-assigned.
+        *state = 1;
+        chunk  = ith;
+    } else if (nth >= n_chunks) {
+        return -1;
+    } else {
+        chunk = atomic_fetch_add_explicit(&tp->current_chunk, 1, memory_order_relaxed);
+    }
+
+    return chunk < n_chunks ? chunk : -1;
+}
+
 #if defined(__gnu_linux__)
 static cpu_set_t ggml_get_numa_affinity(void) {
     cpu_set_t cpuset;
@@ -682,6 +912,98 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// With GGML_NUMA_STRATEGY_DISTRIBUTE thread ith runs on node ith % n_nodes (see set_numa_thread_affinity).
+// The rows of each src0 matrix are split in n_nodes contiguous slices: the pages of slice k are placed on node k
+// by ggml_numa_shard_tensor and the mul_mat rows of slice k are only handed to the threads of node k.
+static bool ggml_numa_is_distributed(void) {
+    return ggml_is_numa() && g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_DISTRIBUTE;
+}
+
+static void ggml_numa_node_rows(int64_t nr, int node, int64_t * ir_start, int64_t * ir_end) {
+    const int n_nodes = g_state.numa.n_nodes;
+
+    *ir_start = (nr*node)/n_nodes;
+    *ir_end   = (nr*(node + 1))/n_nodes;
+}
+
+// rows of the node-local slice of nr rows processed by thread ith, false if the rows are not distributed
+static bool ggml_numa_thread_rows(int64_t nr, int ith, int nth, int64_t * ir_start, int64_t * ir_end) {
+    const int n_nodes = g_state.numa.n_nodes;
+
+    if (!ggml_numa_is_distributed() || nth < n_nodes) {
+        return false;
+    }
+
+    const int node = ith % n_nodes;
+    const int j    = ith / n_nodes;                   // index of the thread on its node
+    const int nj   = (nth - node + n_nodes - 1)/n_nodes; // number of threads on the node
+
+    int64_t node_start;
+    int64_t node_end;
+    ggml_numa_node_rows(nr, node, &node_start, &node_end);
+
+    const int64_t n = node_end - node_start;
+
+    *ir_start = node_start + (n*j)/nj;
+    *ir_end   = node_start + (n*(j + 1))/nj;
+
+    return true;
+}
+
+bool ggml_numa_shard_tensor(const struct ggml_tensor * tensor) {
+#if defined(__gnu_linux__)
+    if (!ggml_numa_is_distributed() || tensor->data == NULL || ggml_n_dims(tensor) < 2 || !ggml_is_contiguous(tensor)) {
+        return false;
+    }
+
+    const int     n_nodes   = g_state.numa.n_nodes;
+    const int64_t page_size = sysconf(_SC_PAGESIZE);
+
+    // not worth it for tensors that fit in a few pages per node
+    if (ggml_nbytes(tensor) < (size_t) (n_nodes*page_size*16)) {
+        return false;
+    }
+
+    const int64_t ne01 = tensor->ne[1];
+    const size_t  nb01 = tensor->nb[1];
+
+    for (int64_t i03 = 0; i03 < tensor->ne[3]; i03++) {
+        for (int64_t i02 = 0; i02 < tensor->ne[2]; i02++) {
+            const uintptr_t base = (uintptr_t) tensor->data + i02*tensor->nb[2] + i03*tensor->nb[3];
+
+            for (int node = 0; node < n_nodes; node++) {
+                int64_t ir_start;
+                int64_t ir_end;
+                ggml_numa_node_rows(ne01, node, &ir_start, &ir_end);
+
+                // pages straddling two slices go to the node of the lower slice
+                const uintptr_t mask = ~(uintptr_t) (page_size - 1);
+
+                const uintptr_t first = node == 0 ? base & mask : (base + ir_start*nb01 + page_size - 1) & mask;
+                const uintptr_t last  = (base + ir_end*nb01 + page_size - 1) & mask;
+
+                if (last <= first) {
+                    continue;
+                }
+
+                unsigned long nodemask = 1UL << node;
+
+                // MPOL_MF_MOVE also migrates the pages that were already faulted in while loading
+                if (syscall(SYS_mbind, (void *) first, last - first, MPOL_PREFERRED, &nodemask, sizeof(nodemask)*8, MPOL_MF_MOVE) != 0) {
+                    GGML_LOG_DEBUG("%s: mbind failed for %s: %s\n", __func__, tensor->name, strerror(errno));
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+#else
+    UNUSED(tensor);
+    return false;
+#endif
+}
+
 #if defined(__ARM_ARCH)
 
 #if defined(__linux__) && defined(__aarch64__)
@@ -1113,7 +1435,7 @@ void ggml_set_f32_nd(const struct ggml_tensor * tensor, int i0, int i1, int i2,
 // ggml_compute_forward_mul_mat
 
 static void ggml_compute_forward_mul_mat_one_chunk(
-    const struct ggml_compute_params * params,
+    const void * wdata_src1,
     struct ggml_tensor * dst,
     const enum ggml_type type,
     const int64_t num_rows_per_vec_dot,
@@ -1143,7 +1465,7 @@ static void ggml_compute_forward_mul_mat_one_chunk(
         return;
     }
 
-    const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const void * wdata = (src1->type == vec_dot_type) ? src1->data : wdata_src1;
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
     assert(ne12 % ne02 == 0);
@@ -1202,9 +1524,38 @@ static void ggml_compute_forward_mul_mat_one_chunk(
     }
 }
 
-void ggml_compute_forward_mul_mat(
+// fused swiglu epilogue: applies glu to the [ir0_start, ir0_end) x [ir1_start, ir1_end) tile of the mul_mat result
+// the other glu operand has been fully computed by an earlier node
+static void ggml_compute_forward_mul_mat_glu_chunk(
+    const struct ggml_tensor * dst,
+    struct ggml_tensor * glu,
+    const int64_t ir0_start,
+    const int64_t ir0_end,
+    const int64_t ir1_start,
+    const int64_t ir1_end) {
+
+    const float * x = (const float *) glu->src[0]->data;
+    const float * g = (const float *) glu->src[1]->data;
+          float * y = (float *) glu->data;
+
+    const int64_t ne0 = dst->ne[0];
+
+    for (int64_t ir1 = ir1_start; ir1 < ir1_end; ++ir1) {
+        const int64_t offs = ir1*ne0 + ir0_start;
+
+        ggml_vec_swiglu_f32(ir0_end - ir0_start, y + offs, x + offs, g + offs);
+    }
+}
+
+// src1 is converted to vec_dot_type into wdata_src1
+// with share_src1, wdata_src1 is the shared region of the work buffer and a conversion left there
+// by a previous mul_mat with the same src1 is reused
+static void ggml_compute_forward_mul_mat_impl(
         const struct ggml_compute_params * params,
-              struct ggml_tensor * dst) {
+              struct ggml_tensor * dst,
+              struct ggml_tensor * glu,
+                            void * wdata_src1,
+                            bool   share_src1) {
 
     const struct ggml_tensor * src0 = dst->src[0];
     const struct ggml_tensor * src1 = dst->src[1];
@@ -1264,15 +1615,18 @@ void ggml_compute_forward_mul_mat(
 UseGgmlGemm1:;
 #endif
 
-    if (src1->type != vec_dot_type) {
-        char * wdata = params->wdata;
+    struct ggml_threadpool * tp = params->threadpool;
+
+    const bool src1_ready = share_src1 && tp->mm_src1 == src1 && tp->mm_src1_type == vec_dot_type;
+
+    if (src1->type != vec_dot_type && !src1_ready) {
+        char * wdata = wdata_src1;
 
         const size_t nbw0 = ggml_type_size(vec_dot_type);
         const size_t nbw1 = ggml_row_size(vec_dot_type, ne10);
         const size_t nbw2 = nbw1*ne11;
         const size_t nbw3 = nbw2*ne12;
 
-        assert(params->wsize >= ne13*nbw3);
         GGML_ASSERT(src1->type == GGML_TYPE_F32);
 
     #if 0
@@ -1301,37 +1655,6 @@ UseGgmlGemm1:;
     #endif
     }
 
-    if (ith == 0) {
-        // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-        atomic_store_explicit(&params->threadpool->current_chunk, nth, memory_order_relaxed);
-    }
-
-    ggml_barrier(params->threadpool);
-
-#if GGML_USE_LLAMAFILE
-    if (src1->type != vec_dot_type) {
-        const void* wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
-        const size_t row_size = ggml_row_size(vec_dot_type, ne10);
-
-        for (int64_t i13 = 0; i13 < ne13; i13++)
-            for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(params,
-                                     ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
-                                     nb01/ggml_type_size(src0->type),
-                                     (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
-                                     row_size/ggml_type_size(vec_dot_type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
-                                     nb1/ggml_type_size(dst->type),
-                                     src0->type,
-                                     vec_dot_type,
-                                     dst->type))
-                    goto UseGgmlGemm2;
-        return;
-    }
-UseGgmlGemm2:;
-#endif
-
     // This is the size of the first dimension of the result, so we can iterate that way. (see the ASSERT above, these are the same numbers)
     const int64_t nr0 = ne0;
 
@@ -1365,10 +1688,65 @@ UseGgmlGemm2:;
     const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
     const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
-    // The first chunk comes from our thread_id, the rest will get auto-assigned.
-    int current_chunk = ith;
+    ggml_chunk_sched_init(params->threadpool, ith, nth, nchunk0*nchunk1);
+
+    ggml_barrier(params->threadpool);
+
+    if (share_src1 && src1->type != vec_dot_type && ith == 0) {
+        // all threads have checked tp->mm_src1 before the barrier above
+        tp->mm_src1      = src1;
+        tp->mm_src1_type = vec_dot_type;
+    }
+
+#if GGML_USE_LLAMAFILE
+    if (src1->type != vec_dot_type) {
+        const void* wdata = (src1->type == vec_dot_type) ? src1->data : wdata_src1;
+        const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
-    while (current_chunk < nchunk0 * nchunk1) {
+        for (int64_t i13 = 0; i13 < ne13; i13++)
+            for (int64_t i12 = 0; i12 < ne12; i12++)
+                if (!llamafile_sgemm(params,
+                                     ne01, ne11, ne00/ggml_blck_size(src0->type),
+                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                                     nb01/ggml_type_size(src0->type),
+                                     (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
+                                     row_size/ggml_type_size(vec_dot_type),
+                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     nb1/ggml_type_size(dst->type),
+                                     src0->type,
+                                     vec_dot_type,
+                                     dst->type))
+                    goto UseGgmlGemm2;
+        return;
+    }
+UseGgmlGemm2:;
+#endif
+
+    {
+        int64_t ir0_start;
+        int64_t ir0_end;
+
+        if (nr0 > nr1 && ggml_numa_thread_rows(nr0, ith, nth, &ir0_start, &ir0_end)) {
+            // the src0 rows of this thread are on its node
+            int64_t num_rows_per_vec_dot = vec_dot_num_rows;
+            if ((nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || (nr1 % 2 != 0)) {
+                num_rows_per_vec_dot = 1;
+            }
+            if (ir0_start < ir0_end) {
+                ggml_compute_forward_mul_mat_one_chunk(wdata_src1, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, 0, nr1);
+
+                if (glu) {
+                    ggml_compute_forward_mul_mat_glu_chunk(dst, glu, ir0_start, ir0_end, 0, nr1);
+                }
+            }
+            return;
+        }
+    }
+
+    int sched_state = 0;
+    int current_chunk;
+
+    while ((current_chunk = ggml_chunk_sched_next(params->threadpool, ith, nth, nchunk0*nchunk1, &sched_state)) >= 0) {
         const int64_t ith0 = current_chunk % nchunk0;
         const int64_t ith1 = current_chunk / nchunk0;
 
@@ -1386,16 +1764,27 @@ UseGgmlGemm2:;
         if ((nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || ((ir1_end - ir1_start) % 2 != 0)) {
             num_rows_per_vec_dot = 1;
         }
-        ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
+        ggml_compute_forward_mul_mat_one_chunk(wdata_src1, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
 
-        if (nth >= nchunk0 * nchunk1) {
-            break;
+        if (glu) {
+            ggml_compute_forward_mul_mat_glu_chunk(dst, glu, ir0_start, ir0_end, ir1_start, ir1_end);
         }
-
-        current_chunk = atomic_fetch_add_explicit(&params->threadpool->current_chunk, 1, memory_order_relaxed);
     }
 }
 
+void ggml_compute_forward_mul_mat(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+    ggml_compute_forward_mul_mat_impl(params, dst, NULL, params->wdata, false);
+}
+
+// mul_mat node of the graph: src1 is converted into the shared region at the end of the work buffer
+static void * ggml_compute_forward_mul_mat_src1_wdata(const struct ggml_compute_params * params) {
+    const struct ggml_cplan * cplan = params->threadpool->cplan;
+
+    return (char *) params->wdata + (cplan->work_size - cplan->work_size_mm);
+}
+
 // ggml_compute_forward_mul_mat_id
 
 #define MMID_MATRIX_ROW(row_id, i1) matrix_rows[(row_id)*ids->ne[0]*ids->ne[1] + (i1)]
@@ -1408,7 +1797,6 @@ struct mmid_row_mapping {
 static void ggml_compute_forward_mul_mat_id_one_chunk(
     struct ggml_tensor * dst,
     const struct ggml_tensor * src0,
-    const struct ggml_tensor * src1,
     const struct ggml_tensor * ids,
     const int64_t cur_a,
     const int64_t ir0_start,
@@ -1418,15 +1806,15 @@ static void ggml_compute_forward_mul_mat_id_one_chunk(
     const char * src0_cur,
     const struct mmid_row_mapping * matrix_rows,
     const size_t row_size,
-    const bool src1_cont,
-    const void * wdata) {
+    const char * src1_cur) {
 
-    GGML_TENSOR_BINARY_OP_LOCALS
+    GGML_TENSOR_LOCALS(int64_t, ne0, src0, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb0, src0, nb)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst,  nb)
 
     const enum ggml_type type = src0->type;
 
     ggml_vec_dot_t    const vec_dot      = type_traits_cpu[type].vec_dot;
-    enum ggml_type    const vec_dot_type = type_traits_cpu[type].vec_dot_type;
 
     const int64_t blck_0 = 16;
     const int64_t blck_1 = 16;
@@ -1441,20 +1829,11 @@ static void ggml_compute_forward_mul_mat_id_one_chunk(
                 struct mmid_row_mapping row_mapping = MMID_MATRIX_ROW(cur_a, _i12);
                 const int id       = row_mapping.i1; // selected expert index
 
-                const int64_t  i11 = id % ne11;
-                const int64_t  i12 = row_mapping.i2; // row index in src1
+                const int64_t  i1 = id;             // selected expert index
+                const int64_t  i2 = row_mapping.i2; // row
 
-                const int64_t  i1 = id;  // selected expert index
-                const int64_t  i2 = i12; // row
-
-                // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
-                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
-                //       the original src1 data pointer, so we should index using the indices directly
-                // TODO: this is a bit of a hack, we should probably have a better way to handle this
-                const char * src1_col = (const char *) wdata +
-                    (src1_cont || src1->type != vec_dot_type
-                    ? (i11      + i12*ne11)*row_size
-                    : (i11*nb11 + i12*nb12));
+                // src1 rows of this expert have been gathered contiguously
+                const char * src1_col = src1_cur + ir1*row_size;
 
                 float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2));
 
@@ -1468,6 +1847,33 @@ static void ggml_compute_forward_mul_mat_id_one_chunk(
     }
 }
 
+// GEMV path for experts with a single row: no tiling, the dot products are written directly to dst
+static void ggml_compute_forward_mul_mat_id_one_row(
+    struct ggml_tensor * dst,
+    const struct ggml_tensor * src0,
+    const struct ggml_tensor * ids,
+    const int64_t cur_a,
+    const int64_t ir0_start,
+    const int64_t ir0_end,
+    const char * src0_cur,
+    const struct mmid_row_mapping * matrix_rows,
+    const char * src1_cur) {
+
+    GGML_TENSOR_LOCALS(int64_t, ne0, src0, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb0, src0, nb)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst,  nb)
+
+    ggml_vec_dot_t const vec_dot = type_traits_cpu[src0->type].vec_dot;
+
+    const struct mmid_row_mapping row_mapping = MMID_MATRIX_ROW(cur_a, 0);
+
+    float * dst_col = (float *) ((char *) dst->data + (row_mapping.i1*nb1 + row_mapping.i2*nb2));
+
+    for (int64_t ir0 = ir0_start; ir0 < ir0_end; ++ir0) {
+        vec_dot(ne00, &dst_col[ir0], 0, src0_cur + ir0*nb01, 0, src1_cur, 0, 1);
+    }
+}
+
 static void * incr_ptr_aligned(void ** p, size_t size, size_t align) {
 
     void * ptr = *p;
@@ -1476,6 +1882,18 @@ static void * incr_ptr_aligned(void ** p, size_t size, size_t align) {
     return ptr;
 }
 
+// chunk size along src0 rows (0) and along the rows of an expert (1) for the mul_mat_id work items
+static void ggml_mul_mat_id_chunk_size(int64_t nr0, int64_t nr1, int64_t * dr0, int64_t * dr1) {
+    const int64_t chunk_size = nr1 == 1 ? 64 : 16;
+
+    *dr0 = MIN(nr0, chunk_size);
+    *dr1 = MIN(nr1, chunk_size);
+}
+
+// the experts are scheduled as a single queue of (expert, src0 row chunk, row chunk) work items:
+//  - the src1 rows routed to each expert are gathered into a contiguous buffer
+//  - the work items of all experts are handed out dynamically, so threads do not idle on experts with few rows
+//  - experts with a single row use a GEMV path
 static void ggml_compute_forward_mul_mat_id(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
@@ -1491,8 +1909,6 @@ static void ggml_compute_forward_mul_mat_id(
 
     const enum ggml_type type = src0->type;
 
-    const bool src1_cont = ggml_is_contiguous(src1);
-
     enum ggml_type    const vec_dot_type    = type_traits_cpu[type].vec_dot_type;
     ggml_from_float_t const from_float      = type_traits_cpu[vec_dot_type].from_float;
 
@@ -1510,6 +1926,10 @@ static void ggml_compute_forward_mul_mat_id(
     const int n_ids = ids->ne[0]; // n_expert_used
     const int n_as  = ne02;       // n_expert
 
+    const int64_t n_rows = ids->ne[0]*ids->ne[1];
+
+    const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+
     void * wdata_cur = params->wdata;
 
     if (src1->type != vec_dot_type) {
@@ -1519,11 +1939,17 @@ static void ggml_compute_forward_mul_mat_id(
     int64_t * matrix_row_counts = // [n_as]
         incr_ptr_aligned(&wdata_cur, n_as*sizeof(int64_t), sizeof(int64_t));
 
+    int64_t * matrix_row_offs = // [n_as + 1] - offset of the first gathered row of each expert
+        incr_ptr_aligned(&wdata_cur, (n_as + 1)*sizeof(int64_t), sizeof(int64_t));
+
+    int64_t * matrix_item_offs = // [n_as + 1] - index of the first work item of each expert
+        incr_ptr_aligned(&wdata_cur, (n_as + 1)*sizeof(int64_t), sizeof(int64_t));
+
     struct mmid_row_mapping * matrix_rows = // [n_as][ids->ne[0]*ids->ne[1]]
-        incr_ptr_aligned(&wdata_cur, n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping), sizeof(int64_t));
+        incr_ptr_aligned(&wdata_cur, n_as*n_rows*sizeof(struct mmid_row_mapping), sizeof(int64_t));
 
-    char (*atomic_current_chunk)[CACHE_LINE_SIZE] = // [n_as]
-        incr_ptr_aligned(&wdata_cur, CACHE_LINE_SIZE * n_as, CACHE_LINE_SIZE);
+    char * src1_gathered = // [n_rows][row_size]
+        incr_ptr_aligned(&wdata_cur, n_rows*row_size, CACHE_LINE_SIZE);
 
     GGML_ASSERT(params->wsize >= (size_t)((char *) wdata_cur - (char *) params->wdata));
 
@@ -1579,79 +2005,116 @@ static void ggml_compute_forward_mul_mat_id(
                 matrix_row_counts[i02] += 1;
             }
         }
-    }
 
-    // reset current_chunk
-    for (int cur_a = ith; cur_a < n_as; cur_a += nth) {
-        atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
-        *current_chunk_ctr = nth;
+        // flatten the work of all experts into a single list of work items
+        matrix_row_offs[0]  = 0;
+        matrix_item_offs[0] = 0;
+
+        for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+            const int64_t nr0 = ne01;
+            const int64_t nr1 = matrix_row_counts[cur_a];
+
+            int64_t n_items = 0;
+
+            if (nr1 > 0) {
+                int64_t dr0;
+                int64_t dr1;
+                ggml_mul_mat_id_chunk_size(nr0, nr1, &dr0, &dr1);
+
+                n_items = ((nr0 + dr0 - 1)/dr0)*((nr1 + dr1 - 1)/dr1);
+            }
+
+            matrix_row_offs[cur_a + 1]  = matrix_row_offs[cur_a]  + nr1;
+            matrix_item_offs[cur_a + 1] = matrix_item_offs[cur_a] + n_items;
+        }
     }
 
     ggml_barrier(params->threadpool);
 
-    for (int cur_a = 0; cur_a < n_as; ++cur_a) {
-        const int64_t cne1 = matrix_row_counts[cur_a];
+    const int64_t n_items = matrix_item_offs[n_as];
 
-        if (cne1 == 0) {
-            continue;
-        }
+    ggml_chunk_sched_init(params->threadpool, ith, nth, n_items);
 
-        const char * src0_cur = (const char *) src0->data + cur_a * nb02;
-        const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
-        const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+    // gather the src1 rows of each expert into a contiguous buffer
+    {
+        const char * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
 
-        const int64_t nr0 = ne01;
-        const int64_t nr1 = cne1;
+        for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+            const int64_t cne1 = matrix_row_counts[cur_a];
+
+            for (int64_t ir1 = 0; ir1 < cne1; ++ir1) {
+                const int64_t row = matrix_row_offs[cur_a] + ir1;
 
-        int chunk_size = 16;
-        if (nr0 == 1 || nr1 == 1) {
-            chunk_size = 64;
+                if (row % nth != ith) {
+                    continue;
+                }
+
+                const struct mmid_row_mapping row_mapping = MMID_MATRIX_ROW(cur_a, ir1);
+
+                const int64_t i11 = row_mapping.i1 % ne11;
+                const int64_t i12 = row_mapping.i2;
+
+                // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
+                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
+                //       the original src1 data pointer, so we should index using the indices directly
+                const char * src1_col = wdata +
+                    (ggml_is_contiguous(src1) || src1->type != vec_dot_type
+                    ? (i11      + i12*ne11)*row_size
+                    : (i11*nb11 + i12*nb12));
+
+                memcpy(src1_gathered + row*row_size, src1_col, row_size);
+            }
         }
+    }
 
-#if defined(__aarch64__)
-        // disable for ARM
-        const bool disable_chunking = true;
-#else
-        // disable for NUMA
-        const bool disable_chunking = ggml_is_numa();
-#endif // defined(__aarch64__)
+    ggml_barrier(params->threadpool);
+
+    int sched_state = 0;
+    int current_item;
 
-        int64_t nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
-        int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
+    int cur_a = 0;
 
-        if (nchunk0 * nchunk1 < nth * 4 || disable_chunking) {
-            nchunk0 = nr0 > nr1 ? nth : 1;
-            nchunk1 = nr0 > nr1 ? 1 : nth;
+    while ((current_item = ggml_chunk_sched_next(params->threadpool, ith, nth, n_items, &sched_state)) >= 0) {
+        // items are mostly taken in increasing order, so look for the expert of the item from the previous one
+        while (current_item < matrix_item_offs[cur_a]) {
+            cur_a--;
+        }
+        while (current_item >= matrix_item_offs[cur_a + 1]) {
+            cur_a++;
         }
 
-        const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
-        const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
+        const int64_t nr0 = ne01;
+        const int64_t nr1 = matrix_row_counts[cur_a];
 
-        int current_chunk = ith;
+        int64_t dr0;
+        int64_t dr1;
+        ggml_mul_mat_id_chunk_size(nr0, nr1, &dr0, &dr1);
 
-        atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
+        const int64_t nchunk0 = (nr0 + dr0 - 1)/dr0;
 
-        while (current_chunk < nchunk0 * nchunk1) {
-            const int64_t ith0 = current_chunk % nchunk0;
-            const int64_t ith1 = current_chunk / nchunk0;
+        const int64_t item = current_item - matrix_item_offs[cur_a];
 
-            const int64_t ir0_start = dr0 * ith0;
-            const int64_t ir0_end = MIN(ir0_start + dr0, nr0);
+        const int64_t ir0_start = dr0*(item % nchunk0);
+        const int64_t ir0_end   = MIN(ir0_start + dr0, nr0);
 
-            const int64_t ir1_start = dr1 * ith1;
-            const int64_t ir1_end = MIN(ir1_start + dr1, nr1);
+        const int64_t ir1_start = dr1*(item / nchunk0);
+        const int64_t ir1_end   = MIN(ir1_start + dr1, nr1);
 
+        const char * src0_cur = (const char *) src0->data + cur_a*nb02;
+        const char * src1_cur = src1_gathered + matrix_row_offs[cur_a]*row_size;
+
+        if (nr1 == 1) {
+            ggml_compute_forward_mul_mat_id_one_row(
+                dst, src0, ids, cur_a,
+                ir0_start, ir0_end,
+                src0_cur, matrix_rows, src1_cur
+            );
+        } else {
             ggml_compute_forward_mul_mat_id_one_chunk(
-                dst, src0, src1, ids, cur_a,
+                dst, src0, ids, cur_a,
                 ir0_start, ir0_end, ir1_start, ir1_end,
-                src0_cur, matrix_rows, row_size, src1_cont, wdata
+                src0_cur, matrix_rows, row_size, src1_cur
             );
-
-            if (nth >= nchunk0 * nchunk1) {
-                break;
-            }
-
-            current_chunk = atomic_fetch_add_explicit(current_chunk_ctr, 1, memory_order_relaxed);
         }
     }
 }
@@ -1781,7 +2244,7 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_MUL_MAT:
             {
-                ggml_compute_forward_mul_mat(params, tensor);
+                ggml_compute_forward_mul_mat_impl(params, tensor, NULL, ggml_compute_forward_mul_mat_src1_wdata(params), true);
             } break;
         case GGML_OP_MUL_MAT_ID:
             {
@@ -1939,6 +2402,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_argsort(params, tensor);
             } break;
+        case GGML_OP_TOP_K:
+            {
+                ggml_compute_forward_top_k(params, tensor);
+            } break;
         case GGML_OP_LEAKY_RELU:
             {
                 ggml_compute_forward_leaky_relu(params, tensor);
@@ -1988,64 +2455,501 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_RWKV_WKV6:
             {
-                ggml_compute_forward_rwkv_wkv6(params, tensor);
+                ggml_compute_forward_rwkv_wkv6(params, tensor);
+            } break;
+        case GGML_OP_GATED_LINEAR_ATTN:
+            {
+                ggml_compute_forward_gla(params, tensor);
+            } break;
+        case GGML_OP_RWKV_WKV7:
+            {
+                ggml_compute_forward_rwkv_wkv7(params, tensor);
+            } break;
+        case GGML_OP_MAP_CUSTOM1:
+            {
+                ggml_compute_forward_map_custom1(params, tensor);
+            }
+            break;
+        case GGML_OP_MAP_CUSTOM2:
+            {
+                ggml_compute_forward_map_custom2(params, tensor);
+            }
+            break;
+        case GGML_OP_MAP_CUSTOM3:
+            {
+                ggml_compute_forward_map_custom3(params, tensor);
+            }
+            break;
+        case GGML_OP_CUSTOM:
+            {
+                ggml_compute_forward_custom(params, tensor);
+            }
+            break;
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                ggml_compute_forward_cross_entropy_loss(params, tensor);
+            }
+            break;
+        case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
+            {
+                ggml_compute_forward_cross_entropy_loss_back(params, tensor);
+            }
+            break;
+        case GGML_OP_OPT_STEP_ADAMW:
+            {
+                ggml_compute_forward_opt_step_adamw(params, tensor);
+            }
+            break;
+        case GGML_OP_OPT_STEP_SGD:
+            {
+                ggml_compute_forward_opt_step_sgd(params, tensor);
+            }
+            break;
+        case GGML_OP_NONE:
+            {
+                // nop
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
+// op fusion
+//
+// common chains of nodes are executed as a single kernel, removing the barriers between them
+// and the extra passes over the activations:
+//   - rms_norm -> mul         (norm weight)
+//   - add -> rms_norm -> mul  (residual add + norm weight)
+//   - mul_mat -> swiglu       (the glu is applied to each tile of the second ffn projection as it is produced)
+//
+// fusion can be disabled with GGML_CPU_DISABLE_FUSION=1
+
+static bool ggml_cpu_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a == NULL || b == NULL || a->data == NULL || b->data == NULL) {
+        return false;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// dst is either clear of src or src itself row for row, so a row-wise kernel reads each row of src before writing it
+static bool ggml_cpu_tensors_same_rows_or_disjoint(const struct ggml_tensor * dst, const struct ggml_tensor * src) {
+    if (!ggml_cpu_tensors_overlap(dst, src)) {
+        return true;
+    }
+
+    return dst->data == src->data && ggml_are_same_shape(dst, src) &&
+        dst->nb[1] == src->nb[1] && dst->nb[2] == src->nb[2] && dst->nb[3] == src->nb[3];
+}
+
+static bool ggml_cpu_can_fuse_rms_norm_mul(const struct ggml_cgraph * cgraph, int node_n) {
+    static const enum ggml_op ops[] = { GGML_OP_RMS_NORM, GGML_OP_MUL };
+
+    if (!ggml_can_fuse(cgraph, node_n, ops, 2)) {
+        return false;
+    }
+
+    const struct ggml_tensor * norm = cgraph->nodes[node_n];
+    const struct ggml_tensor * mul  = cgraph->nodes[node_n + 1];
+    const struct ggml_tensor * w    = mul->src[0] == norm ? mul->src[1] : mul->src[0];
+
+    return !ggml_is_empty(mul) &&
+        norm->src[0]->type == GGML_TYPE_F32 && w->type == GGML_TYPE_F32 && mul->type == GGML_TYPE_F32 &&
+        norm->src[0]->nb[0] == sizeof(float) && w->nb[0] == sizeof(float) && mul->nb[0] == sizeof(float) &&
+        ggml_are_same_shape(norm, mul) && w->ne[0] == mul->ne[0] && ggml_can_repeat(w, mul);
+}
+
+static bool ggml_cpu_can_fuse_add_rms_norm_mul(const struct ggml_cgraph * cgraph, int node_n) {
+    if (node_n + 2 >= cgraph->n_nodes) {
+        return false;
+    }
+
+    const struct ggml_tensor * add  = cgraph->nodes[node_n];
+    const struct ggml_tensor * norm = cgraph->nodes[node_n + 1];
+
+    // the add result may have other uses - it is still written by the fused kernel
+    if (norm->op != GGML_OP_RMS_NORM || norm->src[0] != add || !ggml_cpu_can_fuse_rms_norm_mul(cgraph, node_n + 1)) {
+        return false;
+    }
+
+    const struct ggml_tensor * a   = add->src[0];
+    const struct ggml_tensor * b   = add->src[1];
+    const struct ggml_tensor * mul = cgraph->nodes[node_n + 2];
+
+    // the rows of the result are written while the threads still read other rows of the add operands, which the
+    // allocator may have given to the result once the add was their last use
+    return
+        a->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32 && add->type == GGML_TYPE_F32 &&
+        a->nb[0] == sizeof(float) && b->nb[0] == sizeof(float) &&
+        ggml_are_same_shape(a, add) && b->ne[0] == add->ne[0] && ggml_can_repeat(b, add) &&
+        ggml_cpu_tensors_same_rows_or_disjoint(mul, a) && ggml_cpu_tensors_same_rows_or_disjoint(mul, b);
+}
+
+static bool ggml_cpu_can_fuse_mul_mat_glu(const struct ggml_cgraph * cgraph, int node_n) {
+#if GGML_USE_LLAMAFILE
+    // sgemm writes the whole result at once
+    GGML_UNUSED(cgraph);
+    GGML_UNUSED(node_n);
+    return false;
+#else
+    if (node_n + 1 >= cgraph->n_nodes) {
+        return false;
+    }
+
+    const struct ggml_tensor * mm  = cgraph->nodes[node_n];
+    const struct ggml_tensor * glu = cgraph->nodes[node_n + 1];
+
+    if (glu->op != GGML_OP_GLU || ggml_get_glu_op(glu) != GGML_GLU_OP_SWIGLU || glu->src[1] == NULL) {
+        return false;
+    }
+
+    if ((glu->src[0] != mm) == (glu->src[1] != mm)) {
+        return false;
+    }
+
+    const struct ggml_tensor * other = glu->src[0] == mm ? glu->src[1] : glu->src[0];
+
+    // the allocator may place the glu result in the buffer of a mul_mat source that has no other use, which the
+    // tiles of the glu would overwrite while other tiles of the mul_mat still read it
+    return !ggml_is_empty(glu) &&
+        mm->type == GGML_TYPE_F32 && other->type == GGML_TYPE_F32 && glu->type == GGML_TYPE_F32 &&
+        ggml_is_contiguous(mm) && ggml_is_contiguous(other) && ggml_is_contiguous(glu) &&
+        ggml_are_same_shape(mm, other) && ggml_are_same_shape(mm, glu) &&
+        !ggml_cpu_tensors_overlap(glu, mm->src[0]) && !ggml_cpu_tensors_overlap(glu, mm->src[1]);
+#endif
+}
+
+// number of nodes following node_n that are fused into it
+static int ggml_cpu_graph_n_fused(const struct ggml_cgraph * cgraph, int node_n) {
+    if (g_state.disable_fusion) {
+        return 0;
+    }
+
+    const struct ggml_tensor * node = cgraph->nodes[node_n];
+
+    if (ggml_is_empty(node)) {
+        return 0;
+    }
+
+    switch (node->op) {
+        case GGML_OP_ADD:
+            return ggml_cpu_can_fuse_add_rms_norm_mul(cgraph, node_n) ? 2 : 0;
+        case GGML_OP_RMS_NORM:
+            return ggml_cpu_can_fuse_rms_norm_mul(cgraph, node_n) ? 1 : 0;
+        case GGML_OP_MUL_MAT:
+            return ggml_cpu_can_fuse_mul_mat_glu(cgraph, node_n) ? 1 : 0;
+        default:
+            return 0;
+    }
+}
+
+static void ggml_compute_forward_fused(struct ggml_compute_params * params, const struct ggml_cgraph * cgraph, int node_n) {
+    struct ggml_tensor * node = cgraph->nodes[node_n];
+
+    switch (node->op) {
+        case GGML_OP_ADD:
+            {
+                ggml_compute_forward_rms_norm_mul_fused(params, node, cgraph->nodes[node_n + 1], cgraph->nodes[node_n + 2]);
             } break;
-        case GGML_OP_GATED_LINEAR_ATTN:
+        case GGML_OP_RMS_NORM:
             {
-                ggml_compute_forward_gla(params, tensor);
+                ggml_compute_forward_rms_norm_mul_fused(params, NULL, node, cgraph->nodes[node_n + 1]);
             } break;
-        case GGML_OP_RWKV_WKV7:
+        case GGML_OP_MUL_MAT:
             {
-                ggml_compute_forward_rwkv_wkv7(params, tensor);
+                if (ggml_cpu_extra_compute_forward(params, node)) {
+                    ggml_barrier(params->threadpool);
+                    ggml_compute_forward_glu(params, cgraph->nodes[node_n + 1]);
+                } else {
+                    ggml_compute_forward_mul_mat_impl(params, node, cgraph->nodes[node_n + 1], ggml_compute_forward_mul_mat_src1_wdata(params), true);
+                }
             } break;
-        case GGML_OP_MAP_CUSTOM1:
-            {
-                ggml_compute_forward_map_custom1(params, tensor);
-            }
-            break;
-        case GGML_OP_MAP_CUSTOM2:
-            {
-                ggml_compute_forward_map_custom2(params, tensor);
-            }
-            break;
-        case GGML_OP_MAP_CUSTOM3:
+        default:
             {
-                ggml_compute_forward_map_custom3(params, tensor);
+                GGML_ABORT("fatal error");
             }
-            break;
-        case GGML_OP_CUSTOM:
-            {
-                ggml_compute_forward_custom(params, tensor);
+    }
+}
+
+//
+// level schedule
+//
+// consecutive nodes that do not depend on each other (e.g. the Q/K norms and ropes of a layer, or the
+// copies of K and V into the cache) are grouped into a level and run concurrently, each on its own
+// subset of the threads, with one barrier per level instead of one per node
+// only ops that split rows by ith/nth without barriers, shared chunk counters or shared scratch are grouped
+//
+
+#define GGML_CPU_LEVEL_MAX_UNITS 8
+#define GGML_CPU_LEVEL_WINDOW    8
+
+static bool ggml_cpu_node_is_noop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return ggml_is_empty(node);
+    }
+}
+
+// whether the unit starting at node can share a level with other units
+static bool ggml_cpu_unit_is_concurrent(const struct ggml_tensor * node, int n_fused, size_t wslice) {
+    if (n_fused > 0) {
+        // [ADD +] RMS_NORM + MUL
+        return node->op == GGML_OP_ADD || node->op == GGML_OP_RMS_NORM;
+    }
+
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+            // the quantized variants dequantize into the work buffer
+            return !ggml_is_quantized(node->src[0]->type);
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            return !ggml_is_quantized(node->type);
+        case GGML_OP_SCALE:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_LOG:
+        case GGML_OP_SIN:
+        case GGML_OP_COS:
+        case GGML_OP_CLAMP:
+        case GGML_OP_UNARY:
+        case GGML_OP_GLU:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_L2_NORM:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_SET_ROWS:
+        case GGML_OP_SOFT_MAX:
+            return true;
+        case GGML_OP_ROPE:
+            // one row of scratch per thread
+            return sizeof(float)*(node->ne[0] + CACHE_LINE_SIZE_F32) <= wslice;
+        default:
+            return false;
+    }
+}
+
+// ops that may be moved past other units they do not conflict with
+static bool ggml_cpu_unit_is_movable(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+        case GGML_OP_FLASH_ATTN_EXT:
+        case GGML_OP_TOP_K:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// read-after-write, write-after-read or write-after-write between two nodes
+static bool ggml_cpu_nodes_conflict(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (ggml_cpu_tensors_overlap(a, b)) {
+        return true;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (ggml_cpu_tensors_overlap(a, b->src[i]) || ggml_cpu_tensors_overlap(a->src[i], b)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool ggml_cpu_unit_conflicts(const struct ggml_cgraph * cgraph, const struct ggml_cpu_unit * a, const struct ggml_cpu_unit * b) {
+    for (int i = a->node_n; i <= a->node_n + a->n_fused; i++) {
+        for (int j = b->node_n; j <= b->node_n + b->n_fused; j++) {
+            if (ggml_cpu_nodes_conflict(cgraph->nodes[i], cgraph->nodes[j])) {
+                return true;
             }
-            break;
-        case GGML_OP_CROSS_ENTROPY_LOSS:
-            {
-                ggml_compute_forward_cross_entropy_loss(params, tensor);
+        }
+    }
+
+    return false;
+}
+
+// split the threads among the units of a level, roughly in proportion to the size of their results
+static void ggml_cpu_level_assign_threads(const struct ggml_cgraph * cgraph, struct ggml_cpu_unit * units, int n_units, int n_threads) {
+    if (n_units > n_threads) {
+        for (int u = 0; u < n_units; u++) {
+            units[u].ith0 = u % n_threads;
+            units[u].nth  = 1;
+        }
+        return;
+    }
+
+    int64_t cost[GGML_CPU_LEVEL_MAX_UNITS];
+    int64_t cost_total = 0;
+
+    for (int u = 0; u < n_units; u++) {
+        cost[u] = ggml_nelements(cgraph->nodes[units[u].node_n + units[u].n_fused]) + 1;
+        cost_total += cost[u];
+    }
+
+    const int n_spare = n_threads - n_units;
+
+    int n_left = n_spare;
+    for (int u = 0; u < n_units; u++) {
+        units[u].nth = 1 + (int) (n_spare*cost[u]/cost_total);
+        n_left -= units[u].nth - 1;
+    }
+
+    // remaining threads go to the units with the most work per thread
+    for (; n_left > 0; n_left--) {
+        int best = 0;
+        for (int u = 1; u < n_units; u++) {
+            if (cost[u]*units[best].nth > cost[best]*units[u].nth) {
+                best = u;
             }
-            break;
-        case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
-            {
-                ggml_compute_forward_cross_entropy_loss_back(params, tensor);
+        }
+        units[best].nth++;
+    }
+
+    int ith0 = 0;
+    for (int u = 0; u < n_units; u++) {
+        units[u].ith0 = ith0;
+        ith0 += units[u].nth;
+    }
+}
+
+// level being built, see ggml_graph_compute_levels
+struct ggml_cpu_level_slot {
+    bool concurrent; // holds up to GGML_CPU_LEVEL_MAX_UNITS concurrent units, otherwise a single unit
+    bool fence;      // nothing is moved before this level
+    int  n_units;
+    struct ggml_cpu_unit units[GGML_CPU_LEVEL_MAX_UNITS];
+};
+
+static void ggml_cpu_level_emit(struct ggml_threadpool * tp, const struct ggml_cgraph * cgraph, struct ggml_cpu_level_slot * slot, int * n_units, int n_threads) {
+    struct ggml_cpu_level * level = &tp->levels[tp->n_levels++];
+
+    level->unit_start = *n_units;
+    level->unit_end   = *n_units + slot->n_units;
+
+    struct ggml_cpu_unit * units = tp->units + level->unit_start;
+    memcpy(units, slot->units, sizeof(struct ggml_cpu_unit)*slot->n_units);
+    *n_units += slot->n_units;
+
+    if (slot->n_units == 1) {
+        units[0].ith0 = 0;
+        units[0].nth  = n_threads;
+    } else {
+        ggml_cpu_level_assign_threads(cgraph, units, slot->n_units, n_threads);
+    }
+}
+
+// build the level schedule of cgraph for n_threads into tp
+// each unit is placed in the earliest of the last GGML_CPU_LEVEL_WINDOW levels that comes after all the units it
+// conflicts with (by memory range, which also covers in-place ops and buffers reused by the allocator)
+// e.g. the Q, K and V mul_mats run back to back, followed by the Q and K norms together and the Q and K ropes together
+static void ggml_graph_compute_levels(struct ggml_threadpool * tp, const struct ggml_cgraph * cgraph, const struct ggml_cplan * cplan, int n_threads) {
+    if (cplan->graph_id != 0 && cplan->graph_id == tp->levels_graph_id && n_threads == tp->levels_n_threads) {
+        return;
+    }
+
+    tp->n_levels         = 0;
+    tp->levels_graph_id  = cplan->graph_id;
+    tp->levels_n_threads = n_threads;
+
+    if (!g_state.levels || cgraph->n_nodes == 0) {
+        return;
+    }
+
+    if (tp->levels_cap < cgraph->n_nodes) {
+        free(tp->levels);
+        free(tp->units);
+        tp->levels_cap = cgraph->n_nodes;
+        tp->levels     = malloc(sizeof(struct ggml_cpu_level)*tp->levels_cap);
+        tp->units      = malloc(sizeof(struct ggml_cpu_unit) *tp->levels_cap);
+        GGML_ASSERT(tp->levels && tp->units);
+    }
+
+    // the shared mul_mat region at the end of the work buffer stays with the mul_mats
+    const size_t wsize = cplan->work_size - cplan->work_size_mm;
+    tp->level_wslice = cplan->work_data ? (wsize/n_threads) & ~((size_t) CACHE_LINE_SIZE - 1) : 0;
+
+    struct ggml_cpu_level_slot win[GGML_CPU_LEVEL_WINDOW];
+    int n_win   = 0;
+    int n_units = 0;
+
+    for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
+        const struct ggml_tensor * node = cgraph->nodes[node_n];
+
+        if (ggml_cpu_node_is_noop(node)) {
+            continue;
+        }
+
+        struct ggml_cpu_unit unit = {
+            /*.node_n  =*/ node_n,
+            /*.n_fused =*/ ggml_cpu_graph_n_fused(cgraph, node_n),
+            /*.ith0    =*/ 0,
+            /*.nth     =*/ 0,
+        };
+
+        node_n += unit.n_fused;
+
+        const bool concurrent = ggml_cpu_unit_is_concurrent(node, unit.n_fused, tp->level_wslice);
+        const bool fence      = !concurrent && !ggml_cpu_unit_is_movable(node);
+
+        // latest level with a unit that this one depends on
+        int dep = fence ? n_win - 1 : -1;
+        for (int l = n_win - 1; l > dep; l--) {
+            bool conflict = win[l].fence;
+            for (int u = 0; u < win[l].n_units && !conflict; u++) {
+                conflict = ggml_cpu_unit_conflicts(cgraph, &win[l].units[u], &unit);
             }
-            break;
-        case GGML_OP_OPT_STEP_ADAMW:
-            {
-                ggml_compute_forward_opt_step_adamw(params, tensor);
+            if (conflict) {
+                dep = l;
             }
-            break;
-        case GGML_OP_OPT_STEP_SGD:
-            {
-                ggml_compute_forward_opt_step_sgd(params, tensor);
+        }
+
+        if (concurrent) {
+            int l = dep + 1;
+            while (l < n_win && !(win[l].concurrent && win[l].n_units < GGML_CPU_LEVEL_MAX_UNITS)) {
+                l++;
             }
-            break;
-        case GGML_OP_NONE:
-            {
-                // nop
-            } break;
-        case GGML_OP_COUNT:
-            {
-                GGML_ABORT("fatal error");
+            if (l < n_win) {
+                win[l].units[win[l].n_units++] = unit;
+                continue;
             }
+        }
+
+        // new level right after the dependency
+        if (n_win == GGML_CPU_LEVEL_WINDOW) {
+            ggml_cpu_level_emit(tp, cgraph, &win[0], &n_units, n_threads);
+            memmove(win, win + 1, sizeof(win[0])*(n_win - 1));
+            n_win--;
+            dep = MAX(dep - 1, -1);
+        }
+
+        const int l = dep + 1;
+        memmove(win + l + 1, win + l, sizeof(win[0])*(n_win - l));
+        n_win++;
+
+        win[l].concurrent = concurrent;
+        win[l].fence      = fence;
+        win[l].n_units    = 1;
+        win[l].units[0]   = unit;
+    }
+
+    for (int l = 0; l < n_win; l++) {
+        ggml_cpu_level_emit(tp, cgraph, &win[l], &n_units, n_threads);
     }
 }
 
@@ -2285,6 +3189,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_ARANGE:
         case GGML_OP_TIMESTEP_EMBEDDING:
         case GGML_OP_ARGSORT:
+        case GGML_OP_TOP_K:
         case GGML_OP_FLASH_ATTN_EXT:
         case GGML_OP_FLASH_ATTN_BACK:
         case GGML_OP_SSM_CONV:
@@ -2642,6 +3547,10 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
 
     const size_t workers_size = sizeof(struct ggml_compute_state) * n_threads;
     ggml_aligned_free(threadpool->workers, workers_size);
+    ggml_aligned_free(threadpool->barrier_nodes, sizeof(struct ggml_barrier_node) * n_threads);
+    ggml_aligned_free(threadpool->chunk_queues,  sizeof(struct ggml_chunk_queue)  * n_threads);
+    free(threadpool->levels);
+    free(threadpool->units);
     ggml_aligned_free(threadpool, sizeof(struct ggml_threadpool));
 }
 
@@ -2696,7 +3605,8 @@ struct ggml_cplan ggml_graph_plan(
         n_threads = threadpool ? threadpool->n_threads_max : GGML_DEFAULT_N_THREADS;
     }
 
-    size_t work_size = 0;
+    size_t work_size    = 0;
+    size_t work_size_mm = 0;
 
     struct ggml_cplan cplan;
     memset(&cplan, 0, sizeof(struct ggml_cplan));
@@ -2750,8 +3660,9 @@ struct ggml_cplan ggml_graph_plan(
                     {
                         const enum ggml_type vec_dot_type = type_traits_cpu[node->src[0]->type].vec_dot_type;
 
+                        // src1 is converted into the shared region, which is not used by other ops
                         if (node->src[1]->type != vec_dot_type) {
-                            cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                            work_size_mm = MAX(work_size_mm, ggml_row_size(vec_dot_type, ggml_nelements(node->src[1])));
                         }
                     } break;
                 case GGML_OP_MUL_MAT_ID:
@@ -2768,10 +3679,12 @@ struct ggml_cplan ggml_graph_plan(
                         }
                         // matrix_row_counts
                         cur += n_as * sizeof(int64_t) + sizeof(int64_t);
+                        // matrix_row_offs, matrix_item_offs
+                        cur += 2*((n_as + 1)*sizeof(int64_t) + sizeof(int64_t));
                         // matrix_rows
                         cur += n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping) + sizeof(int64_t);
-                        // atomic_current_chunk
-                        cur += CACHE_LINE_SIZE*n_as + CACHE_LINE_SIZE;
+                        // src1_gathered
+                        cur += ids->ne[0]*ids->ne[1]*ggml_row_size(vec_dot_type, src1->ne[0]) + CACHE_LINE_SIZE;
                     } break;
                 case GGML_OP_OUT_PROD:
                     {
@@ -2785,6 +3698,11 @@ struct ggml_cplan ggml_graph_plan(
                     {
                         cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
                     } break;
+                case GGML_OP_TOP_K:
+                    {
+                        // per thread: the k best (value, index) pairs of its part of a row
+                        cur = (sizeof(float) + sizeof(int32_t))*node->ne[0]*n_tasks + CACHE_LINE_SIZE*n_tasks;
+                    } break;
                 case GGML_OP_CONV_TRANSPOSE_1D:
                     {
                         GGML_ASSERT(node->src[0]->ne[3] == 1);
@@ -2835,6 +3753,10 @@ struct ggml_cplan ggml_graph_plan(
                         const int64_t ne20 = node->src[2]->ne[0]; // DV
 
                         cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+
+                        // split-KV decode: partial max, sum and head size V accumulator per (q row, KV chunk)
+                        // there are at most 2x n_tasks such work items, see ggml_flash_attn_ext_n_kv_chunks
+                        cur += sizeof(float)*(ne20 + 2)*2*n_tasks;
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -2873,14 +3795,87 @@ struct ggml_cplan ggml_graph_plan(
         work_size += CACHE_LINE_SIZE*(n_threads);
     }
 
-    cplan.threadpool = threadpool;
-    cplan.n_threads  = MIN(max_tasks, n_threads);
-    cplan.work_size  = work_size;
-    cplan.work_data  = NULL;
+    if (work_size_mm > 0) {
+        // keep the shared region cache line aligned
+        work_size = GGML_PAD(work_size, CACHE_LINE_SIZE);
+    }
+
+    cplan.threadpool   = threadpool;
+    cplan.n_threads    = MIN(max_tasks, n_threads);
+    cplan.work_size    = work_size + work_size_mm;
+    cplan.work_size_mm = work_size_mm;
+    cplan.work_data    = NULL;
 
     return cplan;
 }
 
+static void ggml_graph_compute_unit(struct ggml_compute_params * params, const struct ggml_cgraph * cgraph, const struct ggml_cpu_unit * unit) {
+    if (unit->n_fused > 0) {
+        ggml_compute_forward_fused(params, cgraph, unit->node_n);
+    } else {
+        ggml_compute_forward(params, cgraph->nodes[unit->node_n]);
+    }
+}
+
+static void ggml_graph_compute_nodes_done(const struct ggml_cplan * cplan, const struct ggml_cgraph * cgraph, int node_start, int node_end) {
+    for (int i = node_start; i < node_end; i++) {
+        cplan->node_callback(cgraph->nodes[i], cplan->node_callback_data);
+    }
+}
+
+static void ggml_graph_compute_thread_levels(struct ggml_compute_state * state, struct ggml_compute_params * params) {
+    struct ggml_threadpool * tp = state->threadpool;
+
+    const struct ggml_cgraph * cgraph = tp->cgraph;
+    const struct ggml_cplan  * cplan  = tp->cplan;
+
+    for (int l = 0; l < tp->n_levels && atomic_load_explicit(&tp->abort, memory_order_relaxed) != l; l++) {
+        const struct ggml_cpu_level * level = &tp->levels[l];
+
+        if (level->unit_end - level->unit_start == 1) {
+            // a single unit gets all the threads and the whole work buffer
+            ggml_graph_compute_unit(params, cgraph, &tp->units[level->unit_start]);
+        } else {
+            for (int u = level->unit_start; u < level->unit_end; u++) {
+                const struct ggml_cpu_unit * unit = &tp->units[u];
+
+                if (state->ith < unit->ith0 || state->ith >= unit->ith0 + unit->nth) {
+                    continue;
+                }
+
+                struct ggml_compute_params unit_params = {
+                    /*.ith       =*/ state->ith - unit->ith0,
+                    /*.nth       =*/ unit->nth,
+                    /*.wsize     =*/ tp->level_wslice*unit->nth,
+                    /*.wdata     =*/ (char *) params->wdata + tp->level_wslice*unit->ith0,
+                    /*.threadpool=*/ tp,
+                };
+
+                ggml_graph_compute_unit(&unit_params, cgraph, unit);
+            }
+        }
+
+        if (state->ith == 0 && cplan->node_callback) {
+            for (int u = level->unit_start; u < level->unit_end; u++) {
+                const struct ggml_cpu_unit * unit = &tp->units[u];
+                ggml_graph_compute_nodes_done(cplan, cgraph, unit->node_n, unit->node_n + unit->n_fused + 1);
+            }
+        }
+
+        if (state->ith == 0 && cplan->abort_callback &&
+                cplan->abort_callback(cplan->abort_callback_data)) {
+            atomic_store_explicit(&tp->abort, l + 1, memory_order_relaxed);
+            tp->ec    = GGML_STATUS_ABORTED;
+        }
+
+        if (l + 1 < tp->n_levels) {
+            ggml_barrier(state->threadpool);
+        }
+    }
+
+    ggml_barrier(state->threadpool);
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -2890,6 +3885,8 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     set_numa_thread_affinity(state->ith);
 
+    ggml_barrier_ith = state->ith;
+
     struct ggml_compute_params params = {
         /*.ith       =*/ state->ith,
         /*.nth       =*/ atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed),
@@ -2898,10 +3895,27 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
+    if (tp->n_levels > 0) {
+        ggml_graph_compute_thread_levels(state, &params);
+        return 0;
+    }
+
     for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
-        ggml_compute_forward(&params, node);
+        const int node_start = node_n;
+        const int n_fused    = ggml_cpu_graph_n_fused(cgraph, node_n);
+
+        if (n_fused > 0) {
+            ggml_compute_forward_fused(&params, cgraph, node_n);
+            node_n += n_fused;
+        } else {
+            ggml_compute_forward(&params, node);
+        }
+
+        if (state->ith == 0 && cplan->node_callback) {
+            ggml_graph_compute_nodes_done(cplan, cgraph, node_start, node_n + 1);
+        }
 
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
@@ -3080,6 +4094,17 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_barrier        = 0;
         threadpool->n_barrier_passed = 0;
         threadpool->current_chunk    = 0;
+        threadpool->n_barrier_sleepers = 0;
+        threadpool->barrier_spin     = g_state.barrier_spin;
+        threadpool->mm_src1          = NULL;
+        threadpool->mm_src1_type     = GGML_TYPE_COUNT;
+        threadpool->levels           = NULL;
+        threadpool->units            = NULL;
+        threadpool->n_levels         = 0;
+        threadpool->levels_cap       = 0;
+        threadpool->level_wslice     = 0;
+        threadpool->levels_graph_id  = 0;
+        threadpool->levels_n_threads = 0;
         threadpool->stop             = false;
         threadpool->pause            = tpp->paused;
         threadpool->abort            = -1;
@@ -3103,6 +4128,15 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
 
     threadpool->workers = workers;
 
+    // the combining tree has fewer nodes than threads
+    const size_t barrier_nodes_size = sizeof(struct ggml_barrier_node) * tpp->n_threads;
+    threadpool->barrier_nodes = ggml_aligned_malloc(barrier_nodes_size);
+    memset(threadpool->barrier_nodes, 0, barrier_nodes_size);
+
+    const size_t chunk_queues_size = sizeof(struct ggml_chunk_queue) * tpp->n_threads;
+    threadpool->chunk_queues = ggml_aligned_malloc(chunk_queues_size);
+    memset(threadpool->chunk_queues, 0, chunk_queues_size);
+
 #ifdef GGML_USE_OPENMP
     int32_t cpumask_iter = 0;
 
@@ -3141,6 +4175,8 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
 }
 
 struct ggml_threadpool * ggml_threadpool_new(struct ggml_threadpool_params * tpp) {
+    ggml_cpu_init();
+
     return ggml_threadpool_new_impl(tpp, NULL, NULL);
 }
 
@@ -3168,6 +4204,8 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->cgraph           = cgraph;
         threadpool->cplan            = cplan;
         threadpool->current_chunk    = 0;
+        threadpool->mm_src1          = NULL;
+        threadpool->mm_src1_type     = GGML_TYPE_COUNT;
         threadpool->abort            = -1;
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
@@ -3181,6 +4219,8 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
                 // update the number of threads from the actual number of threads that we got from OpenMP
                 n_threads = omp_get_num_threads();
                 atomic_store_explicit(&threadpool->n_threads_cur, n_threads, memory_order_relaxed);
+
+                ggml_graph_compute_levels(threadpool, cgraph, cplan, n_threads);
             }
 
             // Apply thread CPU mask and priority
@@ -3194,6 +4234,7 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         }
     } else {
         atomic_store_explicit(&threadpool->n_threads_cur, 1, memory_order_relaxed);
+        ggml_graph_compute_levels(threadpool, cgraph, cplan, 1);
         ggml_graph_compute_thread(&threadpool->workers[0]);
     }
 #else
@@ -3202,6 +4243,8 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         n_threads = threadpool->n_threads_max;
     }
 
+    ggml_graph_compute_levels(threadpool, cgraph, cplan, n_threads);
+
     // Kick all threads to start the new graph
     ggml_graph_compute_kickoff(threadpool, n_threads);
 
@@ -3594,6 +4637,29 @@ void ggml_cpu_init(void) {
         ggml_init_arm_arch_features();
 #endif
 
+        {
+            const char * GGML_CPU_DISABLE_FUSION = getenv("GGML_CPU_DISABLE_FUSION");
+            g_state.disable_fusion = GGML_CPU_DISABLE_FUSION != NULL && atoi(GGML_CPU_DISABLE_FUSION) != 0;
+        }
+
+        {
+            // threading policies, the defaults match the historical behavior
+            const char * GGML_CPU_BARRIER      = getenv("GGML_CPU_BARRIER");      // counter | tree
+            const char * GGML_CPU_BARRIER_WAIT = getenv("GGML_CPU_BARRIER_WAIT"); // spin | hybrid
+            const char * GGML_CPU_BARRIER_SPIN = getenv("GGML_CPU_BARRIER_SPIN"); // initial spin rounds before sleeping
+            const char * GGML_CPU_CHUNK_SCHED  = getenv("GGML_CPU_CHUNK_SCHED");  // shared | steal
+            const char * GGML_CPU_CONCURRENT   = getenv("GGML_CPU_CONCURRENT");   // 0 to run the nodes one by one
+
+            g_state.barrier       = GGML_CPU_BARRIER      && strcmp(GGML_CPU_BARRIER, "tree") == 0 ? GGML_CPU_BARRIER_TREE : GGML_CPU_BARRIER_COUNTER;
+            g_state.barrier_sleep = GGML_CPU_BARRIER_WAIT && strcmp(GGML_CPU_BARRIER_WAIT, "hybrid") == 0;
+            g_state.chunk_sched   = GGML_CPU_CHUNK_SCHED  && strcmp(GGML_CPU_CHUNK_SCHED, "steal") == 0 ? GGML_CPU_CHUNK_SCHED_STEAL : GGML_CPU_CHUNK_SCHED_SHARED;
+
+            g_state.levels        = !(GGML_CPU_CONCURRENT && atoi(GGML_CPU_CONCURRENT) == 0);
+
+            g_state.barrier_spin = GGML_CPU_BARRIER_SPIN ? atoi(GGML_CPU_BARRIER_SPIN) : (1 << 14);
+            g_state.barrier_spin = MAX(GGML_BARRIER_SPIN_MIN, MIN(GGML_BARRIER_SPIN_MAX, g_state.barrier_spin));
+        }
+
         is_first_call = false;
     }
 
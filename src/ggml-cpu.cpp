@@ -10,6 +10,7 @@
 #  endif
 #endif
 
+#include <algorithm>
 #include <cctype>
 #include <string>
 #include <vector>
@@ -103,26 +104,82 @@ static bool ggml_backend_cpu_is_extra_buffer_type(ggml_backend_buffer_type_t buf
 
 // CPU backend - backend (stream)
 
+// plan of a recently computed graph
+struct ggml_backend_cpu_plan {
+    uint64_t            key; // see ggml_backend_cpu_graph_key(), 0 - none
+    uint64_t            sig; // see ggml_backend_cpu_graph_signature()
+    int                 n_threads;
+    ggml_threadpool_t   threadpool;
+    struct ggml_cplan   cplan;
+};
+
 struct ggml_backend_cpu_context {
     int                 n_threads;
     ggml_threadpool_t   threadpool;
 
     uint8_t *           work_data;
     size_t              work_size;
+    size_t              work_mapped_size; // != 0 when work_data is backed by huge pages
 
     ggml_abort_callback abort_callback;
     void *              abort_callback_data;
+
+    ggml_cpu_node_callback node_callback;
+    void *                 node_callback_data;
+
+    // set by the caller while the graphs it computes stay the same, 0 - unknown
+    uint64_t            graph_id;
+
+    // plans of recently computed graphs (e.g. the splits of a graph, or the graphs of a few ubatch shapes), most
+    // recently used first
+    std::vector<ggml_backend_cpu_plan> plans;
 };
 
+static constexpr size_t GGML_BACKEND_CPU_N_PLANS_MAX = 8;
+
 static const char * ggml_backend_cpu_get_name(ggml_backend_t backend) {
     return "CPU";
 
     GGML_UNUSED(backend);
 }
 
+// work buffers are large and touched by every graph: back them with huge pages when enabled (GGML_HUGEPAGES)
+static uint8_t * ggml_backend_cpu_work_alloc(size_t size, size_t * mapped_size) {
+    *mapped_size = 0;
+    if (void * data = ggml_hugepage_malloc(size, mapped_size)) {
+        return (uint8_t *) data;
+    }
+    return new uint8_t[size];
+}
+
+static void ggml_backend_cpu_work_free(uint8_t * data, size_t mapped_size) {
+    if (mapped_size != 0) {
+        ggml_hugepage_free(data, mapped_size);
+    } else {
+        delete[] data;
+    }
+}
+
+// grows the work buffer to at least size bytes, the buffer is shared by all the plans
+static bool ggml_backend_cpu_work_reserve(struct ggml_backend_cpu_context * cpu_ctx, size_t size) {
+    if (cpu_ctx->work_size >= size) {
+        return true;
+    }
+
+    ggml_backend_cpu_work_free(cpu_ctx->work_data, cpu_ctx->work_mapped_size);
+    cpu_ctx->work_data = ggml_backend_cpu_work_alloc(size, &cpu_ctx->work_mapped_size);
+    if (cpu_ctx->work_data == NULL) {
+        cpu_ctx->work_size = 0;
+        return false;
+    }
+    cpu_ctx->work_size = size;
+
+    return true;
+}
+
 static void ggml_backend_cpu_free(ggml_backend_t backend) {
     struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
-    delete[] cpu_ctx->work_data;
+    ggml_backend_cpu_work_free(cpu_ctx->work_data, cpu_ctx->work_mapped_size);
     delete cpu_ctx;
     delete backend;
 }
@@ -130,6 +187,7 @@ static void ggml_backend_cpu_free(ggml_backend_t backend) {
 struct ggml_backend_plan_cpu {
     struct ggml_cplan cplan;
     struct ggml_cgraph cgraph;
+    size_t work_mapped_size;
 };
 
 static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(ggml_backend_t backend, const struct ggml_cgraph * cgraph) {
@@ -139,9 +197,10 @@ static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(ggml_backend
 
     cpu_plan->cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads, cpu_ctx->threadpool);
     cpu_plan->cgraph = *cgraph; // FIXME: deep copy
+    cpu_plan->work_mapped_size = 0;
 
     if (cpu_plan->cplan.work_size > 0) {
-        cpu_plan->cplan.work_data = new uint8_t[cpu_plan->cplan.work_size];
+        cpu_plan->cplan.work_data = ggml_backend_cpu_work_alloc(cpu_plan->cplan.work_size, &cpu_plan->work_mapped_size);
         if (cpu_plan->cplan.work_data == NULL) {
             delete cpu_plan;
             return NULL;
@@ -150,6 +209,8 @@ static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(ggml_backend
 
     cpu_plan->cplan.abort_callback      = cpu_ctx->abort_callback;
     cpu_plan->cplan.abort_callback_data = cpu_ctx->abort_callback_data;
+    cpu_plan->cplan.node_callback       = cpu_ctx->node_callback;
+    cpu_plan->cplan.node_callback_data  = cpu_ctx->node_callback_data;
 
     return cpu_plan;
 }
@@ -157,7 +218,7 @@ static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(ggml_backend
 static void ggml_backend_cpu_graph_plan_free(ggml_backend_t backend, ggml_backend_graph_plan_t plan) {
     struct ggml_backend_plan_cpu * cpu_plan = (struct ggml_backend_plan_cpu *)plan;
 
-    delete[] cpu_plan->cplan.work_data;
+    ggml_backend_cpu_work_free(cpu_plan->cplan.work_data, cpu_plan->work_mapped_size);
     delete cpu_plan;
 
     GGML_UNUSED(backend);
@@ -171,24 +232,118 @@ static enum ggml_status ggml_backend_cpu_graph_plan_compute(ggml_backend_t backe
     GGML_UNUSED(backend);
 }
 
+static void ggml_backend_cpu_mix(uint64_t & h, uint64_t v) {
+    h = (h ^ v)*0x100000001b3ull;
+}
+
+// identifies a graph by its nodes, their shapes, sources and addresses
+// everything ggml_graph_plan and the level schedule depend on, besides the thread count
+static uint64_t ggml_backend_cpu_graph_signature(const struct ggml_cgraph * cgraph) {
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    ggml_backend_cpu_mix(h, (uint64_t) cgraph->n_nodes);
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        ggml_backend_cpu_mix(h, (uint64_t) (uintptr_t) node);
+        ggml_backend_cpu_mix(h, (uint64_t) (uintptr_t) node->data);
+        ggml_backend_cpu_mix(h, ((uint64_t) node->op << 32) | (uint64_t) node->type);
+        for (int d = 0; d < GGML_MAX_DIMS; d++) {
+            ggml_backend_cpu_mix(h, (uint64_t) node->ne[d]);
+            ggml_backend_cpu_mix(h, (uint64_t) node->nb[d]);
+        }
+        ggml_backend_cpu_mix(h, (uint64_t) node->op_params[0]);
+
+        for (int j = 0; j < GGML_MAX_SRC && node->src[j]; j++) {
+            const struct ggml_tensor * src = node->src[j];
+
+            ggml_backend_cpu_mix(h, (uint64_t) (uintptr_t) src);
+            ggml_backend_cpu_mix(h, (uint64_t) (uintptr_t) src->data);
+            ggml_backend_cpu_mix(h, (uint64_t) src->type);
+            for (int d = 0; d < GGML_MAX_DIMS; d++) {
+                ggml_backend_cpu_mix(h, (uint64_t) src->ne[d]);
+                ggml_backend_cpu_mix(h, (uint64_t) src->nb[d]);
+            }
+        }
+    }
+
+    return h != 0 ? h : 1;
+}
+
+// with a graph id from the caller the graph is not walked: the splits of the graph are told apart by their node range
+static uint64_t ggml_backend_cpu_graph_key(const struct ggml_backend_cpu_context * cpu_ctx, const struct ggml_cgraph * cgraph) {
+    if (cpu_ctx->graph_id == 0) {
+        return 0;
+    }
+
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    ggml_backend_cpu_mix(h, cpu_ctx->graph_id);
+    ggml_backend_cpu_mix(h, (uint64_t) (uintptr_t) cgraph->nodes);
+    ggml_backend_cpu_mix(h, (uint64_t) cgraph->n_nodes);
+
+    return h != 0 ? h : 1;
+}
+
 static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
     struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
 
-    struct ggml_cplan cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads, cpu_ctx->threadpool);
+    auto & plans = cpu_ctx->plans;
 
-    if (cpu_ctx->work_size < cplan.work_size) {
-        delete[] cpu_ctx->work_data;
-        cpu_ctx->work_data = new uint8_t[cplan.work_size];
-        if (cpu_ctx->work_data == NULL) {
-            cpu_ctx->work_size = 0;
-            return GGML_STATUS_ALLOC_FAILED;
+    auto find = [&](auto match) {
+        size_t i = 0;
+        while (i < plans.size() && !(match(plans[i]) && plans[i].n_threads == cpu_ctx->n_threads && plans[i].threadpool == cpu_ctx->threadpool)) {
+            i++;
         }
-        cpu_ctx->work_size = cplan.work_size;
+        return i;
+    };
+
+    const uint64_t key = ggml_backend_cpu_graph_key(cpu_ctx, cgraph);
+
+    size_t i = key != 0 ? find([key](const ggml_backend_cpu_plan & plan) { return plan.key == key; }) : plans.size();
+
+    if (i == plans.size()) {
+        // unknown id (e.g. a cached graph that was placed again): the graph may still be the same as a previous one
+        const uint64_t sig = ggml_backend_cpu_graph_signature(cgraph);
+
+        i = find([sig](const ggml_backend_cpu_plan & plan) { return plan.sig == sig; });
+
+        if (i == plans.size()) {
+            ggml_backend_cpu_plan plan;
+            plan.sig        = sig;
+            plan.n_threads  = cpu_ctx->n_threads;
+            plan.threadpool = cpu_ctx->threadpool;
+            plan.cplan      = ggml_graph_plan(cgraph, cpu_ctx->n_threads, cpu_ctx->threadpool);
+
+            // normally sized by ggml_backend_cpu_graph_reserve() already
+            if (!ggml_backend_cpu_work_reserve(cpu_ctx, plan.cplan.work_size)) {
+                return GGML_STATUS_ALLOC_FAILED;
+            }
+
+            if (plans.size() == GGML_BACKEND_CPU_N_PLANS_MAX) {
+                plans.pop_back();
+                i--;
+            }
+            plans.push_back(plan);
+        }
+
+        plans[i].key = key;
     }
+
+    if (i != 0) {
+        std::rotate(plans.begin(), plans.begin() + i, plans.begin() + i + 1);
+    }
+
+    struct ggml_cplan cplan = plans[0].cplan;
+
     cplan.work_data = (uint8_t *)cpu_ctx->work_data;
+    cplan.graph_id  = plans[0].sig;
 
     cplan.abort_callback      = cpu_ctx->abort_callback;
     cplan.abort_callback_data = cpu_ctx->abort_callback_data;
+    cplan.node_callback       = cpu_ctx->node_callback;
+    cplan.node_callback_data  = cpu_ctx->node_callback_data;
 
     return ggml_graph_compute(cgraph, &cplan);
 }
@@ -230,8 +385,12 @@ extern "C" __attribute__((visibility("default"))) ggml_backend_t ggml_backend_cp
     ctx->threadpool          = NULL;
     ctx->work_data           = NULL;
     ctx->work_size           = 0;
+    ctx->work_mapped_size    = 0;
     ctx->abort_callback      = NULL;
     ctx->abort_callback_data = NULL;
+    ctx->node_callback       = NULL;
+    ctx->node_callback_data  = NULL;
+    ctx->graph_id            = 0;
 
     ggml_backend_t cpu_backend = new ggml_backend {
         /* .guid    = */ ggml_backend_cpu_guid(),
@@ -279,6 +438,31 @@ void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_
     ctx->abort_callback_data = abort_callback_data;
 }
 
+void ggml_backend_cpu_set_graph_id(ggml_backend_t backend_cpu, uint64_t graph_id) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->graph_id = graph_id;
+}
+
+bool ggml_backend_cpu_graph_reserve(ggml_backend_t backend_cpu, const struct ggml_cgraph * cgraph, int n_threads) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+
+    const struct ggml_cplan cplan = ggml_graph_plan(cgraph, n_threads, NULL);
+
+    return ggml_backend_cpu_work_reserve(ctx, cplan.work_size);
+}
+
+void ggml_backend_cpu_set_node_callback(ggml_backend_t backend_cpu, ggml_cpu_node_callback node_callback, void * node_callback_data) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->node_callback      = node_callback;
+    ctx->node_callback_data = node_callback_data;
+}
+
 // CPU backend - device
 
 struct ggml_backend_cpu_device_context {
@@ -657,6 +841,15 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
     if (strcmp(name, "ggml_backend_set_abort_callback") == 0) {
         return (void *)ggml_backend_cpu_set_abort_callback;
     }
+    if (strcmp(name, "ggml_backend_cpu_set_graph_id") == 0) {
+        return (void *)ggml_backend_cpu_set_graph_id;
+    }
+    if (strcmp(name, "ggml_backend_cpu_graph_reserve") == 0) {
+        return (void *)ggml_backend_cpu_graph_reserve;
+    }
+    if (strcmp(name, "ggml_backend_cpu_set_node_callback") == 0) {
+        return (void *)ggml_backend_cpu_set_node_callback;
+    }
     if (strcmp(name, "ggml_backend_cpu_numa_init") == 0) {
         return (void *)ggml_numa_init;
     }
@@ -9,16 +9,30 @@ extern "C" {
 
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggml-org/ggml/issues/287
+    // called with each computed node of the graph, see ggml_cplan.node_callback
+    typedef void (*ggml_cpu_node_callback)(const struct ggml_tensor * node, void * user_data);
+
     struct ggml_cplan {
         size_t    work_size; // size of work buffer, calculated by `ggml_graph_plan()`
         uint8_t * work_data; // work buffer, to be allocated by caller before calling to `ggml_graph_compute()`
 
+        size_t    work_size_mm; // tail of the work buffer holding the quantized src1 of mul_mat nodes (included in work_size)
+
         int n_threads;
         struct ggml_threadpool * threadpool;
 
+        // nonzero when the caller identifies cgraph across calls (same nodes, shapes and addresses)
+        // the threadpool then keeps the level schedule of the graph instead of rebuilding it
+        uint64_t graph_id;
+
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        // called on the first thread once it has finished its share of a node (other threads may still be on it)
+        // meant for cheap notifications such as progress or prefetch hints, not for reading the node data
+        ggml_cpu_node_callback node_callback;
+        void *                 node_callback_data;
     };
 
     // numa strategies
@@ -33,6 +47,7 @@ extern "C" {
 
     GGML_BACKEND_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_BACKEND_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
+    GGML_BACKEND_API bool    ggml_numa_shard_tensor(const struct ggml_tensor * tensor); // place the rows of a weight on the nodes that multiply them (GGML_NUMA_STRATEGY_DISTRIBUTE)
 
     GGML_BACKEND_API struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value);
     GGML_BACKEND_API struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value);
@@ -130,6 +145,13 @@ extern "C" {
     GGML_BACKEND_API void ggml_backend_cpu_set_n_threads     (ggml_backend_t backend_cpu, int n_threads);
     GGML_BACKEND_API void ggml_backend_cpu_set_threadpool    (ggml_backend_t backend_cpu, ggml_threadpool_t threadpool);
     GGML_BACKEND_API void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data);
+    GGML_BACKEND_API void ggml_backend_cpu_set_node_callback (ggml_backend_t backend_cpu, ggml_cpu_node_callback node_callback, void * node_callback_data);
+
+    // graph_id != 0: the caller vouches that the graphs it computes are unchanged (same nodes, shapes, sources and
+    // addresses) for as long as the id stays the same, so their plans are looked up without walking the graphs
+    GGML_BACKEND_API void ggml_backend_cpu_set_graph_id      (ggml_backend_t backend_cpu, uint64_t graph_id);
+    // size the work buffer for the largest graph up front, e.g. with the graph of a scheduler reserve pass
+    GGML_BACKEND_API bool ggml_backend_cpu_graph_reserve     (ggml_backend_t backend_cpu, const struct ggml_cgraph * cgraph, int n_threads);
 
     GGML_BACKEND_API ggml_backend_reg_t ggml_backend_cpu_reg(void);
 
@@ -354,6 +354,13 @@ GGML_API bool ggml_op_can_inplace(enum ggml_op op);
 GGML_API void * ggml_aligned_malloc(size_t size);
 GGML_API void ggml_aligned_free(void * ptr, size_t size);
 
+// huge page backed allocations, selected with GGML_HUGEPAGES=thp|hugetlb|hugetlb1g
+// returns NULL when huge pages are disabled or unavailable, *mapped_size is the size to pass to ggml_hugepage_free
+GGML_API void * ggml_hugepage_malloc(size_t size, size_t * mapped_size);
+GGML_API void ggml_hugepage_free(void * ptr, size_t mapped_size);
+// bytes of [ptr, ptr + size) currently backed by huge pages, 0 when huge pages are disabled
+GGML_API size_t ggml_hugepage_bytes(const void * ptr, size_t size);
+
 // FP16 <-> FP32
 // ref: https://github.com/Maratyszcza/FP16
 
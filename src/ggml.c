@@ -71,6 +71,7 @@
 #include <sys/wait.h>
 #if defined(__linux__)
 #include <sys/prctl.h>
+#include <sys/mman.h>
 #endif
 
 #if defined(__ANDROID__)
@@ -363,6 +364,164 @@ void ggml_aligned_free(void * ptr, size_t size) {
 #endif
 }
 
+#define GGML_HUGEPAGE_SIZE ((size_t) 2*1024*1024)
+
+enum ggml_hugepage_mode {
+    GGML_HUGEPAGE_NONE,
+    GGML_HUGEPAGE_THP,       // anonymous mapping with MADV_HUGEPAGE
+    GGML_HUGEPAGE_HUGETLB,   // MAP_HUGETLB with the default (2 MB) size, THP fallback
+    GGML_HUGEPAGE_HUGETLB1G, // MAP_HUGETLB with 1 GB pages for buffers of at least 1 GB, 2 MB pages below, THP fallback
+};
+
+static enum ggml_hugepage_mode ggml_hugepage_get_mode(void) {
+    const char * mode = getenv("GGML_HUGEPAGES");
+    if (mode == NULL) {
+        return GGML_HUGEPAGE_NONE;
+    }
+    if (strcmp(mode, "thp") == 0 || strcmp(mode, "1") == 0) {
+        return GGML_HUGEPAGE_THP;
+    }
+    if (strcmp(mode, "hugetlb") == 0) {
+        return GGML_HUGEPAGE_HUGETLB;
+    }
+    if (strcmp(mode, "hugetlb1g") == 0) {
+        return GGML_HUGEPAGE_HUGETLB1G;
+    }
+    return GGML_HUGEPAGE_NONE;
+}
+
+void * ggml_hugepage_malloc(size_t size, size_t * mapped_size) {
+#if defined(__linux__)
+    const enum ggml_hugepage_mode mode = ggml_hugepage_get_mode();
+
+    // smaller buffers would mostly be padding
+    if (mode == GGML_HUGEPAGE_NONE || size < GGML_HUGEPAGE_SIZE) {
+        return NULL;
+    }
+
+    if (mode == GGML_HUGEPAGE_HUGETLB || mode == GGML_HUGEPAGE_HUGETLB1G) {
+        int    flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE;
+        size_t page  = GGML_HUGEPAGE_SIZE;
+#ifdef MAP_HUGE_SHIFT
+        // padding a smaller buffer to a whole 1 GB page would drain the reserved pool meant for the weights
+        if (mode == GGML_HUGEPAGE_HUGETLB1G && size >= (size_t) 1024*1024*1024) {
+            flags |= 30 << MAP_HUGE_SHIFT;
+            page   = (size_t) 1024*1024*1024;
+        } else {
+            // not the default huge page size, which may be 1 GB
+            flags |= 21 << MAP_HUGE_SHIFT;
+        }
+#endif
+        const size_t len = GGML_PAD(size, page);
+
+        void * ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (ptr != MAP_FAILED) {
+            *mapped_size = len;
+            return ptr;
+        }
+        GGML_LOG_DEBUG("%s: hugetlb mmap of %.2f MiB failed (%s), falling back to transparent huge pages\n",
+                __func__, len/(1024.0*1024.0), strerror(errno));
+    }
+
+    // over-allocate to align the start to a huge page, then trim
+    const size_t len = GGML_PAD(size, GGML_HUGEPAGE_SIZE);
+
+    char * raw = mmap(NULL, len + GGML_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    char * ptr = (char *) GGML_PAD((uintptr_t) raw, GGML_HUGEPAGE_SIZE);
+    if (ptr > raw) {
+        munmap(raw, ptr - raw);
+    }
+    if (raw + len + GGML_HUGEPAGE_SIZE > ptr + len) {
+        munmap(ptr + len, raw + len + GGML_HUGEPAGE_SIZE - (ptr + len));
+    }
+
+    if (madvise(ptr, len, MADV_HUGEPAGE) != 0) {
+        GGML_LOG_DEBUG("%s: madvise(MADV_HUGEPAGE) failed: %s\n", __func__, strerror(errno));
+    }
+
+    // fault the pages in now so that the kernel picks their size while the range is still unfragmented
+    for (size_t i = 0; i < len; i += GGML_HUGEPAGE_SIZE) {
+        ((volatile char *) ptr)[i] = 0;
+    }
+
+    *mapped_size = len;
+    return ptr;
+#else
+    GGML_UNUSED(size);
+    GGML_UNUSED(mapped_size);
+    return NULL;
+#endif
+}
+
+void ggml_hugepage_free(void * ptr, size_t mapped_size) {
+#if defined(__linux__)
+    if (ptr != NULL) {
+        munmap(ptr, mapped_size);
+    }
+#else
+    GGML_UNUSED(ptr);
+    GGML_UNUSED(mapped_size);
+#endif
+}
+
+size_t ggml_hugepage_bytes(const void * ptr, size_t size) {
+#if defined(__linux__)
+    // reading smaps walks every mapping of the process, not worth it when nothing was allocated on huge pages
+    if (ggml_hugepage_get_mode() == GGML_HUGEPAGE_NONE) {
+        return 0;
+    }
+
+    FILE * f = fopen("/proc/self/smaps", "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    const uintptr_t first = (uintptr_t) ptr;
+    const uintptr_t last  = first + size;
+
+    // overlap of the current mapping with [first, last)
+    uintptr_t overlap = 0;
+    uintptr_t vma_len = 0;
+
+    double total = 0.0;
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start;
+        unsigned long end;
+        unsigned long kb;
+
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            overlap = start < last && end > first ? MIN(end, last) - MAX(start, first) : 0;
+            vma_len = end - start;
+            continue;
+        }
+        if (overlap == 0) {
+            continue;
+        }
+        if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+            sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1 ||
+            sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1 ||
+            sscanf(line, "Shared_Hugetlb: %lu kB", &kb) == 1) {
+            // attribute the huge pages of a mapping that extends past the range proportionally
+            total += (double) kb*1024.0*overlap/vma_len;
+        }
+    }
+
+    fclose(f);
+
+    return MIN((size_t) total, size);
+#else
+    GGML_UNUSED(ptr);
+    GGML_UNUSED(size);
+    return 0;
+#endif
+}
+
 
 inline static void * ggml_malloc(size_t size) {
     if (size == 0) {
@@ -989,6 +1148,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "ARANGE",
     "TIMESTEP_EMBEDDING",
     "ARGSORT",
+    "TOP_K",
     "LEAKY_RELU",
 
     "FLASH_ATTN_EXT",
@@ -1019,7 +1179,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "GLU",
 };
 
-static_assert(GGML_OP_COUNT == 90, "GGML_OP_COUNT != 90");
+static_assert(GGML_OP_COUNT == 91, "GGML_OP_COUNT != 91");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -1093,6 +1253,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "arange(start, stop, step)",
     "timestep_embedding(timesteps, dim, max_period)",
     "argsort(x)",
+    "top_k(x)",
     "leaky_relu(x)",
 
     "flash_attn_ext(x)",
@@ -1123,7 +1284,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "glu(x)",
 };
 
-static_assert(GGML_OP_COUNT == 90, "GGML_OP_COUNT != 90");
+static_assert(GGML_OP_COUNT == 91, "GGML_OP_COUNT != 91");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -4992,13 +5153,12 @@ struct ggml_tensor * ggml_top_k(
         struct ggml_tensor  * a,
         int                   k) {
     GGML_ASSERT(a->ne[0] >= k);
+    GGML_ASSERT(k > 0);
 
-    struct ggml_tensor * result = ggml_argsort(ctx, a, GGML_SORT_ORDER_DESC);
+    struct ggml_tensor * result = ggml_new_tensor_4d(ctx, GGML_TYPE_I32, k, a->ne[1], a->ne[2], a->ne[3]);
 
-    result = ggml_view_4d(ctx, result,
-                k, result->ne[1], result->ne[2], result->ne[3],
-                   result->nb[1], result->nb[2], result->nb[3],
-                0);
+    result->op     = GGML_OP_TOP_K;
+    result->src[0] = a;
 
     return result;
 }
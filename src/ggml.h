@@ -528,6 +528,7 @@ extern "C" {
         GGML_OP_ARANGE,
         GGML_OP_TIMESTEP_EMBEDDING,
         GGML_OP_ARGSORT,
+        GGML_OP_TOP_K,
         GGML_OP_LEAKY_RELU,
 
         GGML_OP_FLASH_ATTN_EXT,
@@ -2168,13 +2169,16 @@ extern "C" {
             float                 stop,
             float                 step);
 
-    // top k elements per row
+    // indices of the top k elements per row, in descending order of value (ties: lower index first)
+    // result is I32 [k, ne1, ne2, ne3]
     GGML_API struct ggml_tensor * ggml_top_k(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
             int                   k);
 
-#define GGML_KQ_MASK_PAD 64
+// the CPU kernels read only the mask rows of the actual queries - no padding needed (the GPU kernels that read the
+// mask in tiles of 64 rows are not built)
+#define GGML_KQ_MASK_PAD 1
 
     // q:    [n_embd_k, n_batch,     n_head,    ne3 ]
     // k:    [n_embd_k, n_kv,        n_head_kv, ne3 ]
@@ -4,15 +4,25 @@
 
 // Forward declaration of our .Call routine
 extern SEXP llama_build_test(void);
-extern SEXP llama_generate_greedy(SEXP, SEXP, SEXP, SEXP);
-extern SEXP llama_generate_sampled(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP llama_generate_greedy(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP llama_generate_sampled(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 extern SEXP llama_chat_format(SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP llama_tune_threads(SEXP);
+extern SEXP llama_engine_new(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP llama_engine_submit(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP llama_engine_step(SEXP);
+extern SEXP llama_engine_status(SEXP);
 
 static const R_CallMethodDef CallEntries[] = {
     {"llama_build_test", (DL_FUNC) &llama_build_test, 0},
-    {"llama_generate_greedy", (DL_FUNC) &llama_generate_greedy, 4},
-    {"llama_generate_sampled", (DL_FUNC) &llama_generate_sampled, 11},
+    {"llama_generate_greedy", (DL_FUNC) &llama_generate_greedy, 9},
+    {"llama_generate_sampled", (DL_FUNC) &llama_generate_sampled, 16},
     {"llama_chat_format", (DL_FUNC) &llama_chat_format, 5},
+    {"llama_tune_threads", (DL_FUNC) &llama_tune_threads, 1},
+    {"llama_engine_new", (DL_FUNC) &llama_engine_new, 9},
+    {"llama_engine_submit", (DL_FUNC) &llama_engine_submit, 10},
+    {"llama_engine_step", (DL_FUNC) &llama_engine_step, 1},
+    {"llama_engine_status", (DL_FUNC) &llama_engine_status, 1},
     {NULL, NULL, 0}
 };
 
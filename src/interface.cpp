@@ -2,33 +2,51 @@
 
 #include <Rcpp.h>
 #include "llama.h"
+#include "llama-cpp.h"
 
 #include <thread>
 #include <random>
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <deque>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
 
 using namespace Rcpp;
 
 extern "C" SEXP llama_build_test();
-extern "C" SEXP llama_generate_greedy(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEXP n_ctx_);
+extern "C" SEXP llama_generate_greedy(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEXP n_ctx_,
+                                       SEXP cache_type_k_, SEXP cache_type_v_,
+                                       SEXP context_shift_, SEXP n_keep_, SEXP shift_discard_);
 extern "C" SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEXP n_ctx_,
                                         SEXP temperature_, SEXP top_p_, SEXP top_k_,
-                                        SEXP repeat_penalty_, SEXP repeat_last_n_, SEXP seed_, SEXP stop_);
+                                        SEXP repeat_penalty_, SEXP repeat_last_n_, SEXP seed_, SEXP stop_,
+                                        SEXP cache_type_k_, SEXP cache_type_v_,
+                                        SEXP context_shift_, SEXP n_keep_, SEXP shift_discard_);
 extern "C" SEXP llama_chat_format(SEXP model_path_, SEXP roles_, SEXP contents_, SEXP tmpl_, SEXP add_assistant_);
+extern "C" SEXP llama_tune_threads(SEXP model_path_);
+extern "C" SEXP llama_engine_new(SEXP model_path_, SEXP n_ctx_, SEXP n_parallel_, SEXP n_batch_, SEXP n_chunk_,
+                                  SEXP cache_type_k_, SEXP cache_type_v_, SEXP prefix_cache_, SEXP kv_block_);
+extern "C" SEXP llama_engine_submit(SEXP engine_, SEXP prompt_, SEXP n_predict_,
+                                     SEXP temperature_, SEXP top_p_, SEXP top_k_,
+                                     SEXP repeat_penalty_, SEXP repeat_last_n_, SEXP seed_, SEXP stop_);
+extern "C" SEXP llama_engine_step(SEXP engine_);
+extern "C" SEXP llama_engine_status(SEXP engine_);
 
 // --- tiny helpers ------------------------------------------------------------
 
-static unsigned env_threads_default() {
-  unsigned t = std::thread::hardware_concurrency();
-  if (const char *e = std::getenv("LLAMAR_N_THREADS")) {
-    int v = std::atoi(e);
-    if (v > 0) t = (unsigned) v;
-  }
-  return std::max(1u, t);
-}
-
 static bool env_use_mmap_default() {
   bool use_mmap = true;
   if (const char *e = std::getenv("LLAMAR_USE_MMAP")) {
@@ -37,29 +55,478 @@ static bool env_use_mmap_default() {
   return use_mmap;
 }
 
+// KV cache data type from its name ("f16", "q8_0", ...)
+static ggml_type cache_type_from_name(const std::string & name) {
+  static const ggml_type types[] = {
+    GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_BF16, GGML_TYPE_Q8_0,
+    GGML_TYPE_Q4_0, GGML_TYPE_Q4_1, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1, GGML_TYPE_IQ4_NL,
+  };
+  std::string valid;
+  for (ggml_type t : types) {
+    if (name == ggml_type_name(t)) return t;
+    valid += valid.empty() ? "" : ", ";
+    valid += ggml_type_name(t);
+  }
+  Rcpp::stop("Unsupported KV cache type '" + name + "' (expected one of: " + valid + ")");
+}
+
+// a quantized V cache is only read by the flash attention kernel, which dequantizes it on the fly
+static void set_cache_types(llama_context_params & cparams, ggml_type type_k, ggml_type type_v) {
+  cparams.type_k = type_k;
+  cparams.type_v = type_v;
+  if (ggml_is_quantized(type_v)) {
+    cparams.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+  }
+}
+
+// --- thread counts -----------------------------------------------------------
+//
+// decode is memory bound and usually peaks at the physical core count or below, prompt
+// processing is compute bound and wants every hardware thread: the two get separate counts.
+// llama_tune_threads() measures both on the model and caches them per (model, host).
+
+struct host_topology {
+  int n_logical  = 0; // online hardware threads
+  int n_physical = 0; // cores, SMT siblings counted once
+};
+
+struct thread_counts {
+  int decode = 0;
+  int batch  = 0;
+};
+
+static bool read_int_file(const std::string &path, int &v) {
+  std::ifstream f(path);
+  return static_cast<bool>(f >> v);
+}
+
+// cpu list in the sysfs format, e.g. "0-3,8-11"
+static std::vector<int> parse_cpu_list(const std::string &s) {
+  std::vector<int> cpus;
+  std::stringstream ss(s);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    int a = 0, b = 0;
+    const size_t dash = range.find('-');
+    try {
+      a = std::stoi(range.substr(0, dash));
+      b = dash == std::string::npos ? a : std::stoi(range.substr(dash + 1));
+    } catch (...) {
+      continue;
+    }
+    for (int c = a; c <= b; ++c) cpus.push_back(c);
+  }
+  return cpus;
+}
+
+static host_topology probe_topology() {
+  static host_topology topo;
+  if (topo.n_logical > 0) return topo;
+
+  const std::string sys = "/sys/devices/system/cpu/";
+
+  std::string online;
+  if (std::ifstream f(sys + "online"); f && std::getline(f, online)) {
+    std::set<std::pair<int, int>> cores; // (package, core)
+    int n_cpus = 0;
+    for (int cpu : parse_cpu_list(online)) {
+      const std::string dir = sys + "cpu" + std::to_string(cpu) + "/topology/";
+      int core = -1, pkg = 0;
+      if (!read_int_file(dir + "core_id", core)) continue;
+      read_int_file(dir + "physical_package_id", pkg);
+      cores.emplace(pkg, core);
+      n_cpus++;
+    }
+    topo.n_logical  = n_cpus;
+    topo.n_physical = (int) cores.size();
+  }
+
+#if defined(__APPLE__)
+  if (topo.n_physical == 0) {
+    int n = 0;
+    size_t len = sizeof(n);
+    if (sysctlbyname("hw.physicalcpu", &n, &len, nullptr, 0) == 0 && n > 0) topo.n_physical = n;
+    len = sizeof(n);
+    if (sysctlbyname("hw.logicalcpu", &n, &len, nullptr, 0) == 0 && n > 0) topo.n_logical = n;
+  }
+#endif
+
+  if (topo.n_logical <= 0) topo.n_logical = (int) std::max(1u, std::thread::hardware_concurrency());
+  if (topo.n_physical <= 0 || topo.n_physical > topo.n_logical) topo.n_physical = topo.n_logical;
+
+  return topo;
+}
+
+static std::string host_key(const host_topology &topo) {
+  char name[256] = "localhost";
+#if !defined(_WIN32)
+  if (gethostname(name, sizeof(name)) != 0) std::snprintf(name, sizeof(name), "localhost");
+  name[sizeof(name) - 1] = '\0';
+#else
+  if (const char *e = std::getenv("COMPUTERNAME")) std::snprintf(name, sizeof(name), "%s", e);
+#endif
+  return std::string(name) + ":" + std::to_string(topo.n_physical) + "c" + std::to_string(topo.n_logical) + "t";
+}
+
+// path, size and modification time: a re-downloaded or re-quantized file is tuned again
+static std::string model_key(const std::string &model_path) {
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  const fs::path p = fs::absolute(model_path, ec);
+  const auto size  = fs::file_size(p, ec);
+  const auto mtime = fs::last_write_time(p, ec).time_since_epoch().count();
+  return p.string() + ":" + std::to_string(size) + ":" + std::to_string((long long) mtime);
+}
+
+// LLAMAR_CACHE_DIR, else $XDG_CACHE_HOME/llamar, else ~/.cache/llamar
+static std::filesystem::path thread_cache_path() {
+  namespace fs = std::filesystem;
+  fs::path dir;
+  if (const char *e = std::getenv("LLAMAR_CACHE_DIR")) {
+    dir = e;
+  } else if (const char *e = std::getenv("XDG_CACHE_HOME")) {
+    dir = fs::path(e) / "llamar";
+  } else if (const char *e = std::getenv("HOME")) {
+    dir = fs::path(e) / ".cache" / "llamar";
+  } else if (const char *e = std::getenv("LOCALAPPDATA")) {
+    dir = fs::path(e) / "llamar";
+  } else {
+    return {};
+  }
+  return dir / "threads.tsv";
+}
+
+// one line per (host, model): host \t model \t decode \t batch
+static bool thread_cache_get(const std::string &host, const std::string &model, thread_counts &tc) {
+  const auto path = thread_cache_path();
+  if (path.empty()) return false;
+
+  std::ifstream f(path);
+  std::string line;
+  while (std::getline(f, line)) {
+    std::stringstream ss(line);
+    std::string h, m, d, b;
+    if (!std::getline(ss, h, '\t') || !std::getline(ss, m, '\t') ||
+        !std::getline(ss, d, '\t') || !std::getline(ss, b, '\t')) continue;
+    if (h != host || m != model) continue;
+    tc.decode = std::atoi(d.c_str());
+    tc.batch  = std::atoi(b.c_str());
+    return tc.decode > 0 && tc.batch > 0;
+  }
+  return false;
+}
+
+static void thread_cache_put(const std::string &host, const std::string &model, const thread_counts &tc) {
+  namespace fs = std::filesystem;
+  const auto path = thread_cache_path();
+  if (path.empty()) return;
+
+  std::error_code ec;
+  fs::create_directories(path.parent_path(), ec);
+
+  std::vector<std::string> lines;
+  {
+    std::ifstream f(path);
+    std::string line;
+    const std::string prefix = host + "\t" + model + "\t";
+    while (std::getline(f, line)) {
+      if (line.compare(0, prefix.size(), prefix) != 0) lines.push_back(line);
+    }
+  }
+  lines.push_back(host + "\t" + model + "\t" + std::to_string(tc.decode) + "\t" + std::to_string(tc.batch));
+
+  // write a sibling file and rename it, concurrent R sessions never see a partial cache
+  fs::path tmp = path;
+  tmp += "." + std::to_string((long long) std::chrono::steady_clock::now().time_since_epoch().count());
+  {
+    std::ofstream f(tmp, std::ios::trunc);
+    for (const auto &l : lines) f << l << '\n';
+    if (!f) {
+      fs::remove(tmp, ec);
+      return;
+    }
+  }
+  fs::rename(tmp, path, ec);
+  if (ec) fs::remove(tmp, ec);
+}
+
+// times prompt processing (n_batch tokens) and decode (single tokens) at a few thread counts
+// and keeps the fastest of each; returns false if the model cannot be run
+static bool tune_threads(llama_model *model, const host_topology &topo, thread_counts &best) {
+  const int n_batch  = 128;
+  const int n_decode = 16;
+
+  llama_context_params cparams = llama_context_default_params();
+  cparams.n_ctx           = n_batch + n_decode + 16;
+  cparams.n_batch         = n_batch;
+  cparams.n_ubatch        = n_batch;
+  cparams.offload_kqv     = false;
+  cparams.op_offload      = false;
+  cparams.n_threads       = topo.n_physical;
+  cparams.n_threads_batch = topo.n_logical;
+
+  llama_context *ctx = llama_init_from_model(model, cparams);
+  if (!ctx) return false;
+
+  const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+  std::vector<llama_token> prompt(n_batch);
+  for (int i = 0; i < n_batch; ++i) prompt[i] = (llama_token) ((i*7919 + 13) % std::max(1, n_vocab));
+
+  using clock = std::chrono::steady_clock;
+  auto seconds = [](clock::time_point t0) {
+    return std::chrono::duration<double>(clock::now() - t0).count();
+  };
+
+  // one pass: seconds per prompt token and per decoded token
+  auto run = [&](int n_threads, double &t_batch, double &t_decode) {
+    llama_set_n_threads(ctx, n_threads, n_threads);
+    llama_memory_clear(llama_get_memory(ctx), true);
+
+    auto t0 = clock::now();
+    if (llama_decode(ctx, llama_batch_get_one(prompt.data(), n_batch)) != 0) return false;
+    t_batch = seconds(t0) / n_batch;
+
+    llama_token tok = prompt.back();
+    t0 = clock::now();
+    for (int i = 0; i < n_decode; ++i) {
+      if (llama_decode(ctx, llama_batch_get_one(&tok, 1)) != 0) return false;
+    }
+    t_decode = seconds(t0) / n_decode;
+    return true;
+  };
+
+  std::set<int> candidates = { std::max(1, topo.n_physical / 2), std::max(1, topo.n_physical - 1),
+                               topo.n_physical, topo.n_logical };
+
+  // the first pass pages the weights in and is not counted
+  double tb = 0.0, td = 0.0;
+  bool ok = run(topo.n_physical, tb, td);
+
+  double best_batch = 1e30, best_decode = 1e30;
+  for (int n : candidates) {
+    if (!ok) break;
+    for (int rep = 0; rep < 2 && ok; ++rep) {
+      ok = run(n, tb, td);
+      if (tb < best_batch)  { best_batch  = tb; best.batch  = n; }
+      if (td < best_decode) { best_decode = td; best.decode = n; }
+    }
+  }
+
+  llama_free(ctx);
+  return ok && best.decode > 0 && best.batch > 0;
+}
+
+// LLAMAR_N_THREADS (and LLAMAR_N_THREADS_BATCH) override everything; then the tuning cache;
+// then, with LLAMAR_AUTOTUNE=1, a calibration run; otherwise physical cores for decode and
+// all hardware threads for prompt processing
+static thread_counts threads_for_model(llama_model *model, const std::string &model_path) {
+  const host_topology topo = probe_topology();
+
+  thread_counts tc;
+  if (const char *e = std::getenv("LLAMAR_N_THREADS")) {
+    tc.decode = tc.batch = std::max(0, std::atoi(e));
+  }
+  if (const char *e = std::getenv("LLAMAR_N_THREADS_BATCH")) {
+    tc.batch = std::max(0, std::atoi(e));
+  }
+
+  if (tc.decode <= 0 || tc.batch <= 0) {
+    const std::string host = host_key(topo);
+    const std::string key  = model_key(model_path);
+
+    thread_counts tuned;
+    bool have = thread_cache_get(host, key, tuned);
+    if (!have) {
+      const char *e = std::getenv("LLAMAR_AUTOTUNE");
+      if (e && std::atoi(e) != 0 && tune_threads(model, topo, tuned)) {
+        thread_cache_put(host, key, tuned);
+        have = true;
+      }
+    }
+    if (!have) {
+      tuned.decode = topo.n_physical;
+      tuned.batch  = topo.n_logical;
+    }
+
+    if (tc.decode <= 0) tc.decode = tuned.decode;
+    if (tc.batch  <= 0) tc.batch  = tuned.batch;
+  }
+
+  return tc;
+}
+
+// LLAMAR_PREFETCH=<layers ahead>, LLAMAR_PREFETCH_EVICT=1 to also drop computed layers (mmap only)
+static void env_prefetch_default(llama_model_params & mparams) {
+  if (const char *e = std::getenv("LLAMAR_PREFETCH")) {
+    mparams.n_prefetch_layers = std::max(0, std::atoi(e));
+  }
+  if (const char *e = std::getenv("LLAMAR_PREFETCH_EVICT")) {
+    mparams.prefetch_evict = std::atoi(e) != 0;
+  }
+}
+
+// LLAMAR_NUMA=distribute|isolate|numactl; ggml only accepts one NUMA init per process
+static void env_numa_init() {
+  static bool done = false;
+  if (done) return;
+  done = true;
+
+  const char *e = std::getenv("LLAMAR_NUMA");
+  if (!e) return;
+
+  const std::string s(e);
+  ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
+  if      (s == "distribute") numa = GGML_NUMA_STRATEGY_DISTRIBUTE;
+  else if (s == "isolate")    numa = GGML_NUMA_STRATEGY_ISOLATE;
+  else if (s == "numactl")    numa = GGML_NUMA_STRATEGY_NUMACTL;
+  llama_numa_init(numa);
+}
+
+// --- context shift -----------------------------------------------------------
+//
+// generation that reaches n_ctx drops part of the context instead of failing: the first n_keep
+// tokens stay, a fraction of the tokens after them is removed and the rest slides down. The KV
+// cache re-rotates the shifted keys (RoPE shift) on the next decode, nothing is re-processed.
+
+struct context_shift_params {
+  bool   enabled = true;
+  int    n_keep  = 0;   // tokens kept at the start, BOS included; < 0 keeps the whole prompt
+  double discard = 0.5; // fraction of the tokens after n_keep dropped per shift
+};
+
+static context_shift_params context_shift_from(SEXP context_shift_, SEXP n_keep_, SEXP shift_discard_) {
+  context_shift_params cs;
+  cs.enabled = as<bool>(context_shift_);
+  cs.n_keep  = as<int>(n_keep_);
+  cs.discard = as<double>(shift_discard_);
+  if (!(cs.discard > 0.0 && cs.discard <= 1.0)) Rcpp::stop("shift_discard must be in (0, 1]");
+  return cs;
+}
+
+// resolve n_keep against the prompt: BOS is always kept, and at most half of the context so that
+// a shift can always free room
+static void context_shift_resolve(context_shift_params &cs, const llama_vocab *vocab, int n_prompt, int n_ctx) {
+  if (cs.n_keep < 0 || cs.n_keep > n_prompt) cs.n_keep = n_prompt;
+  if (llama_vocab_get_add_bos(vocab) && n_prompt > 0) cs.n_keep = std::max(cs.n_keep, 1);
+  cs.n_keep = std::min(cs.n_keep, n_ctx/2);
+}
+
+// a prompt that leaves no room for generation keeps its first n_keep tokens and its tail
+static void context_shift_truncate(const context_shift_params &cs, std::vector<llama_token> &tokens, int n_ctx) {
+  if (!cs.enabled || (int) tokens.size() < n_ctx) return;
+  const int n_tail = std::min(n_ctx - cs.n_keep - 1, std::max(1, (int) ((n_ctx - cs.n_keep)*(1.0 - cs.discard))));
+  tokens.erase(tokens.begin() + cs.n_keep, tokens.end() - n_tail);
+}
+
+// make room in sequence 0 for n_tokens more tokens, false if they cannot fit
+static bool context_make_room(llama_context *ctx, const context_shift_params &cs, int n_tokens) {
+  const int n_ctx    = (int) llama_n_ctx(ctx);
+  llama_memory_t mem = llama_get_memory(ctx);
+
+  const int n_past = (int) llama_memory_seq_pos_max(mem, 0) + 1;
+  if (n_past + n_tokens <= n_ctx) return true;
+  if (!cs.enabled || !llama_memory_can_shift(mem)) return false;
+
+  const int n_keep = std::min(cs.n_keep, n_past);
+  const int n_left = n_past - n_keep;
+
+  const int n_discard = std::max((int) (n_left*cs.discard), n_past + n_tokens - n_ctx);
+  if (n_discard > n_left) return false;
+
+  llama_memory_seq_rm (mem, 0, n_keep, n_keep + n_discard);
+  llama_memory_seq_add(mem, 0, n_keep + n_discard, n_past, -n_discard);
+
+  return true;
+}
+
+// --- sampling ----------------------------------------------------------------
+
+struct sampling_params {
+  double temperature    = 0.8;
+  double top_p          = 0.95;
+  int    top_k          = 40;
+  double repeat_penalty = 1.0;
+  int    repeat_last_n  = 64;
+  int    seed           = 0;   // 0 - random
+};
+
+// out-of-range values fall back to the neutral setting
+static void sampling_sanitize(sampling_params &sp) {
+  if (!(sp.temperature > 0.0)) sp.temperature = 1.0;
+  if (!(sp.top_p > 0.0 && sp.top_p <= 1.0)) sp.top_p = 1.0;
+  if (sp.top_k <= 0) sp.top_k = 1;
+  if (!(sp.repeat_penalty > 0.0)) sp.repeat_penalty = 1.0;
+  if (sp.repeat_last_n < 0) sp.repeat_last_n = 0;
+}
+
+// penalties -> top-k -> top-p -> temperature -> dist; nullptr if a sampler cannot be created
+static llama_sampler * sampler_chain_new(const sampling_params &sp, int n_ctx) {
+  llama_sampler * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+  if (!chain) return nullptr;
+
+  bool ok = true;
+  auto add = [&](llama_sampler *s) {
+    if (s) llama_sampler_chain_add(chain, s);
+    ok = ok && s;
+  };
+
+  // repetition penalties (only if meaningful)
+  if (sp.repeat_penalty != 1.0) {
+    int lastn = sp.repeat_last_n == 0 ? 64 : sp.repeat_last_n;
+    lastn = std::max(0, std::min(lastn, n_ctx));
+    add(llama_sampler_init_penalties(lastn, (float) sp.repeat_penalty,
+                                     /*alpha_frequency*/0.0f,
+                                     /*alpha_presence*/0.0f));
+  }
+
+  // top-k / top-p
+  if (sp.top_k > 1) add(llama_sampler_init_top_k(sp.top_k));
+  if (sp.top_p > 0.0 && sp.top_p < 1.0) add(llama_sampler_init_top_p((float) sp.top_p, /*min_keep*/1));
+
+  // temperature or greedy
+  if (sp.temperature > 0.0) add(llama_sampler_init_temp((float) sp.temperature));
+  else                      add(llama_sampler_init_greedy());
+
+  // RNG / distribution
+  add(llama_sampler_init_dist(sp.seed == 0 ? LLAMA_DEFAULT_SEED : (uint32_t) sp.seed));
+
+  if (!ok) {
+    llama_sampler_free(chain);
+    return nullptr;
+  }
+  return chain;
+}
+
 SEXP llama_build_test() {
   return Rf_mkString("Success! R package can see llama.cpp headers.");
 }
 
 // --- GREEDY ------------------------------------------------------------------
 
-SEXP llama_generate_greedy(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEXP n_ctx_) {
+SEXP llama_generate_greedy(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEXP n_ctx_,
+                           SEXP cache_type_k_, SEXP cache_type_v_,
+                           SEXP context_shift_, SEXP n_keep_, SEXP shift_discard_) {
   try {
     std::string model_path = as<std::string>(model_path_);
     std::string prompt     = as<std::string>(prompt_);
     int n_predict          = as<int>(n_predict_);
     int n_ctx              = as<int>(n_ctx_);
+    const ggml_type type_k = cache_type_from_name(as<std::string>(cache_type_k_));
+    const ggml_type type_v = cache_type_from_name(as<std::string>(cache_type_v_));
+    context_shift_params cs = context_shift_from(context_shift_, n_keep_, shift_discard_);
 
     if (model_path.empty()) Rcpp::stop("Model path is empty");
     if (n_predict <= 0)     return Rf_mkString("");
 
     // init backend
     llama_backend_init();
+    env_numa_init();
 
     // model params (CPU only)
     llama_model_params mparams = llama_model_default_params();
     mparams.n_gpu_layers = 0;
     mparams.use_mmap     = env_use_mmap_default();
+    env_prefetch_default(mparams);
     mparams.use_mlock    = false;
 
     llama_model * model = llama_model_load_from_file(model_path.c_str(), mparams);
@@ -73,8 +540,10 @@ SEXP llama_generate_greedy(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEXP
     cparams.n_ctx            = std::max(8, n_ctx <= 0 ? 512 : n_ctx);
     cparams.offload_kqv      = false;
     cparams.op_offload       = false;
-    cparams.n_threads        = env_threads_default();
-    cparams.n_threads_batch  = cparams.n_threads;
+    const thread_counts nt   = threads_for_model(model, model_path);
+    cparams.n_threads        = nt.decode;
+    cparams.n_threads_batch  = nt.batch;
+    set_cache_types(cparams, type_k, type_v);
 
     llama_context * ctx = llama_init_from_model(model, cparams);
     if (!ctx) {
@@ -98,6 +567,9 @@ SEXP llama_generate_greedy(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEXP
       Rcpp::stop("Invalid vocabulary size from model");
     }
 
+    // argmax in-graph: only the best token id comes back, not n_vocab logits
+    llama_set_logits_top_k(ctx, 1);
+
     // tokenize
     std::vector<llama_token> tokens;
     tokens.resize(std::max<int>(32, (int)prompt.size() + 8));
@@ -112,6 +584,10 @@ SEXP llama_generate_greedy(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEXP
     }
     tokens.resize(ntok);
 
+    const int n_ctx_eff = (int) llama_n_ctx(ctx);
+    context_shift_resolve(cs, vocab, ntok, n_ctx_eff);
+    context_shift_truncate(cs, tokens, n_ctx_eff);
+
     // feed prompt
     llama_batch batch = llama_batch_get_one(tokens.data(), (int32_t)tokens.size());
     int32_t rc = llama_decode(ctx, batch);
@@ -128,21 +604,20 @@ SEXP llama_generate_greedy(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEXP
     std::vector<char> piece(4096);
 
     for (int i = 0; i < n_predict; ++i) {
+      if (!context_make_room(ctx, cs, 1)) break;
+
       llama_token last = tokens.back();
       llama_batch b = llama_batch_get_one(&last, 1);
       if (b.logits) b.logits[0] = 1;      // request logits
 
       rc = llama_decode(ctx, b);
-      if (rc < 0) break;
+      if (rc != 0) break;
 
-      float * logits = llama_get_logits(ctx);
-      if (!logits) break;
+      const llama_token * top_ids    = nullptr;
+      const float       * top_logits = nullptr;
+      if (llama_get_logits_top_k_ith(ctx, 0, &top_ids, &top_logits) < 1) break;
 
-      int best_id = 0;
-      float best_logit = logits[0];
-      for (int vid = 1; vid < n_vocab; ++vid) {
-        if (logits[vid] > best_logit) { best_logit = logits[vid]; best_id = vid; }
-      }
+      const int best_id = top_ids[0];
 
       tokens.push_back((llama_token)best_id);
 
@@ -178,18 +653,24 @@ SEXP llama_generate_greedy(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEXP
 
 SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEXP n_ctx_,
                             SEXP temperature_, SEXP top_p_, SEXP top_k_,
-                            SEXP repeat_penalty_, SEXP repeat_last_n_, SEXP seed_, SEXP stop_) {
+                            SEXP repeat_penalty_, SEXP repeat_last_n_, SEXP seed_, SEXP stop_,
+                            SEXP cache_type_k_, SEXP cache_type_v_,
+                            SEXP context_shift_, SEXP n_keep_, SEXP shift_discard_) {
   try {
     std::string model_path = as<std::string>(model_path_);
     std::string prompt     = as<std::string>(prompt_);
     int n_predict          = as<int>(n_predict_);
     int n_ctx              = as<int>(n_ctx_);
-    double temperature     = as<double>(temperature_);
-    double top_p           = as<double>(top_p_);
-    int top_k              = as<int>(top_k_);
-    double repeat_penalty  = as<double>(repeat_penalty_);
-    int repeat_last_n      = as<int>(repeat_last_n_);
-    int seed               = as<int>(seed_);
+    sampling_params sp;
+    sp.temperature         = as<double>(temperature_);
+    sp.top_p               = as<double>(top_p_);
+    sp.top_k               = as<int>(top_k_);
+    sp.repeat_penalty      = as<double>(repeat_penalty_);
+    sp.repeat_last_n       = as<int>(repeat_last_n_);
+    sp.seed                = as<int>(seed_);
+    const ggml_type type_k = cache_type_from_name(as<std::string>(cache_type_k_));
+    const ggml_type type_v = cache_type_from_name(as<std::string>(cache_type_v_));
+    context_shift_params cs = context_shift_from(context_shift_, n_keep_, shift_discard_);
 
     std::vector<std::string> stops;
     if (!Rf_isNull(stop_)) {
@@ -202,19 +683,16 @@ SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEX
     if (model_path.empty()) Rcpp::stop("Model path is empty");
     if (n_predict <= 0)     return Rf_mkString("");
 
-    // sanitize sampling params
-    if (!(temperature > 0.0)) temperature = 1.0;
-    if (!(top_p > 0.0 && top_p <= 1.0)) top_p = 1.0;
-    if (top_k <= 0) top_k = 1;
-    if (!(repeat_penalty > 0.0)) repeat_penalty = 1.0;
-    if (repeat_last_n < 0) repeat_last_n = 0;
+    sampling_sanitize(sp);
 
     llama_backend_init();
+    env_numa_init();
 
     // model params (CPU only)
     llama_model_params mparams = llama_model_default_params();
     mparams.n_gpu_layers = 0;
     mparams.use_mmap     = env_use_mmap_default();
+    env_prefetch_default(mparams);
     mparams.use_mlock    = false;
 
     llama_model * model = llama_model_load_from_file(model_path.c_str(), mparams);
@@ -228,8 +706,10 @@ SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEX
     cparams.n_ctx            = std::max(8, n_ctx <= 0 ? 512 : n_ctx);
     cparams.offload_kqv      = false;
     cparams.op_offload       = false;
-    cparams.n_threads        = env_threads_default();
-    cparams.n_threads_batch  = cparams.n_threads;
+    const thread_counts nt   = threads_for_model(model, model_path);
+    cparams.n_threads        = nt.decode;
+    cparams.n_threads_batch  = nt.batch;
+    set_cache_types(cparams, type_k, type_v);
 
     llama_context * ctx = llama_init_from_model(model, cparams);
     if (!ctx) {
@@ -253,6 +733,13 @@ SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEX
       Rcpp::stop("Invalid vocabulary size from model");
     }
 
+    // when the chain starts with top-k, let the graph select those candidates instead of
+    // copying out all n_vocab logits (penalties may promote tokens from outside the top k)
+    if (sp.top_k > n_vocab) sp.top_k = n_vocab;
+    const bool use_penalties = sp.repeat_penalty != 1.0;
+    const bool top_k_in_graph = !use_penalties && sp.top_k > 1;
+    if (top_k_in_graph) llama_set_logits_top_k(ctx, sp.top_k);
+
     // tokenize
     std::vector<llama_token> tokens;
     tokens.resize(std::max<int>(32, (int)prompt.size() + 8));
@@ -267,6 +754,10 @@ SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEX
     }
     tokens.resize(ntok);
 
+    const int n_ctx_eff = (int) llama_n_ctx(ctx);
+    context_shift_resolve(cs, vocab, ntok, n_ctx_eff);
+    context_shift_truncate(cs, tokens, n_ctx_eff);
+
     // feed prompt (single batch)
     llama_batch batch = llama_batch_get_one(tokens.data(), (int32_t)tokens.size());
     int32_t rc = llama_decode(ctx, batch);
@@ -282,8 +773,8 @@ SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEX
       llama_token last_tok = tokens.back();
       llama_batch lastb = llama_batch_get_one(&last_tok, 1);
       if (lastb.logits) lastb.logits[0] = 1;
-      rc = llama_decode(ctx, lastb);
-      if (rc < 0) {
+      rc = context_make_room(ctx, cs, 1) ? llama_decode(ctx, lastb) : -1;
+      if (rc != 0) {
         llama_free(ctx);
         llama_model_free(model);
         llama_backend_free();
@@ -291,9 +782,8 @@ SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEX
       }
     }
 
-    // build sampler chain (defensive: check each sampler)
-    llama_sampler_chain_params chain_params = llama_sampler_chain_default_params();
-    struct llama_sampler * chain = llama_sampler_chain_init(chain_params);
+    // build sampler chain
+    struct llama_sampler * chain = sampler_chain_new(sp, (int) cparams.n_ctx);
     if (!chain) {
       llama_free(ctx);
       llama_model_free(model);
@@ -301,40 +791,6 @@ SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEX
       Rcpp::stop("Failed to initialize sampler chain");
     }
 
-    auto add_sampler = [&](llama_sampler *s, const char *name) {
-      if (!s) {
-        llama_sampler_free(chain);
-        llama_free(ctx);
-        llama_model_free(model);
-        llama_backend_free();
-        Rcpp::stop(std::string("Failed to init sampler: ") + name);
-      }
-      llama_sampler_chain_add(chain, s);
-    };
-
-    // repetition penalties (only if meaningful)
-    if (repeat_penalty != 1.0 || repeat_last_n > 0) {
-      int lastn = repeat_last_n == 0 ? 64 : repeat_last_n;
-      lastn = std::max(0, std::min(lastn, static_cast<int>(cparams.n_ctx)));
-      add_sampler(llama_sampler_init_penalties(lastn, (float)repeat_penalty,
-                                               /*alpha_frequency*/0.0f,
-                                               /*alpha_presence*/0.0f),
-                  "penalties");
-    }
-
-    // top-k / top-p
-    if (top_k > n_vocab) top_k = n_vocab;
-    if (top_k > 1) add_sampler(llama_sampler_init_top_k(top_k), "top_k");
-    if (top_p > 0.0 && top_p < 1.0) add_sampler(llama_sampler_init_top_p((float)top_p, /*min_keep*/1), "top_p");
-
-    // temperature or greedy
-    if (temperature > 0.0) add_sampler(llama_sampler_init_temp((float)temperature), "temp");
-    else                   add_sampler(llama_sampler_init_greedy(), "greedy");
-
-    // RNG / distribution
-    uint32_t sseed = (seed == 0) ? LLAMA_DEFAULT_SEED : (uint32_t) seed;
-    add_sampler(llama_sampler_init_dist(sseed), "dist");
-
     // generation loop
     std::string generated;
     generated.reserve(1024);
@@ -342,8 +798,12 @@ SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEX
 
     for (int i = 0; i < n_predict; ++i) {
       // guard: logits must be present before sampling
-      const float * logits_ptr = llama_get_logits(ctx);
-      if (!logits_ptr) {
+      const llama_token * top_ids    = nullptr;
+      const float       * top_logits = nullptr;
+      const bool has_logits = top_k_in_graph
+        ? llama_get_logits_top_k_ith(ctx, 0, &top_ids, &top_logits) > 0
+        : llama_get_logits(ctx) != nullptr;
+      if (!has_logits) {
         llama_sampler_free(chain);
         llama_free(ctx);
         llama_model_free(model);
@@ -363,16 +823,20 @@ SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEX
       // update sampler internal state
       llama_sampler_accept(chain, new_id);
 
-      // decode next step, requesting logits for the newly generated token
-      llama_batch b = llama_batch_get_one(&new_id, 1);
-      if (b.logits) b.logits[0] = 1;
-      rc = llama_decode(ctx, b);
-      if (rc < 0) {
-        llama_sampler_free(chain);
-        llama_free(ctx);
-        llama_model_free(model);
-        llama_backend_free();
-        Rcpp::stop("llama_decode failed during generation");
+      // decode next step, requesting logits for the newly generated token; a full context
+      // that cannot shift ends generation with the text so far
+      const bool has_room = context_make_room(ctx, cs, 1);
+      if (has_room) {
+        llama_batch b = llama_batch_get_one(&new_id, 1);
+        if (b.logits) b.logits[0] = 1;
+        rc = llama_decode(ctx, b);
+        if (rc < 0) {
+          llama_sampler_free(chain);
+          llama_free(ctx);
+          llama_model_free(model);
+          llama_backend_free();
+          Rcpp::stop("llama_decode failed during generation");
+        }
       }
 
       // append text
@@ -401,6 +865,8 @@ SEXP llama_generate_sampled(SEXP model_path_, SEXP prompt_, SEXP n_predict_, SEX
           }
         }
       }
+
+      if (!has_room || rc != 0) break;
     }
 
     llama_sampler_free(chain);
@@ -495,3 +961,444 @@ SEXP llama_chat_format(SEXP model_path_, SEXP roles_, SEXP contents_, SEXP tmpl_
     Rcpp::stop("llama_chat_format: unknown error");
   }
 }
+
+// --- THREAD TUNING -----------------------------------------------------------
+
+SEXP llama_tune_threads(SEXP model_path_) {
+  try {
+    std::string model_path = as<std::string>(model_path_);
+    if (model_path.empty()) Rcpp::stop("Model path is empty");
+
+    llama_backend_init();
+    env_numa_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+    mparams.use_mmap     = env_use_mmap_default();
+    env_prefetch_default(mparams);
+    mparams.use_mlock    = false;
+
+    llama_model * model = llama_model_load_from_file(model_path.c_str(), mparams);
+    if (!model) {
+      llama_backend_free();
+      Rcpp::stop(std::string("Failed to load model: ") + model_path);
+    }
+
+    const host_topology topo = probe_topology();
+    thread_counts tc;
+    const bool ok = tune_threads(model, topo, tc);
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    if (!ok) Rcpp::stop("Thread calibration failed (could not run the model)");
+
+    thread_cache_put(host_key(topo), model_key(model_path), tc);
+
+    IntegerVector res = IntegerVector::create(
+      _["decode"] = tc.decode, _["batch"] = tc.batch,
+      _["physical"] = topo.n_physical, _["logical"] = topo.n_logical);
+    return res;
+
+  } catch (std::exception &e) {
+    Rcpp::stop(std::string("llama_tune_threads error: ") + e.what());
+  } catch (...) {
+    Rcpp::stop("llama_tune_threads: unknown error");
+  }
+}
+
+// --- CONTINUOUS BATCHING ENGINE ----------------------------------------------
+//
+// one model and one context serve a queue of requests. Every step decodes the next token of each
+// running request together with a bounded chunk of prompt tokens of the requests still in prefill,
+// so a long prompt delays the others by one chunk per step instead of by its whole prefill. Each
+// running request owns a sequence of a unified KV cache; the sequence ids are recycled as requests
+// finish, prompts that start like an earlier one reuse its cells through the prefix cache, and the
+// cells are allocated in per-sequence blocks so that finished requests free whole blocks.
+
+struct engine_request {
+  int id = 0;
+  std::vector<llama_token> tokens; // prompt, then the sampled tokens
+  int n_prompt  = 0;
+  int n_predict = 0;
+  int n_sampled = 0;
+  std::vector<std::string> stops;
+  llama_sampler_ptr chain;
+  std::string text;
+
+  llama_seq_id seq = -1;
+  int  n_past = 0;     // tokens[0, n_past) are in the KV cache, the rest go into the next batches
+  bool stored = false; // prompt stored in the prefix cache
+  int  n_batch = 0;    // tokens in the current batch
+  int  i_out   = -1;   // row of the logits of the last one, -1 if it is not the last token
+};
+
+struct llama_engine {
+  llama_model   * model = nullptr;
+  llama_context * ctx   = nullptr;
+  const llama_vocab * vocab = nullptr;
+
+  llama_batch batch = {};
+  int  n_batch = 0;     // tokens per step
+  int  n_chunk = 0;     // prompt tokens per step
+  bool prefix  = false; // prefix cache enabled
+
+  int next_id = 1;
+
+  std::deque<engine_request>  queue;
+  std::vector<engine_request> running; // in admission order
+  std::vector<llama_seq_id>   seq_free;
+  std::vector<std::pair<int, std::string>> done;
+
+  ~llama_engine() {
+    queue.clear();
+    running.clear();
+    if (batch.token) llama_batch_free(batch);
+    if (ctx)   llama_free(ctx);
+    if (model) llama_model_free(model);
+  }
+};
+
+static llama_engine * engine_get(SEXP engine_) {
+  XPtr<llama_engine> xp(engine_);
+  llama_engine * e = xp.get();
+  if (!e) Rcpp::stop("The engine is no longer valid (it does not survive saving and reloading the session)");
+  return e;
+}
+
+static std::vector<llama_token> tokenize_prompt(const llama_vocab *vocab, const std::string &prompt) {
+  std::vector<llama_token> tokens(std::max<int>(32, (int) prompt.size() + 8));
+  int32_t ntok = llama_tokenize(vocab, prompt.c_str(), (int32_t) prompt.size(),
+                                tokens.data(), (int32_t) tokens.size(),
+                                /*add_special=*/true, /*parse_special=*/false);
+  if (ntok < 0) {
+    tokens.resize(-ntok);
+    ntok = llama_tokenize(vocab, prompt.c_str(), (int32_t) prompt.size(),
+                          tokens.data(), (int32_t) tokens.size(), true, false);
+  }
+  tokens.resize(std::max(0, ntok));
+  return tokens;
+}
+
+static void append_piece(const llama_vocab *vocab, llama_token id, std::string &out) {
+  char buf[256];
+  int32_t n = llama_token_to_piece(vocab, id, buf, (int32_t) sizeof(buf), /*lstrip=*/0, /*special=*/true);
+  if (n >= 0) {
+    out.append(buf, n);
+    return;
+  }
+  std::vector<char> piece(-n);
+  n = llama_token_to_piece(vocab, id, piece.data(), (int32_t) piece.size(), 0, true);
+  if (n > 0) out.append(piece.data(), n);
+}
+
+// the request leaves its sequence, which goes back to the pool
+static void engine_release(llama_engine &e, engine_request &r) {
+  llama_memory_seq_rm(llama_get_memory(e.ctx), r.seq, -1, -1);
+  e.seq_free.push_back(r.seq);
+  r.seq    = -1;
+  r.n_past = 0;
+  r.stored = false;
+}
+
+static void engine_finish(llama_engine &e, size_t i) {
+  engine_request &r = e.running[i];
+  engine_release(e, r);
+  e.done.emplace_back(r.id, std::move(r.text));
+  e.running.erase(e.running.begin() + i);
+}
+
+// queued requests take the free sequences; the cells of a stored prefix of their prompt are attached
+// instead of computed
+static void engine_admit(llama_engine &e) {
+  llama_memory_t mem = llama_get_memory(e.ctx);
+  while (!e.queue.empty() && !e.seq_free.empty()) {
+    engine_request r = std::move(e.queue.front());
+    e.queue.pop_front();
+
+    r.seq = e.seq_free.back();
+    e.seq_free.pop_back();
+
+    if (e.prefix) {
+      r.n_past = llama_memory_prefix_attach(mem, r.seq, r.tokens.data(), (int32_t) r.tokens.size());
+    } else {
+      llama_memory_seq_rm(mem, r.seq, -1, -1);
+      r.n_past = 0;
+    }
+    e.running.push_back(std::move(r));
+  }
+}
+
+// the pending token of every decoding request, then prompt chunks in admission order; returns the
+// number of tokens in the batch
+static int engine_fill_batch(llama_engine &e) {
+  llama_batch &b = e.batch;
+  b.n_tokens = 0;
+
+  auto add = [&](engine_request &r, int n) {
+    for (int k = 0; k < n; ++k) {
+      const int i = b.n_tokens++;
+      b.token[i]     = r.tokens[r.n_past + k];
+      b.pos[i]       = r.n_past + k;
+      b.n_seq_id[i]  = 1;
+      b.seq_id[i][0] = r.seq;
+      b.logits[i]    = r.n_past + k + 1 == (int) r.tokens.size();
+      if (b.logits[i]) r.i_out = i;
+    }
+    r.n_batch = n;
+  };
+
+  for (auto &r : e.running) {
+    r.n_batch = 0;
+    r.i_out   = -1;
+    if ((int) r.tokens.size() - r.n_past == 1) add(r, 1);
+  }
+
+  int n_chunk = std::min(e.n_chunk, e.n_batch - b.n_tokens);
+  for (auto &r : e.running) {
+    const int n_left = (int) r.tokens.size() - r.n_past;
+    if (n_left <= 1 || n_chunk <= 0) continue;
+    const int n = std::min(n_left, n_chunk);
+    add(r, n);
+    n_chunk -= n;
+  }
+
+  return b.n_tokens;
+}
+
+// sample the next token of the requests whose last token was in the batch
+static void engine_sample(llama_engine &e) {
+  llama_memory_t mem = llama_get_memory(e.ctx);
+  const int n_ctx = (int) llama_n_ctx(e.ctx);
+
+  for (size_t i = 0; i < e.running.size(); ) {
+    engine_request &r = e.running[i];
+
+    if (e.prefix && !r.stored && r.n_past >= r.n_prompt) {
+      llama_memory_prefix_store(mem, r.seq, r.tokens.data(), r.n_prompt);
+      r.stored = true;
+    }
+
+    if (r.i_out < 0) {
+      ++i;
+      continue;
+    }
+
+    const llama_token id = llama_sampler_sample(r.chain.get(), e.ctx, r.i_out);
+    llama_sampler_accept(r.chain.get(), id);
+    r.tokens.push_back(id);
+    r.n_sampled++;
+
+    bool finished = llama_vocab_is_eog(e.vocab, id);
+    if (!finished) {
+      append_piece(e.vocab, id, r.text);
+      for (const auto &s : r.stops) {
+        if (!s.empty() && r.text.size() >= s.size() &&
+            r.text.compare(r.text.size() - s.size(), s.size(), s) == 0) {
+          r.text.resize(r.text.size() - s.size()); // trim stop sequence
+          finished = true;
+          break;
+        }
+      }
+    }
+    finished = finished || r.n_sampled >= r.n_predict || (int) r.tokens.size() > n_ctx;
+
+    if (finished) {
+      engine_finish(e, i);
+    } else {
+      ++i;
+    }
+  }
+}
+
+// admit queued requests, decode one batch and sample
+static void engine_step(llama_engine &e) {
+  engine_admit(e);
+
+  while (engine_fill_batch(e) > 0) {
+    const int32_t rc = llama_decode(e.ctx, e.batch);
+    if (rc == 0) {
+      for (auto &r : e.running) r.n_past += r.n_batch;
+      engine_sample(e);
+      return;
+    }
+    if (rc != 1) Rcpp::stop("llama_decode failed (rc=" + std::to_string(rc) + ")");
+
+    // the KV cache is full: the last admitted request gives its cells back and is recomputed from its
+    // tokens when a sequence frees up; a request that does not fit alone ends with its text so far
+    if (e.running.size() == 1) {
+      engine_finish(e, 0);
+      continue;
+    }
+    engine_request r = std::move(e.running.back());
+    e.running.pop_back();
+    engine_release(e, r);
+    e.queue.push_front(std::move(r));
+  }
+}
+
+SEXP llama_engine_new(SEXP model_path_, SEXP n_ctx_, SEXP n_parallel_, SEXP n_batch_, SEXP n_chunk_,
+                      SEXP cache_type_k_, SEXP cache_type_v_, SEXP prefix_cache_, SEXP kv_block_) {
+  try {
+    std::string model_path = as<std::string>(model_path_);
+    const int n_ctx        = as<int>(n_ctx_);
+    const int n_parallel   = as<int>(n_parallel_);
+    const int n_batch      = as<int>(n_batch_);
+    const int n_chunk      = as<int>(n_chunk_);
+    const ggml_type type_k = cache_type_from_name(as<std::string>(cache_type_k_));
+    const ggml_type type_v = cache_type_from_name(as<std::string>(cache_type_v_));
+    const bool prefix      = as<bool>(prefix_cache_);
+    const int kv_block     = as<int>(kv_block_);
+
+    if (model_path.empty()) Rcpp::stop("Model path is empty");
+    if (n_parallel < 1 || n_parallel >= 256) Rcpp::stop("n_parallel must be in [1, 255]");
+    if (n_batch < n_parallel) Rcpp::stop("n_batch must be at least n_parallel");
+    if (n_chunk < 1) Rcpp::stop("prefill_chunk must be positive");
+
+    llama_backend_init();
+    env_numa_init();
+
+    // model params (CPU only)
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+    mparams.use_mmap     = env_use_mmap_default();
+    env_prefetch_default(mparams);
+    mparams.use_mlock    = false;
+
+    std::unique_ptr<llama_engine> e(new llama_engine());
+
+    e->model = llama_model_load_from_file(model_path.c_str(), mparams);
+    if (!e->model) Rcpp::stop(std::string("Failed to load model: ") + model_path);
+
+    // context params (CPU only): all requests share one KV cache of n_ctx cells; with the prefix
+    // cache, one more sequence keeps the stored prefixes alive
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx            = std::max(8, n_ctx <= 0 ? 2048 : n_ctx);
+    cparams.n_batch          = n_batch;
+    cparams.n_seq_max        = n_parallel + (prefix ? 1 : 0);
+    cparams.kv_unified       = true;
+    cparams.n_kv_block       = std::max(0, kv_block);
+    // the number of decoding requests changes from step to step: pad the decode-only steps to a
+    // few sizes so that their graphs are reused instead of rebuilt
+    cparams.n_ubatch_pad     = n_parallel;
+    cparams.offload_kqv      = false;
+    cparams.op_offload       = false;
+    const thread_counts nt   = threads_for_model(e->model, model_path);
+    cparams.n_threads        = nt.decode;
+    cparams.n_threads_batch  = nt.batch;
+    set_cache_types(cparams, type_k, type_v);
+
+    e->ctx = llama_init_from_model(e->model, cparams);
+    if (!e->ctx) Rcpp::stop("Failed to create llama context");
+
+    e->vocab = llama_model_get_vocab(e->model);
+    if (!e->vocab) Rcpp::stop("Null vocab pointer from model");
+
+    e->n_batch = (int) llama_n_batch(e->ctx);
+    e->n_chunk = std::min(n_chunk, e->n_batch);
+    e->batch   = llama_batch_init(e->n_batch, 0, 1);
+    e->prefix  = prefix && llama_memory_prefix_init(llama_get_memory(e->ctx), n_parallel, 0);
+
+    for (int s = n_parallel - 1; s >= 0; --s) e->seq_free.push_back(s);
+
+    return XPtr<llama_engine>(e.release(), true);
+
+  } catch (std::exception &e) {
+    Rcpp::stop(std::string("llama_engine_new error: ") + e.what());
+  } catch (...) {
+    Rcpp::stop("llama_engine_new: unknown error");
+  }
+}
+
+SEXP llama_engine_submit(SEXP engine_, SEXP prompt_, SEXP n_predict_,
+                         SEXP temperature_, SEXP top_p_, SEXP top_k_,
+                         SEXP repeat_penalty_, SEXP repeat_last_n_, SEXP seed_, SEXP stop_) {
+  try {
+    llama_engine * e = engine_get(engine_);
+
+    engine_request r;
+    r.id        = e->next_id++;
+    r.n_predict = as<int>(n_predict_);
+
+    sampling_params sp;
+    sp.temperature    = as<double>(temperature_);
+    sp.top_p          = as<double>(top_p_);
+    sp.top_k          = as<int>(top_k_);
+    sp.repeat_penalty = as<double>(repeat_penalty_);
+    sp.repeat_last_n  = as<int>(repeat_last_n_);
+    sp.seed           = as<int>(seed_);
+    sampling_sanitize(sp);
+
+    if (!Rf_isNull(stop_)) {
+      CharacterVector sv(stop_);
+      for (int i = 0; i < sv.size(); ++i) {
+        if (sv[i] != NA_STRING) r.stops.emplace_back(as<std::string>(sv[i]));
+      }
+    }
+
+    if (r.n_predict <= 0) {
+      e->done.emplace_back(r.id, std::string());
+      return Rcpp::wrap(r.id);
+    }
+
+    r.tokens   = tokenize_prompt(e->vocab, as<std::string>(prompt_));
+    r.n_prompt = (int) r.tokens.size();
+    if (r.n_prompt == 0) Rcpp::stop("The prompt is empty after tokenization");
+    if (r.n_prompt >= (int) llama_n_ctx(e->ctx)) Rcpp::stop("The prompt does not fit in n_ctx");
+
+    r.chain.reset(sampler_chain_new(sp, (int) llama_n_ctx(e->ctx)));
+    if (!r.chain) Rcpp::stop("Failed to initialize sampler chain");
+
+    e->queue.push_back(std::move(r));
+
+    return Rcpp::wrap(e->queue.back().id);
+
+  } catch (std::exception &e) {
+    Rcpp::stop(std::string("llama_engine_submit error: ") + e.what());
+  } catch (...) {
+    Rcpp::stop("llama_engine_submit: unknown error");
+  }
+}
+
+SEXP llama_engine_step(SEXP engine_) {
+  try {
+    llama_engine * e = engine_get(engine_);
+
+    engine_step(*e);
+
+    CharacterVector res(e->done.size());
+    CharacterVector ids(e->done.size());
+    for (size_t i = 0; i < e->done.size(); ++i) {
+      res[i] = e->done[i].second;
+      ids[i] = std::to_string(e->done[i].first);
+    }
+    res.attr("names") = ids;
+    e->done.clear();
+
+    return res;
+
+  } catch (std::exception &e) {
+    Rcpp::stop(std::string("llama_engine_step error: ") + e.what());
+  } catch (...) {
+    Rcpp::stop("llama_engine_step: unknown error");
+  }
+}
+
+SEXP llama_engine_status(SEXP engine_) {
+  try {
+    llama_engine * e = engine_get(engine_);
+
+    const llama_memory_kv_stats st = llama_memory_get_kv_stats(llama_get_memory(e->ctx));
+
+    IntegerVector res = IntegerVector::create(
+      _["queued"] = (int) e->queue.size(), _["running"] = (int) e->running.size(),
+      _["finished"] = (int) e->done.size(),
+      _["kv_used"] = (int) st.n_used, _["kv_size"] = (int) st.n_cells);
+    return res;
+
+  } catch (std::exception &e) {
+    Rcpp::stop(std::string("llama_engine_status error: ") + e.what());
+  } catch (...) {
+    Rcpp::stop("llama_engine_status: unknown error");
+  }
+}
@@ -404,6 +404,56 @@ llama_ubatch llama_batch_allocr::ubatch_reserve(uint32_t n_seq_tokens, uint32_t
     return res;
 }
 
+llama_ubatch llama_batch_allocr::ubatch_pad(const llama_ubatch & ubatch, uint32_t n_tokens) {
+    GGML_ASSERT(ubatch.token && !ubatch.equal_seqs());
+    GGML_ASSERT(ubatch.n_tokens > 0 && ubatch.n_tokens <= n_tokens);
+
+    const uint32_t n_real = ubatch.n_tokens;
+    const uint32_t i_last = n_real - 1;
+
+    bool output_all = true;
+    for (uint32_t i = 0; i < n_real; ++i) {
+        output_all = output_all && ubatch.output[i];
+    }
+
+    auto udata = std::make_shared<llama_ubatch::data_t>();
+
+    udata->token     .assign(ubatch.token,    ubatch.token    + n_real);
+    udata->embd      .clear();
+    udata->pos       .assign(ubatch.pos,      ubatch.pos      + n_real);
+    udata->n_seq_id  .assign(ubatch.n_seq_id, ubatch.n_seq_id + n_real);
+    udata->seq_id    .assign(ubatch.seq_id,   ubatch.seq_id   + n_real);
+    udata->seq_id_unq.assign(ubatch.seq_id_unq, ubatch.seq_id_unq + ubatch.n_seqs_unq);
+    udata->seq_idx   .assign(ubatch.seq_idx,  ubatch.seq_idx  + LLAMA_MAX_SEQ);
+    udata->output    .assign(ubatch.output,   ubatch.output   + n_real);
+
+    udata->token   .resize(n_tokens, ubatch.token[i_last]);
+    udata->pos     .resize(n_tokens, ubatch.pos[i_last]);
+    udata->n_seq_id.resize(n_tokens, ubatch.n_seq_id[i_last]);
+    udata->seq_id  .resize(n_tokens, ubatch.seq_id[i_last]);
+    udata->output  .resize(n_tokens, output_all);
+
+    llama_ubatch res {
+        /*.b_equal_seqs =*/ false,
+        /*.n_tokens     =*/ n_tokens,
+        /*.n_seq_tokens =*/ 1,
+        /*.n_seqs       =*/ n_tokens,
+        /*.n_seqs_unq   =*/ ubatch.n_seqs_unq,
+
+        /*.token        =*/ udata->token.data(),
+        /*.embd         =*/ nullptr,
+        /*.pos          =*/ udata->pos.data(),
+        /*.n_seq_id     =*/ udata->n_seq_id.data(),
+        /*.seq_id       =*/ udata->seq_id.data(),
+        /*.seq_id_unq   =*/ udata->seq_id_unq.data(),
+        /*.seq_idx      =*/ udata->seq_idx.data(),
+        /*.output       =*/ udata->output.data(),
+        /*.data         =*/ std::move(udata),
+    };
+
+    return res;
+}
+
 const llama_batch & llama_batch_allocr::get_batch() const {
     return batch;
 }
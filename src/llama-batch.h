@@ -100,6 +100,10 @@ public:
     // TODO: support embeddings if needed in the future
     llama_ubatch ubatch_reserve(uint32_t n_seq_tokens, uint32_t n_seqs);
 
+    // a copy of a simple-split ubatch of tokens, extended to n_tokens with copies of its last token (same id, position
+    // and sequences) - the copies are outputs only if all the tokens of ubatch are
+    static llama_ubatch ubatch_pad(const llama_ubatch & ubatch, uint32_t n_tokens);
+
 private:
     void clear();
 
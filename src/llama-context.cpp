@@ -3,14 +3,17 @@
 #include "llama-impl.h"
 #include "llama-batch.h"
 #include "llama-io.h"
+#include "llama-kv-cache.h"
 #include "llama-memory.h"
 #include "llama-mmap.h"
 #include "llama-model.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstring>
 #include <limits>
 #include <stdexcept>
+#include <unordered_set>
 
 extern "C" ggml_backend_t llamar_cpu_init_shim();
 
@@ -103,8 +106,14 @@ llama_context::llama_context(
     cparams.n_ubatch = std::min(cparams.n_batch, params.n_ubatch == 0 ? params.n_batch : params.n_ubatch);
 
     cparams.op_offload = params.op_offload;
+    cparams.logits_top_k = 0;
     cparams.kv_unified = params.kv_unified;
 
+    cparams.defrag_thold = params.defrag_thold;
+
+    // the padded ubatches must fit in the worst-case graph
+    cparams.n_ubatch_pad = std::min(params.n_ubatch_pad, cparams.n_ubatch);
+
     {
         const char * LLAMA_GRAPH_REUSE_DISABLE = getenv("LLAMA_GRAPH_REUSE_DISABLE");
         graph_reuse_disable = LLAMA_GRAPH_REUSE_DISABLE ? (atoi(LLAMA_GRAPH_REUSE_DISABLE) != 0) : graph_reuse_disable;
@@ -178,6 +187,9 @@ llama_context::llama_context(
             /*.type_k   =*/ params.type_k,
             /*.type_v   =*/ params.type_v,
             /*.swa_full =*/ params.swa_full,
+            /*.n_block  =*/ params.n_kv_block,
+            /*.n_sink   =*/ params.n_kv_sink,
+            /*.n_window =*/ params.n_kv_window,
         };
 
         memory.reset(model.create_memory(params_mem, cparams));
@@ -294,6 +306,10 @@ llama_context::llama_context(
                 GGML_ASSERT(strncmp(n->name, LLAMA_TENSOR_NAME_FATTN "-", prefix_len) == 0);
                 const int il = std::stoi(n->name + prefix_len);
                 ggml_backend_dev_t device_kv = model.dev_layer(il);
+                if (device_kv == nullptr && (device_fa == nullptr || ggml_backend_dev_type(device_fa) == GGML_BACKEND_DEVICE_TYPE_CPU)) {
+                    // CPU-only build without a device registry: the layer has no device and runs on the CPU backend
+                    continue;
+                }
                 if (device_fa != device_kv) {
                     LLAMA_LOG_WARN("%s: layer %d is assigned to device %s but the Flash Attention tensor "
                         "is assigned to device %s (usually due to missing support)\n",
@@ -365,6 +381,12 @@ llama_context::llama_context(
                         ggml_backend_buft_name(buft),
                         size / 1024.0 / 1024.0);
             }
+            const size_t size_huge = ggml_backend_sched_get_buffer_hugepage_size(sched.get(), backend);
+            if (size_huge > 0) {
+                LLAMA_LOG_INFO("%s: %10s compute buffer on huge pages = %8.2f MiB\n", __func__,
+                        ggml_backend_buft_name(buft),
+                        size_huge / 1024.0 / 1024.0);
+            }
         }
 
         if (n_nodes_pp == n_nodes_tg) {
@@ -464,6 +486,8 @@ bool llama_context::memory_update(bool optimize) {
         return false;
     }
 
+    bool need_reserve = true;
+
     {
         const auto mctx = memory->init_update(this, optimize);
         switch (mctx->get_status()) {
@@ -484,18 +508,23 @@ bool llama_context::memory_update(bool optimize) {
                 }
         }
 
-        // reset the previous graph result to make sure that it won't be reused
-        // TODO: change the mctx->apply() to return information if a graph reserve is needed
-        //       reset the graph result only if the memory module did reset the scheduler
-        gf_res_prev->reset();
-
         if (!mctx->apply()) {
             LLAMA_LOG_ERROR("%s: failed to apply memory update\n", __func__);
         }
+
+        need_reserve = mctx->update_needs_reserve();
+
+        // the memory module did reset the scheduler, so the previous graph cannot be reused as it is
+        // without a new reserve its topology is still valid: keep it with the cached graphs, which are placed again
+        // before they are used (an incremental defrag step then costs neither a reserve nor a graph build)
+        if (!need_reserve && !graph_reuse_disable) {
+            graph_cache_put();
+        }
+        gf_res_prev->reset();
     }
 
-    // if the memory module did any computation, we have to reserve a new worst-case graph
-    {
+    // if the memory module computed anything in the compute buffers, we have to reserve a new worst-case graph
+    if (need_reserve) {
         const auto mctx = memory->init_full();
         if (!mctx) {
             throw std::runtime_error("failed to initialize memory context");
@@ -520,6 +549,15 @@ enum llama_pooling_type llama_context::pooling_type() const {
 float * llama_context::get_logits() {
     output_reorder();
 
+    // the rows of restricted outputs hold only the logits of their allowed tokens, see get_logits_subset_ith()
+    if (logits != nullptr) {
+        for (uint32_t j = 0; j < n_outputs; ++j) {
+            if (logits_subset_out[j]) {
+                return nullptr;
+            }
+        }
+    }
+
     return logits;
 }
 
@@ -552,6 +590,11 @@ float * llama_context::get_logits_ith(int32_t i) {
             throw std::runtime_error(format("corrupt output buffer (j=%" PRId64 ", n_outputs=%d)", j, n_outputs));
         }
 
+        // the row holds only the logits of the allowed tokens, see get_logits_subset_ith()
+        if (logits_subset_out[j]) {
+            return nullptr;
+        }
+
         return logits + j*model.vocab.n_tokens();
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
@@ -563,6 +606,91 @@ float * llama_context::get_logits_ith(int32_t i) {
     }
 }
 
+int32_t llama_context::get_logits_top_k_ith(int32_t i, const llama_token ** ids, const float ** values) {
+    int64_t j = -1;
+
+    // not enabled, the caller falls back to the full logits
+    if (logits_top_k_val == nullptr) {
+        return 0;
+    }
+
+    output_reorder();
+
+    try {
+        if (i < 0) {
+            j = n_outputs + i;
+            if (j < 0) {
+                throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
+            }
+        } else if ((size_t) i >= output_ids.size()) {
+            throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
+        } else {
+            j = output_ids[i];
+        }
+
+        if (j < 0) {
+            throw std::runtime_error(format("batch.logits[%d] != true", i));
+        }
+        if (j >= n_outputs) {
+            // This should not happen
+            throw std::runtime_error(format("corrupt output buffer (j=%" PRId64 ", n_outputs=%d)", j, n_outputs));
+        }
+
+        *ids    = logits_top_k_ids + j*logits_top_k_n;
+        *values = logits_top_k_val + j*logits_top_k_n;
+
+        return logits_top_k_n;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
+        return 0;
+    }
+}
+
+int32_t llama_context::get_logits_subset_ith(int32_t i, const llama_token ** ids, const float ** values) {
+    int64_t j = -1;
+
+    // no restricted outputs, the caller falls back to the full logits
+    if (logits == nullptr || logits_subset.empty()) {
+        return 0;
+    }
+
+    output_reorder();
+
+    try {
+        if (i < 0) {
+            j = n_outputs + i;
+            if (j < 0) {
+                throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
+            }
+        } else if ((size_t) i >= output_ids.size()) {
+            throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
+        } else {
+            j = output_ids[i];
+        }
+
+        if (j < 0) {
+            throw std::runtime_error(format("batch.logits[%d] != true", i));
+        }
+        if (j >= n_outputs) {
+            // This should not happen
+            throw std::runtime_error(format("corrupt output buffer (j=%" PRId64 ", n_outputs=%d)", j, n_outputs));
+        }
+
+        const auto & subset = logits_subset_out[j];
+        if (!subset) {
+            return 0;
+        }
+
+        *ids    = subset->data();
+        *values = logits + j*model.vocab.n_tokens();
+
+        return subset->size();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
+        return 0;
+    }
+}
+
 float * llama_context::get_embeddings() {
     output_reorder();
 
@@ -671,6 +799,50 @@ void llama_context::set_causal_attn(bool value) {
     cparams.causal_attn = value;
 }
 
+void llama_context::set_logits_top_k(int32_t value) {
+    LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
+
+    cparams.logits_top_k = std::max(0, value);
+}
+
+void llama_context::set_logits_subset(llama_seq_id seq_id, const llama_token * ids, int32_t n_ids) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d, n_ids = %d\n", __func__, seq_id, n_ids);
+
+    if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id = %d\n", __func__, seq_id);
+        return;
+    }
+
+    if (logits_subset.empty()) {
+        logits_subset.resize(LLAMA_MAX_SEQ);
+    }
+
+    if (n_ids <= 0) {
+        logits_subset[seq_id].reset();
+        return;
+    }
+
+    const int32_t n_vocab = model.vocab.n_tokens();
+
+    auto subset = std::make_shared<std::vector<llama_token>>();
+    subset->reserve(n_ids);
+
+    for (int32_t i = 0; i < n_ids; ++i) {
+        if (ids[i] < 0 || ids[i] >= n_vocab) {
+            LLAMA_LOG_ERROR("%s: invalid token id %d at index %d\n", __func__, ids[i], i);
+            return;
+        }
+        subset->push_back(ids[i]);
+    }
+
+    // sorted, so that the logits of a restricted output can be compacted in place and looked up by token id
+    std::sort(subset->begin(), subset->end());
+    subset->erase(std::unique(subset->begin(), subset->end()), subset->end());
+
+    // outputs already produced keep their own reference to the previous set
+    logits_subset[seq_id] = std::move(subset);
+}
+
 void llama_context::set_warmup(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
@@ -734,16 +906,50 @@ llm_graph_result * llama_context::process_ubatch(const llama_ubatch & ubatch, ll
 
         n_reused++;
     } else {
-        res->reset();
+        const bool cached = !graph_reuse_disable && graph_cache_get(gparams);
+
+        if (!cached && cparams.n_ubatch_pad > 0) {
+            graph_cache_put();
+        }
+
+        res = gf_res_prev.get();
 
         ggml_backend_sched_reset(sched.get());
         ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
 
-        //const auto t_start_us = ggml_time_us();
+        if (cached) {
+            // the topology is the same, but the compute buffer has been reused by other graphs since - place the
+            // tensors of the graph again
+            // note: the compute buffer may have been reallocated since, so the tensors to place are told apart from the
+            //       views of the KV cache by the context they come from, not by their (possibly dangling) buffer
+            gf = res->get_gf();
+
+            ggml_context * ctx_res = res->get_ctx();
+
+            std::unordered_set<const ggml_tensor *> own;
+            for (ggml_tensor * t = ggml_get_first_tensor(ctx_res); t; t = ggml_get_next_tensor(ctx_res, t)) {
+                if (t->view_src == nullptr) {
+                    own.insert(t);
+                }
+            }
 
-        gf = model.build_graph(gparams);
+            for (ggml_tensor * t = ggml_get_first_tensor(ctx_res); t; t = ggml_get_next_tensor(ctx_res, t)) {
+                if (own.count(t->view_src ? t->view_src : t)) {
+                    t->buffer = nullptr;
+                    t->data   = nullptr;
+                }
+            }
 
-        //LLAMA_LOG_INFO("graph build time: %.3f ms\n", (ggml_time_us() - t_start_us)/1000.0);
+            n_reused++;
+        } else {
+            res->reset();
+
+            //const auto t_start_us = ggml_time_us();
+
+            gf = model.build_graph(graph_params(res, ubatch, mctx, gtype));
+
+            //LLAMA_LOG_INFO("graph build time: %.3f ms\n", (ggml_time_us() - t_start_us)/1000.0);
+        }
 
         if (!gf) {
             LLAMA_LOG_ERROR("%s: failed to initialize graph\n", __func__);
@@ -756,6 +962,8 @@ llm_graph_result * llama_context::process_ubatch(const llama_ubatch & ubatch, ll
             ret = GGML_STATUS_ALLOC_FAILED;
             return nullptr;
         }
+
+        gf_id++;
     }
 
     // set the input data for the input tensors
@@ -767,7 +975,7 @@ llm_graph_result * llama_context::process_ubatch(const llama_ubatch & ubatch, ll
         //LLAMA_LOG_INFO("graph set inputs time: %.3f ms\n", (ggml_time_us() - t_start_us)/1000.0);
     }
 
-    const auto status = graph_compute(res->get_gf(), ubatch.n_tokens > 1);
+    const auto status = graph_compute(res->get_gf(), ubatch.n_tokens > 1, true);
     if (status != GGML_STATUS_SUCCESS) {
         LLAMA_LOG_ERROR("%s: failed to compute graph, compute status: %d\n", __func__, status);
         ret = status;
@@ -1070,8 +1278,82 @@ int llama_context::decode(const llama_batch & batch_inp) {
             n_outputs = n_outputs_new;
         }
 
+        // pad a small ubatch to the next power of two, so that the graph of the previous steps can be reused when the
+        // number of tokens changes a little - only the outputs of the real tokens are extracted below
+        const uint32_t n_tokens_pad = graph_n_tokens_pad(ubatch, mctx.get());
+
+        const llama_ubatch ubatch_pad = n_tokens_pad > ubatch.n_tokens ? llama_batch_allocr::ubatch_pad(ubatch, n_tokens_pad) : llama_ubatch {};
+
+        const uint32_t n_outputs_ubatch = n_outputs;
+
+        if (ubatch_pad.n_tokens > 0 && n_outputs == ubatch.n_tokens) {
+            n_outputs = ubatch_pad.n_tokens;
+        }
+
+        // the allowed tokens of the outputs of this ubatch, see llama_set_logits_subset()
+        // when all of them are restricted, the output projection computes only the union of their allowed tokens
+        bool has_subset = false;
+
+        logits_vocab_ids.clear();
+
+        if (!logits_subset.empty() && logits_size > 0 && n_outputs_ubatch > 0) {
+            bool all_subset = true;
+
+            int64_t k = n_outputs_prev;
+            for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+                if (n_outputs_all != n_tokens_all && !ubatch.output[i]) {
+                    continue;
+                }
+
+                const auto & subset = logits_subset[ubatch.seq_id[i][0]];
+
+                logits_subset_out[k++] = subset;
+
+                has_subset |= subset != nullptr;
+                all_subset &= subset != nullptr;
+
+                if (all_subset) {
+                    logits_vocab_ids.insert(logits_vocab_ids.end(), subset->begin(), subset->end());
+                }
+            }
+
+            // the projection bias and the suppression of image tokens span the whole vocabulary
+            all_subset &= model.output != nullptr && model.output_b == nullptr && model.arch != LLM_ARCH_CHAMELEON && !cparams.embeddings;
+
+            if (all_subset) {
+                std::sort(logits_vocab_ids.begin(), logits_vocab_ids.end());
+                logits_vocab_ids.erase(std::unique(logits_vocab_ids.begin(), logits_vocab_ids.end()), logits_vocab_ids.end());
+            }
+
+            // gathering the rows costs a dequantization of each, so this pays off only for small sets
+            if (all_subset && (int64_t) logits_vocab_ids.size()*8 <= n_vocab) {
+                if (logits_vocab_col.empty()) {
+                    logits_vocab_col.resize(n_vocab, -1);
+                }
+
+                // note: every token looked up during the extraction is in the current set, so the columns of the
+                //       previous sets need not be reset
+                for (size_t c = 0; c < logits_vocab_ids.size(); ++c) {
+                    logits_vocab_col[logits_vocab_ids[c]] = c;
+                }
+
+                // pad the set to a power of two with copies of its last token, so that the graph can be reused
+                size_t n_pad = 1;
+                while (n_pad < logits_vocab_ids.size()) {
+                    n_pad *= 2;
+                }
+                logits_vocab_ids.resize(n_pad, logits_vocab_ids.back());
+            } else {
+                logits_vocab_ids.clear();
+            }
+        }
+
         ggml_status status;
-        const auto * res = process_ubatch(ubatch, LLM_GRAPH_TYPE_DECODER, mctx.get(), status);
+        const auto * res = process_ubatch(ubatch_pad.n_tokens > 0 ? ubatch_pad : ubatch, LLM_GRAPH_TYPE_DECODER, mctx.get(), status);
+
+        n_outputs = n_outputs_ubatch;
+
+        logits_vocab_ids.clear();
 
         if (!res) {
             // the last ubatch failed or was aborted -> remove all positions of that ubatch from the memory module
@@ -1116,18 +1398,68 @@ int llama_context::decode(const llama_batch & batch_inp) {
             t_embd = res->get_embd_pooled();
         }
 
-        // extract logits
-        if (t_logits && n_outputs > 0) {
+        auto * t_top_k     = res->get_logits_top_k();
+        auto * t_top_k_ids = res->get_logits_top_k_ids();
+
+        // extract the top k logits only
+        if (t_top_k && n_outputs > 0) {
+            ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_top_k);
+            GGML_ASSERT(backend_res != nullptr);
+            GGML_ASSERT(logits_top_k_val != nullptr);
+
+            const int64_t k = t_top_k->ne[0];
+
+            GGML_ASSERT( n_outputs_prev + n_outputs <= n_outputs_all);
+            GGML_ASSERT((n_outputs_prev + n_outputs)*k <= (int64_t) logits_top_k_size);
+            ggml_backend_tensor_get_async(backend_res, t_top_k,     logits_top_k_val + n_outputs_prev*k, 0, n_outputs*k*sizeof(float));
+            ggml_backend_tensor_get_async(backend_res, t_top_k_ids, logits_top_k_ids + n_outputs_prev*k, 0, n_outputs*k*sizeof(llama_token));
+        } else if (t_logits && n_outputs > 0) {
+            // extract logits
             ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits);
             GGML_ASSERT(backend_res != nullptr);
             GGML_ASSERT(logits != nullptr);
 
             float * logits_out = logits + n_outputs_prev*n_vocab;
 
+            // the number of logits computed for each output
+            const int64_t n_cols = t_logits->ne[0];
+
             if (n_outputs) {
                 GGML_ASSERT( n_outputs_prev + n_outputs <= n_outputs_all);
                 GGML_ASSERT((n_outputs_prev + n_outputs)*n_vocab <= (int64_t) logits_size);
-                ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_vocab*sizeof(float));
+
+                if (n_cols < n_vocab) {
+                    logits_compact.resize(n_outputs*n_cols);
+                    ggml_backend_tensor_get_async(backend_res, t_logits, logits_compact.data(), 0, n_outputs*n_cols*sizeof(float));
+                } else {
+                    ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_vocab*sizeof(float));
+                }
+            }
+
+            // restricted outputs: move the logits of the allowed tokens to the start of their rows
+            if (has_subset) {
+                ggml_backend_synchronize(backend_res);
+
+                for (int64_t k = 0; k < n_outputs; ++k) {
+                    const auto & subset = logits_subset_out[n_outputs_prev + k];
+                    if (!subset) {
+                        continue;
+                    }
+
+                    float * row = logits_out + k*n_vocab;
+
+                    if (n_cols < n_vocab) {
+                        const float * src = logits_compact.data() + k*n_cols;
+                        for (size_t m = 0; m < subset->size(); ++m) {
+                            row[m] = src[logits_vocab_col[(*subset)[m]]];
+                        }
+                    } else {
+                        // the ids are ascending, so no value is overwritten before it is read
+                        for (size_t m = 0; m < subset->size(); ++m) {
+                            row[m] = row[(*subset)[m]];
+                        }
+                    }
+                }
             }
         }
 
@@ -1268,8 +1600,13 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
         has_embd   = true;
     }
 
-    logits_size = has_logits ? n_vocab*n_outputs_max : 0;
-    embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
+    // with in-graph top-k only the k best (value, id) pairs of each output are extracted
+    const int64_t top_k = cparams.logits_top_k > 0 ? std::min<int64_t>(cparams.logits_top_k, n_vocab) : 0;
+
+    logits_size       = has_logits && top_k == 0 ? n_vocab*n_outputs_max : 0;
+    logits_top_k_size = has_logits               ?   top_k*n_outputs_max : 0;
+    logits_top_k_n    = has_logits               ?   top_k               : 0;
+    embd_size         = has_embd                 ?  n_embd*n_outputs_max : 0;
 
     if (output_ids.empty()) {
         // init, never resized afterwards
@@ -1277,7 +1614,7 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
     }
 
     const size_t prev_size = buf_output ? ggml_backend_buffer_get_size(buf_output.get()) : 0;
-    const size_t new_size  = (logits_size + embd_size) * sizeof(float);
+    const size_t new_size  = (logits_size + embd_size + 2*logits_top_k_size) * sizeof(float);
 
     // alloc only when more than the current capacity is required
     // TODO: also consider shrinking the buffer
@@ -1290,6 +1627,8 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
             buf_output = nullptr;
             logits = nullptr;
             embd = nullptr;
+            logits_top_k_val = nullptr;
+            logits_top_k_ids = nullptr;
         }
 
         auto * buft = ggml_backend_cpu_buffer_type();
@@ -1308,12 +1647,17 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
 
     float * output_base = (float *) ggml_backend_buffer_get_base(buf_output.get());
 
-    logits = has_logits ? output_base               : nullptr;
-    embd   = has_embd   ? output_base + logits_size : nullptr;
+    logits = logits_size > 0 ? output_base               : nullptr;
+    embd   = has_embd        ? output_base + logits_size : nullptr;
+
+    logits_top_k_val = logits_top_k_size > 0 ?                 output_base + logits_size + embd_size                      : nullptr;
+    logits_top_k_ids = logits_top_k_size > 0 ? (llama_token *) (output_base + logits_size + embd_size + logits_top_k_size) : nullptr;
 
     // set all ids as invalid (negative)
     std::fill(output_ids.begin(), output_ids.end(), -1);
 
+    logits_subset_out.assign(logits_size > 0 ? n_outputs_max : 0, nullptr);
+
     this->n_outputs = 0;
 
     return n_outputs_max;
@@ -1331,6 +1675,7 @@ void llama_context::output_reorder() {
             for (uint64_t k = 0; k < n_vocab; k++) {
                 std::swap(logits[i0*n_vocab + k], logits[i1*n_vocab + k]);
             }
+            std::swap(logits_subset_out[i0], logits_subset_out[i1]);
         }
 
         if (embd_size > 0) {
@@ -1338,6 +1683,14 @@ void llama_context::output_reorder() {
                 std::swap(embd[i0*n_embd + k], embd[i1*n_embd + k]);
             }
         }
+
+        if (logits_top_k_size > 0) {
+            const uint64_t top_k = logits_top_k_n;
+            for (uint64_t k = 0; k < top_k; k++) {
+                std::swap(logits_top_k_val[i0*top_k + k], logits_top_k_val[i1*top_k + k]);
+                std::swap(logits_top_k_ids[i0*top_k + k], logits_top_k_ids[i1*top_k + k]);
+            }
+        }
     }
 
     output_swaps.clear();
@@ -1396,6 +1749,17 @@ ggml_cgraph * llama_context::graph_reserve(uint32_t n_tokens, uint32_t n_seqs, u
     } else if (!ggml_backend_sched_reserve(sched.get(), gf)) {
         LLAMA_LOG_ERROR("%s: failed to allocate compute buffers\n", __func__);
         return nullptr;
+    } else if (backend_cpu != nullptr) {
+        // size the CPU work buffer for the worst case now, instead of growing it while decoding
+        ggml_backend_dev_t dev = ggml_backend_get_device(backend_cpu);
+        ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+        if (reg) {
+            auto * graph_reserve_fn = (decltype(ggml_backend_cpu_graph_reserve) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_graph_reserve");
+            if (graph_reserve_fn && !graph_reserve_fn(backend_cpu, gf, std::max(cparams.n_threads, cparams.n_threads_batch))) {
+                LLAMA_LOG_ERROR("%s: failed to allocate the CPU work buffer\n", __func__);
+                return nullptr;
+            }
+        }
     }
 
     return gf;
@@ -1418,6 +1782,9 @@ llm_graph_params llama_context::graph_params(
         /*.loras       =*/ &loras,
         /*.mctx        =*/ mctx,
         /*.cross       =*/ &cross,
+        /*.w_output    =*/ model.output,
+        /*.vocab_ids   =*/ &logits_vocab_ids,
+        /*.n_vocab_ids =*/ (uint32_t) logits_vocab_ids.size(),
         /*.n_outputs   =*/ n_outputs,
         /*.cb          =*/ graph_get_cb(),
         /*.res         =*/ res,
@@ -1426,10 +1793,13 @@ llm_graph_params llama_context::graph_params(
 
 ggml_status llama_context::graph_compute(
             ggml_cgraph * gf,
-                   bool   batched) {
+                   bool   batched,
+                   bool   tracked) {
     int n_threads        = batched ? cparams.n_threads_batch : cparams.n_threads;
     ggml_threadpool_t tp = batched ? threadpool_batch        : threadpool;
 
+    decltype(ggml_backend_cpu_set_graph_id) * set_graph_id_fn = nullptr;
+
     if (backend_cpu != nullptr) {
         ggml_backend_dev_t dev = ggml_backend_get_device(backend_cpu);
         if (dev) {
@@ -1439,6 +1809,19 @@ ggml_status llama_context::graph_compute(
                 if (set_threadpool_fn) {
                     set_threadpool_fn(backend_cpu, tp);
                 }
+
+                // the CPU plans of a reused graph are looked up by this id, without walking the graph
+                set_graph_id_fn = (decltype(ggml_backend_cpu_set_graph_id) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_set_graph_id");
+                if (set_graph_id_fn) {
+                    set_graph_id_fn(backend_cpu, tracked ? gf_id : 0);
+                }
+
+                // the layer outputs are reported from the node loop of the backend, asking for them through the
+                // eval callback would make the scheduler split the graph after every layer
+                auto * set_node_callback_fn = (decltype(ggml_backend_cpu_set_node_callback) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_set_node_callback");
+                if (set_node_callback_fn) {
+                    set_node_callback_fn(backend_cpu, model.prefetcher ? graph_node_prefetch : nullptr, this);
+                }
             }
         }
     }
@@ -1448,16 +1831,96 @@ ggml_status llama_context::graph_compute(
         set_n_threads_fn.second(set_n_threads_fn.first, n_threads);
     }
 
+    if (model.prefetcher) {
+        model.prefetcher->begin();
+    }
+
     auto status = ggml_backend_sched_graph_compute_async(sched.get(), gf);
     if (status != GGML_STATUS_SUCCESS) {
         LLAMA_LOG_ERROR("%s: ggml_backend_sched_graph_compute_async failed with error %d\n", __func__, status);
     }
 
+    // other users of the scheduler (e.g. ggml_opt) do not keep the id up to date
+    if (set_graph_id_fn) {
+        set_graph_id_fn(backend_cpu, 0);
+    }
+
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(sched));
 
     return status;
 }
 
+void llama_context::graph_node_prefetch(const ggml_tensor * t, void * user_data) {
+    auto * lctx = (llama_context *) user_data;
+
+    if (strncmp(t->name, "l_out-", 6) == 0) {
+        lctx->model.prefetcher->layer_done(atoi(t->name + 6));
+    }
+}
+
+uint32_t llama_context::graph_n_tokens_pad(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) const {
+    const uint32_t n_tokens = ubatch.n_tokens;
+
+    if (cparams.n_ubatch_pad == 0 || n_tokens > cparams.n_ubatch_pad) {
+        return n_tokens;
+    }
+
+    // the dummy tokens are copies of the last token of the ubatch, which only works for the causal decoding of tokens
+    if (cparams.embeddings || !cparams.causal_attn || !ubatch.token || ubatch.equal_seqs() || model.hparams.n_pos_per_embd() > 1) {
+        return n_tokens;
+    }
+
+    // their K/V go to a free cell of a plain KV cache
+    const auto * kv_mctx = dynamic_cast<const llama_kv_cache_context *>(mctx);
+    if (!kv_mctx || !kv_mctx->can_pad()) {
+        return n_tokens;
+    }
+
+    uint32_t n_pad = 1;
+    while (n_pad < n_tokens) {
+        n_pad *= 2;
+    }
+
+    return std::min(n_pad, cparams.n_ubatch);
+}
+
+bool llama_context::graph_cache_get(const llm_graph_params & gparams) {
+    for (size_t i = 0; i < gf_res_cache.size(); ++i) {
+        if (!gf_res_cache[i]->can_reuse(gparams)) {
+            continue;
+        }
+
+        llm_graph_result_ptr res = std::move(gf_res_cache[i]);
+        gf_res_cache.erase(gf_res_cache.begin() + i);
+
+        gf_res_cache.insert(gf_res_cache.begin(), std::move(gf_res_prev));
+        gf_res_prev = std::move(res);
+
+        return true;
+    }
+
+    return false;
+}
+
+void llama_context::graph_cache_put() {
+    // nothing worth keeping, e.g. after a graph reserve
+    if (ggml_graph_n_nodes(gf_res_prev->get_gf()) == 0) {
+        return;
+    }
+
+    llm_graph_result_ptr res;
+
+    if (gf_res_cache.size() < n_graph_cache_max) {
+        res.reset(new llm_graph_result(graph_max_nodes()));
+    } else {
+        res = std::move(gf_res_cache.back());
+        gf_res_cache.pop_back();
+    }
+
+    gf_res_cache.insert(gf_res_cache.begin(), std::move(gf_res_prev));
+    gf_res_prev = std::move(res);
+}
+
 llm_graph_cb llama_context::graph_get_cb() const {
     return [&](const llama_ubatch & ubatch, ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
@@ -2278,6 +2741,10 @@ llama_context_params llama_context_default_params() {
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.n_kv_block                  =*/ 0,
+        /*.n_kv_sink                   =*/ 4,
+        /*.n_kv_window                 =*/ 0,
+        /*.n_ubatch_pad                =*/ 0,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
         /*.embeddings                  =*/ false,
@@ -2417,6 +2884,14 @@ void llama_set_causal_attn(llama_context * ctx, bool causal_attn) {
     ctx->set_causal_attn(causal_attn);
 }
 
+void llama_set_logits_top_k(llama_context * ctx, int32_t k) {
+    ctx->set_logits_top_k(k);
+}
+
+void llama_set_logits_subset(llama_context * ctx, llama_seq_id seq_id, const llama_token * ids, int32_t n_ids) {
+    ctx->set_logits_subset(seq_id, ids, n_ids);
+}
+
 void llama_set_warmup(llama_context * ctx, bool warmup) {
     ctx->set_warmup(warmup);
 }
@@ -2431,6 +2906,18 @@ float * llama_get_logits(llama_context * ctx) {
     return ctx->get_logits();
 }
 
+int32_t llama_get_logits_top_k_ith(llama_context * ctx, int32_t i, const llama_token ** ids, const float ** logits) {
+    ctx->synchronize();
+
+    return ctx->get_logits_top_k_ith(i, ids, logits);
+}
+
+int32_t llama_get_logits_subset_ith(llama_context * ctx, int32_t i, const llama_token ** ids, const float ** logits) {
+    ctx->synchronize();
+
+    return ctx->get_logits_subset_ith(i, ids, logits);
+}
+
 float * llama_get_logits_ith(llama_context * ctx, int32_t i) {
     ctx->synchronize();
 
@@ -2595,6 +3082,64 @@ bool llama_memory_can_shift(llama_memory_t mem) {
     return mem->get_can_shift();
 }
 
+llama_memory_kv_stats llama_memory_get_kv_stats(llama_memory_t mem) {
+    auto * kv = dynamic_cast<llama_kv_cache *>(mem);
+    if (!kv) {
+        return {};
+    }
+
+    return kv->get_stats();
+}
+
+bool llama_memory_prefix_init(
+        llama_memory_t mem,
+          llama_seq_id seq_id_cache,
+              uint32_t n_cells_max) {
+    auto * kv = dynamic_cast<llama_kv_cache *>(mem);
+    if (!kv) {
+        return false;
+    }
+
+    return kv->prefix_init(seq_id_cache, n_cells_max);
+}
+
+int32_t llama_memory_prefix_attach(
+        llama_memory_t mem,
+          llama_seq_id seq_id,
+   const llama_token * tokens,
+               int32_t n_tokens) {
+    auto * kv = dynamic_cast<llama_kv_cache *>(mem);
+    if (!kv || n_tokens <= 0) {
+        return 0;
+    }
+
+    return kv->prefix_attach(seq_id, tokens, n_tokens);
+}
+
+void llama_memory_prefix_store(
+        llama_memory_t mem,
+          llama_seq_id seq_id,
+   const llama_token * tokens,
+               int32_t n_tokens) {
+    auto * kv = dynamic_cast<llama_kv_cache *>(mem);
+    if (!kv || n_tokens <= 0) {
+        return;
+    }
+
+    kv->prefix_store(seq_id, tokens, n_tokens);
+}
+
+void llama_memory_prefix_release(
+        llama_memory_t mem,
+          llama_seq_id seq_id) {
+    auto * kv = dynamic_cast<llama_kv_cache *>(mem);
+    if (!kv) {
+        return;
+    }
+
+    kv->prefix_release(seq_id);
+}
+
 // llama state API
 
 // deprecated
@@ -9,6 +9,7 @@
 #include "ggml-opt.h"
 
 #include <map>
+#include <memory>
 #include <vector>
 
 struct llama_model;
@@ -62,6 +63,9 @@ struct llama_context {
     float * get_logits();
     float * get_logits_ith(int32_t i);
 
+    int32_t get_logits_top_k_ith(int32_t i, const llama_token ** ids, const float ** values);
+    int32_t get_logits_subset_ith(int32_t i, const llama_token ** ids, const float ** values);
+
     float * get_embeddings();
     float * get_embeddings_ith(int32_t i);
     float * get_embeddings_seq(llama_seq_id seq_id);
@@ -78,6 +82,8 @@ struct llama_context {
 
     void set_embeddings (bool value);
     void set_causal_attn(bool value);
+    void set_logits_top_k(int32_t value);
+    void set_logits_subset(llama_seq_id seq_id, const llama_token * ids, int32_t n_ids);
     void set_warmup(bool value);
 
     void set_adapter_lora(
@@ -203,7 +209,9 @@ public:
     llm_graph_result * get_gf_res_reserve() const;
 
     // returns the result of ggml_backend_sched_graph_compute_async execution
-    ggml_status graph_compute(ggml_cgraph * gf, bool batched);
+    // tracked: gf was allocated by process_ubatch and is identified by gf_id - false for any other graph (e.g. the
+    //          K-shift and defrag graphs of the memory), so that the CPU backend does not take it for the last ubatch graph
+    ggml_status graph_compute(ggml_cgraph * gf, bool batched, bool tracked);
 
     // reserve a graph with a dummy ubatch of the specified size
     ggml_cgraph * graph_reserve(uint32_t n_tokens, uint32_t n_seqs, uint32_t n_outputs, const llama_memory_context_i * mctx, bool split_only = false);
@@ -217,6 +225,18 @@ private:
 
     llm_graph_cb graph_get_cb() const;
 
+    // the number of tokens to pad ubatch to (see cparams.n_ubatch_pad), ubatch.n_tokens if it is not padded
+    uint32_t graph_n_tokens_pad(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) const;
+
+    // swap gf_res_prev with a cached graph that can be reused with gparams, returns false if there is none
+    bool graph_cache_get(const llm_graph_params & gparams);
+
+    // keep gf_res_prev in the cache and replace it with a free graph result, evicting the least recently used one
+    void graph_cache_put();
+
+    // CPU node callback that reports the end of each layer to the model prefetcher
+    static void graph_node_prefetch(const ggml_tensor * t, void * user_data);
+
     // TODO: read/write lora adapters and cvec
     size_t state_write_data(llama_io_write_i & io);
     size_t state_read_data (llama_io_read_i  & io);
@@ -242,6 +262,21 @@ private:
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // in-graph top-k output (2-dimensional arrays: [n_outputs][logits_top_k_n]), replaces logits when cparams.logits_top_k > 0
+    size_t        logits_top_k_size = 0; // capacity (of elements) for each of the arrays
+    int64_t       logits_top_k_n    = 0;
+    float       * logits_top_k_val  = nullptr;
+    llama_token * logits_top_k_ids  = nullptr;
+
+    // restricted outputs, see llama_set_logits_subset()
+    // the logits of a restricted output are stored compacted at the start of its row of the logits array
+    std::vector<std::shared_ptr<const std::vector<llama_token>>> logits_subset;     // [LLAMA_MAX_SEQ] sorted allowed tokens of each sequence
+    std::vector<std::shared_ptr<const std::vector<llama_token>>> logits_subset_out; // [n_outputs_max] the allowed tokens of each output
+
+    std::vector<llama_token> logits_vocab_ids; // rows of the output projection computed for the current ubatch, empty for all
+    std::vector<int32_t>     logits_vocab_col; // [n_vocab] column of each token in logits_vocab_ids, -1 if not there
+    std::vector<float>       logits_compact;   // [n_outputs][logits_vocab_ids.size()] staging for the computed rows
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
@@ -285,9 +320,17 @@ private:
     std::vector<ggml_backend_t>             backend_ptrs;
     std::vector<ggml_backend_buffer_type_t> backend_buft;
 
+    // bumped whenever process_ubatch allocates a graph, see ggml_backend_cpu_set_graph_id()
+    uint64_t gf_id = 0;
+
     llm_graph_result_ptr gf_res_prev;
     llm_graph_result_ptr gf_res_reserve;
 
+    // graphs of other ubatch shapes, kept when cparams.n_ubatch_pad > 0 - most recently used first
+    std::vector<llm_graph_result_ptr> gf_res_cache;
+
+    static constexpr size_t n_graph_cache_max = 4;
+
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_ptr buf_output;
 
@@ -308,5 +351,5 @@ private:
     mutable int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     mutable int32_t n_eval   = 0; // number of eval calls
 
-    mutable int32_t n_reused = 0; // number of times the previous graph was reused
+    mutable int32_t n_reused = 0; // number of times the previous graph (or a cached one) was reused
 };
@@ -34,6 +34,12 @@ struct llama_cparams {
     bool op_offload;
     bool kv_unified;
 
+    int32_t logits_top_k; // > 0: only the ids and values of the top k logits of each output are extracted
+
+    uint32_t n_ubatch_pad; // > 0: ubatches of up to this many tokens are padded to the next power of two
+
+    float defrag_thold; // > 0: move a few KV cells per decode while the free cells below the last used one exceed this fraction
+
     enum llama_pooling_type pooling_type;
 
     ggml_backend_sched_eval_callback cb_eval;
@@ -143,6 +143,24 @@ bool llm_graph_input_out_ids::can_reuse(const llm_graph_params & params) {
     return res;
 }
 
+void llm_graph_input_vocab_ids::set_input(const llama_ubatch * ubatch) {
+    GGML_UNUSED(ubatch);
+
+    GGML_ASSERT(ids);
+    GGML_ASSERT(ggml_backend_buffer_is_host(ids->buffer));
+    GGML_ASSERT((int64_t) vocab_ids->size() == ids->ne[0]);
+
+    memcpy(ids->data, vocab_ids->data(), ggml_nbytes(ids));
+}
+
+bool llm_graph_input_vocab_ids::can_reuse(const llm_graph_params & params) {
+    bool res = true;
+
+    res &= ids->ne[0] == params.n_vocab_ids;
+
+    return res;
+}
+
 void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -461,6 +479,9 @@ void llm_graph_result::reset() {
     t_embd        = nullptr;
     t_embd_pooled = nullptr;
 
+    t_logits_top_k     = nullptr;
+    t_logits_top_k_ids = nullptr;
+
     params = {};
 
     inputs.clear();
@@ -565,6 +586,9 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     loras            (params.loras),
     mctx             (params.mctx),
     cross            (params.cross),
+    w_output         (params.w_output),
+    vocab_ids        (params.vocab_ids),
+    n_vocab_ids      (params.n_vocab_ids),
     cb_func          (params.cb),
     res              (params.res),
     ctx0             (res->get_ctx()),
@@ -587,7 +611,10 @@ ggml_tensor * llm_graph_context::build_cvec(
 ggml_tensor * llm_graph_context::build_lora_mm(
           ggml_tensor * w,
           ggml_tensor * cur) const {
-    ggml_tensor * res = ggml_mul_mat(ctx0, w, cur);
+    // restricted outputs: gather the rows of the allowed tokens before the output projection
+    ggml_tensor * ids = w == w_output && n_vocab_ids > 0 ? build_inp_vocab_ids() : nullptr;
+
+    ggml_tensor * res = ggml_mul_mat(ctx0, ids ? ggml_get_rows(ctx0, w, ids) : w, cur);
 
     for (const auto & lora : *loras) {
         llama_adapter_lora_weight * lw = lora.first->get_weight(w);
@@ -599,7 +626,7 @@ ggml_tensor * llm_graph_context::build_lora_mm(
         const float scale = lw->get_scale(lora.first->alpha, adapter_scale);
 
         ggml_tensor * ab_cur = ggml_mul_mat(
-                ctx0, lw->b,
+                ctx0, ids ? ggml_get_rows(ctx0, lw->b, ids) : lw->b,
                 ggml_mul_mat(ctx0, lw->a, cur)
                 );
 
@@ -1183,6 +1210,19 @@ ggml_tensor * llm_graph_context::build_inp_out_ids() const {
     return cur;
 }
 
+ggml_tensor * llm_graph_context::build_inp_vocab_ids() const {
+    auto inp = std::make_unique<llm_graph_input_vocab_ids>(vocab_ids);
+
+    auto & cur = inp->ids;
+
+    cur = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_vocab_ids);
+    ggml_set_input(cur);
+
+    res->add_input(std::move(inp));
+
+    return cur;
+}
+
 ggml_tensor * llm_graph_context::build_inp_mean() const {
     auto inp = std::make_unique<llm_graph_input_mean>(cparams);
 
@@ -1937,6 +1977,32 @@ void llm_graph_context::build_pooling(
     ggml_build_forward_expand(gf, cur);
 }
 
+void llm_graph_context::build_logits_top_k() const {
+    ggml_tensor * logits = res->t_logits;
+
+    if (cparams.logits_top_k <= 0 || logits == nullptr) {
+        return;
+    }
+
+    const int64_t n_vocab   = logits->ne[0];
+    const int64_t n_outputs = logits->ne[1];
+
+    const int64_t k = std::min<int64_t>(cparams.logits_top_k, n_vocab);
+
+    ggml_tensor * ids = ggml_top_k(ctx0, logits, k);
+    cb(ids, "result_top_k_ids", -1);
+
+    ggml_tensor * cur = ggml_get_rows(ctx0, ggml_reshape_3d(ctx0, logits, 1, n_vocab, n_outputs), ids);
+    cur = ggml_reshape_2d(ctx0, cur, k, n_outputs);
+    cb(cur, "result_top_k", -1);
+
+    res->t_logits_top_k_ids = ids;
+    res->t_logits_top_k     = cur;
+
+    ggml_build_forward_expand(gf, ids);
+    ggml_build_forward_expand(gf, cur);
+}
+
 int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t n_buckets, bool bidirectional) {
     // TODO move to hparams if a T5 variant appears that uses a different value
     const int64_t max_distance = 128;
@@ -192,6 +192,22 @@ public:
     const uint32_t n_outputs;
 };
 
+// the vocabulary rows of the output projection to compute, see llama_set_logits_subset()
+class llm_graph_input_vocab_ids : public llm_graph_input_i {
+public:
+    llm_graph_input_vocab_ids(const std::vector<llama_token> * vocab_ids) : vocab_ids(vocab_ids) {}
+    virtual ~llm_graph_input_vocab_ids() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    bool can_reuse(const llm_graph_params & params) override;
+
+    ggml_tensor * ids; // I32 [n_vocab_ids]
+
+    // owned by the context, filled in before each ubatch
+    const std::vector<llama_token> * vocab_ids;
+};
+
 class llm_graph_input_mean : public llm_graph_input_i {
 public:
     llm_graph_input_mean(const llama_cparams & cparams) : cparams(cparams) {}
@@ -412,6 +428,11 @@ struct llm_graph_params {
     const llama_memory_context_i * mctx;
     const llama_cross            * cross;
 
+    // when n_vocab_ids > 0, the output projection w_output is computed only for the tokens in vocab_ids
+    ggml_tensor                    * w_output;
+    const std::vector<llama_token> * vocab_ids;
+
+    uint32_t n_vocab_ids;
     uint32_t n_outputs;
 
     llm_graph_cb cb;
@@ -427,7 +448,8 @@ struct llm_graph_params {
             ubatch.n_tokens     == other.ubatch.n_tokens &&
             ubatch.n_seq_tokens == other.ubatch.n_seq_tokens &&
             ubatch.n_seqs       == other.ubatch.n_seqs &&
-            ubatch.n_seqs_unq   == other.ubatch.n_seqs_unq &&
+            // the unique sequences shape the graph only through the attention streams and the pooling
+            (ubatch.n_seqs_unq  == other.ubatch.n_seqs_unq || (cparams.kv_unified && !cparams.embeddings)) &&
             (
                 (!ubatch.token && !other.ubatch.token) ||
                 (!ubatch.embd  && !other.ubatch.embd)
@@ -452,14 +474,16 @@ struct llm_graph_params {
         }
 
         return
-            cparams.embeddings  == other.cparams.embeddings  &&
-            cparams.causal_attn == other.cparams.causal_attn &&
+            cparams.embeddings   == other.cparams.embeddings   &&
+            cparams.causal_attn  == other.cparams.causal_attn  &&
+            cparams.logits_top_k == other.cparams.logits_top_k &&
             arch      == other.arch  &&
             gtype     == other.gtype &&
             cvec      == other.cvec  &&
             loras     == other.loras &&
             cross     == other.cross &&
-            n_outputs == other.n_outputs;
+            n_vocab_ids == other.n_vocab_ids &&
+            n_outputs   == other.n_outputs;
     }
 };
 
@@ -471,6 +495,8 @@ public:
 
     ggml_tensor * get_tokens()      const { return t_tokens; }
     ggml_tensor * get_logits()      const { return t_logits; }
+    ggml_tensor * get_logits_top_k()     const { return t_logits_top_k; }
+    ggml_tensor * get_logits_top_k_ids() const { return t_logits_top_k_ids; }
     ggml_tensor * get_embd()        const { return t_embd; }
     ggml_tensor * get_embd_pooled() const { return t_embd_pooled; }
 
@@ -498,6 +524,9 @@ public:
     ggml_tensor * t_tokens      = nullptr;
     ggml_tensor * t_logits      = nullptr;
     ggml_tensor * t_embd        = nullptr;
+
+    ggml_tensor * t_logits_top_k     = nullptr; // [k, n_outputs] values of the k largest logits, when cparams.logits_top_k > 0
+    ggml_tensor * t_logits_top_k_ids = nullptr; // [k, n_outputs] their token ids
     ggml_tensor * t_embd_pooled = nullptr;
 
     std::vector<llm_graph_input_ptr> inputs;
@@ -575,6 +604,10 @@ struct llm_graph_context {
     const llama_memory_context_i * mctx;
     const llama_cross            * cross;
 
+    ggml_tensor                    * w_output;
+    const std::vector<llama_token> * vocab_ids;
+    const int64_t                    n_vocab_ids; // > 0: compute only these rows of w_output in build_lora_mm()
+
     const llm_graph_cb & cb_func;
 
     llm_graph_result * res;
@@ -676,6 +709,7 @@ struct llm_graph_context {
     ggml_tensor * build_inp_pos() const;
     ggml_tensor * build_inp_attn_scale() const;
     ggml_tensor * build_inp_out_ids() const;
+    ggml_tensor * build_inp_vocab_ids() const;
     ggml_tensor * build_inp_mean() const;
     ggml_tensor * build_inp_cls() const;
 
@@ -814,6 +848,13 @@ struct llm_graph_context {
             ggml_tensor * cls_b,
             ggml_tensor * cls_out,
             ggml_tensor * cls_out_b) const;
+
+    //
+    // sampling
+    //
+
+    // select the top cparams.logits_top_k logits of every output in-graph
+    void build_logits_top_k() const;
 };
 
 // TODO: better name
@@ -115,6 +115,8 @@ public:
     llama_memory_status  get_status() const override;
     const llama_ubatch & get_ubatch() const override;
 
+    bool update_needs_reserve() const override;
+
     //
     // llama_kv_cache_iswa_context specific API
     //
@@ -26,15 +26,39 @@ llama_kv_cache::llama_kv_cache(
                  uint32_t   kv_size,
                  uint32_t   n_seq_max,
                  uint32_t   n_pad,
+                 uint32_t   n_block,
+                 uint32_t   n_sink,
+                 uint32_t   n_window,
                  uint32_t   n_swa,
            llama_swa_type   swa_type,
     const layer_filter_cb & filter,
     const  layer_reuse_cb & reuse) :
     model(model), hparams(model.hparams), v_trans(v_trans),
-    n_seq_max(n_seq_max), n_stream(unified ? 1 : n_seq_max), n_pad(n_pad), n_swa(n_swa), swa_type(swa_type) {
+    n_seq_max(n_seq_max), n_stream(unified ? 1 : n_seq_max), n_pad(n_pad),
+    n_block(n_block > 1 && kv_size % n_block == 0 && swa_type == LLAMA_SWA_TYPE_NONE ? n_block : 1),
+    n_sink  (swa_type == LLAMA_SWA_TYPE_NONE && n_window > 0 ? n_sink   : 0),
+    n_window(swa_type == LLAMA_SWA_TYPE_NONE && n_window > 0 ? n_window : 0),
+    n_swa(n_swa), swa_type(swa_type) {
 
     GGML_ASSERT(kv_size % n_pad == 0);
 
+    if (n_block > 1 && this->n_block == 1) {
+        LLAMA_LOG_WARN("%s: n_block = %u requires a non-SWA cache with a size multiple of it (size = %u) - paging disabled\n",
+                __func__, n_block, kv_size);
+    }
+
+    if (n_window > 0 && this->n_window == 0) {
+        LLAMA_LOG_WARN("%s: StreamingLLM eviction is not supported with SWA - disabled\n", __func__);
+    }
+
+    if (this->n_window > 0) {
+        LLAMA_LOG_INFO("%s: StreamingLLM eviction: %u sink tokens, window of %u tokens\n", __func__, this->n_sink, this->n_window);
+
+        if (n_sink + n_window > kv_size) {
+            LLAMA_LOG_WARN("%s: the sinks and the window (%u) do not fit in the cache (size = %u)\n", __func__, n_sink + n_window, kv_size);
+        }
+    }
+
     const uint32_t n_layer_kv = hparams.n_layer_kv();
 
     // create a context for each buffer type
@@ -74,6 +98,11 @@ llama_kv_cache::llama_kv_cache(
         v_cells[s].resize(kv_size);
     }
 
+    v_block_seq.resize(n_stream);
+    for (uint32_t s = 0; s < n_stream; ++s) {
+        v_block_seq[s].assign(kv_size/this->n_block, -1);
+    }
+
     // by default, all sequence ids are mapped to the 0th stream
     seq_to_stream.resize(LLAMA_MAX_SEQ, 0);
 
@@ -181,6 +210,10 @@ llama_kv_cache::llama_kv_cache(
 
         LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
 
+        if (const size_t size_huge = ggml_backend_cpu_buffer_hugepage_size(buf)) {
+            LLAMA_LOG_INFO("%s: %10s KV buffer on huge pages = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), size_huge/1024.0/1024.0);
+        }
+
         ggml_backend_buffer_clear(buf, 0);
         bufs.emplace_back(buf);
     }
@@ -203,6 +236,12 @@ void llama_kv_cache::clear(bool data) {
     for (uint32_t s = 0; s < n_stream; ++s) {
         v_cells[s].reset();
         v_heads[s] = 0;
+
+        std::fill(v_block_seq[s].begin(), v_block_seq[s].end(), -1);
+    }
+
+    if (prefix) {
+        prefix->clear();
     }
 
     if (data) {
@@ -245,6 +284,15 @@ bool llama_kv_cache::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
         if (new_head != cells.size() && new_head < head) {
             head = new_head;
         }
+
+        if (p0 == 0 && p1 == std::numeric_limits<llama_pos>::max()) {
+            block_release(seq_id);
+            prefix_release(seq_id);
+        }
+
+        if (seq_id == prefix_seq) {
+            prefix_validate();
+        }
     } else {
         // match any sequence
         for (uint32_t s = 0; s < n_stream; ++s) {
@@ -270,6 +318,8 @@ bool llama_kv_cache::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
                 head = new_head;
             }
         }
+
+        prefix_validate();
     }
 
     return true;
@@ -378,6 +428,14 @@ void llama_kv_cache::seq_keep(llama_seq_id seq_id) {
     if (new_head != cells.size() && new_head < head) {
         head = new_head;
     }
+
+    for (auto & bs : v_block_seq[seq_to_stream[seq_id]]) {
+        if (bs != seq_id) {
+            bs = -1;
+        }
+    }
+
+    prefix_validate();
 }
 
 void llama_kv_cache::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
@@ -422,6 +480,9 @@ void llama_kv_cache::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, ll
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     head = new_head != cells.size() ? new_head : 0;
+
+    // the positions of shared cells moved for all of their sequences
+    prefix_validate();
 }
 
 void llama_kv_cache::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
@@ -455,6 +516,8 @@ void llama_kv_cache::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, in
             cells.pos_div(i, d);
         }
     }
+
+    prefix_validate();
 }
 
 llama_pos llama_kv_cache::seq_pos_min(llama_seq_id seq_id) const {
@@ -507,6 +570,11 @@ llama_memory_context_ptr llama_kv_cache::init_batch(
         }
 
         auto sinfos = prepare(ubatches);
+        if (sinfos.empty() && prefix_evict(balloc.get_n_tokens())) {
+            // make room by evicting unused prefixes and try again
+            sinfos = prepare(ubatches);
+        }
+
         if (sinfos.empty()) {
             break;
         }
@@ -523,11 +591,12 @@ llama_memory_context_ptr llama_kv_cache::init_full() {
 }
 
 llama_memory_context_ptr llama_kv_cache::init_update(llama_context * lctx, bool optimize) {
-    GGML_UNUSED(optimize);
-
     bool do_shift = get_has_shift();
 
-    return std::make_unique<llama_kv_cache_context>(this, lctx, do_shift, std::move(sc_info));
+    // optimize: a batch did not fit, compact the whole cache - otherwise a bounded step if the cache is fragmented
+    defrag_info dinfo = defrag_prepare(lctx, optimize);
+
+    return std::make_unique<llama_kv_cache_context>(this, lctx, do_shift, std::move(dinfo), std::move(sc_info));
 }
 
 llama_kv_cache::slot_info_vec_t llama_kv_cache::prepare(const std::vector<llama_ubatch> & ubatches) {
@@ -596,7 +665,7 @@ llama_kv_cache::slot_info_vec_t llama_kv_cache::prepare(const std::vector<llama_
     return res;
 }
 
-bool llama_kv_cache::update(llama_context * lctx, bool do_shift, const stream_copy_info & sc_info) {
+bool llama_kv_cache::update(llama_context * lctx, bool do_shift, const defrag_info & dinfo, const stream_copy_info & sc_info) {
     bool updated = false;
 
     auto * sched = lctx->get_sched();
@@ -651,7 +720,7 @@ bool llama_kv_cache::update(llama_context * lctx, bool do_shift, const stream_co
 
             res->set_inputs(nullptr);
 
-            if (lctx->graph_compute(gf, false) != GGML_STATUS_SUCCESS) {
+            if (lctx->graph_compute(gf, false, false) != GGML_STATUS_SUCCESS) {
                 LLAMA_LOG_ERROR("%s: failed to compute K-shift\n", __func__);
                 return updated;
             }
@@ -666,9 +735,144 @@ bool llama_kv_cache::update(llama_context * lctx, bool do_shift, const stream_co
         }
     }
 
+    if (!dinfo.empty()) {
+        LLAMA_LOG_DEBUG("%s: defragmenting KV cache: %zu runs of cells\n", __func__, dinfo.moves.size());
+
+        ggml_backend_sched_reset(sched);
+
+        auto * res = lctx->get_gf_res_reserve();
+
+        res->reset();
+
+        auto * gf = build_graph_defrag(res, lctx, dinfo);
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            LLAMA_LOG_ERROR("%s: failed to allocate compute graph for defrag\n", __func__);
+            return updated;
+        }
+
+        res->set_inputs(nullptr);
+
+        if (lctx->graph_compute(gf, false, false) != GGML_STATUS_SUCCESS) {
+            LLAMA_LOG_ERROR("%s: failed to compute defrag\n", __func__);
+            return updated;
+        }
+
+        // the tree of the prefix cache refers to the cells by index
+        std::vector<uint32_t> ids;
+        if (prefix) {
+            ids.resize(get_size());
+            for (uint32_t i = 0; i < ids.size(); ++i) {
+                ids[i] = i;
+            }
+        }
+
+        for (const auto & mv : dinfo.moves) {
+            auto & cells = v_cells[mv.strm];
+
+            for (uint32_t i = 0; i < mv.n; ++i) {
+                cells.mv(mv.src + i, mv.dst + i);
+
+                if (prefix) {
+                    ids[mv.src + i] = mv.dst + i;
+                }
+            }
+
+            n_defrag_moved += mv.n;
+        }
+
+        if (prefix) {
+            prefix->remap(ids);
+        }
+
+        for (uint32_t s = 0; s < n_stream; ++s) {
+            v_heads[s] = 0;
+        }
+
+        updated = true;
+    }
+
     return updated;
 }
 
+llama_kv_cache::defrag_info llama_kv_cache::defrag_prepare(const llama_context * lctx, bool full) const {
+    defrag_info res;
+
+    // paged caches keep every block to one sequence, moving cells between blocks would mix them
+    if (n_block > 1 || layers.empty()) {
+        return res;
+    }
+
+    const float thold = lctx->get_cparams().defrag_thold;
+
+    if (!full && thold <= 0.0f) {
+        return res;
+    }
+
+    // an incremental step moves at most this many cells, so that a single decode never pays for the whole compaction
+    const uint32_t n_move_max = full ? get_size() : 64;
+
+    // each run of cells costs a view + view + cpy for K and for V in every layer
+    const size_t n_runs_max = std::max<size_t>(1, (lctx->graph_max_nodes() - 2*layers.size())/(6*layers.size()));
+
+    for (uint32_t s = 0; s < n_stream; ++s) {
+        const auto & cells = v_cells[s];
+
+        const uint32_t n_used = cells.get_used();
+        const uint32_t n_span = cells.used_max_p1();
+
+        if (n_used == n_span) {
+            continue;
+        }
+
+        if (!full && (float) (n_span - n_used)/n_span <= thold) {
+            continue;
+        }
+
+        // fill the free cells from the bottom with the used cells from the top, run by run
+        //  - the cells below i0 are used or already filled by a planned move
+        //  - the cells from i1 up are free or already moved away by a planned move
+        uint32_t i0 = 0;
+        uint32_t i1 = n_span;
+
+        uint32_t n_moved = 0;
+
+        while (n_moved < n_move_max && res.moves.size() < n_runs_max) {
+            while (i0 < i1 && !cells.is_empty(i0)) {
+                i0++;
+            }
+
+            while (i1 > i0 && cells.is_empty(i1 - 1)) {
+                i1--;
+            }
+
+            if (i0 >= i1) {
+                break;
+            }
+
+            uint32_t n_free = 0;
+            while (i0 + n_free < i1 && cells.is_empty(i0 + n_free)) {
+                n_free++;
+            }
+
+            uint32_t n_last = 0;
+            while (i1 - n_last > i0 + n_free && !cells.is_empty(i1 - n_last - 1)) {
+                n_last++;
+            }
+
+            const uint32_t n = std::min({ n_free, n_last, n_move_max - n_moved });
+
+            res.moves.push_back({ s, i1 - n, i0, n });
+
+            i0 += n;
+            i1 -= n;
+
+            n_moved += n;
+        }
+    }
+
+    return res;
+}
+
 llama_kv_cache::slot_info llama_kv_cache::find_slot(const llama_ubatch & ubatch, bool cont) const {
 
     if (debug > 0) {
@@ -770,6 +974,14 @@ llama_kv_cache::slot_info llama_kv_cache::find_slot(const llama_ubatch & ubatch,
         res.strm[s] = seq_to_stream[seq_id];
         res.idxs[s].reserve(n_tokens);
 
+        if (n_block > 1 && !cont) {
+            if (!find_slot_paged(ubatch, s*n_tokens, n_tokens, seq_to_stream[seq_id], res.idxs[s])) {
+                return { };
+            }
+
+            continue;
+        }
+
         const auto & cells = v_cells[seq_to_stream[seq_id]];
 
         uint32_t head_cur = v_heads[seq_to_stream[seq_id]];
@@ -868,6 +1080,112 @@ llama_kv_cache::slot_info llama_kv_cache::find_slot(const llama_ubatch & ubatch,
     return res;
 }
 
+bool llama_kv_cache::find_slot_paged(const llama_ubatch & ubatch, uint32_t i0, uint32_t n_tokens, uint32_t strm, slot_info::idx_vec_t & idxs) const {
+    const auto & cells = v_cells[strm];
+
+    const uint32_t n_blocks = cells.size()/n_block;
+
+    if (n_tokens > cells.size() - cells.get_used()) {
+        return false;
+    }
+
+    // the cells are not modified until apply_ubatch(), so track the cells taken by this ubatch and the blocks it
+    // claims locally
+    std::vector<llama_seq_id> block_seq = v_block_seq[strm];
+    std::vector<uint32_t>     block_use(n_blocks, 0); // non-empty + taken cells in each block
+    std::vector<bool>         taken(cells.size(), false);
+
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (!cells.is_empty(i)) {
+            block_use[i/n_block]++;
+        }
+    }
+
+    // the block each sequence of the ubatch is currently filling
+    std::map<llama_seq_id, uint32_t> seq_block;
+
+    const uint32_t b_head = v_heads[strm]/n_block;
+
+    for (uint32_t i = i0; i < i0 + n_tokens; ++i) {
+        // tokens shared by several sequences go to the block of the first one
+        const llama_seq_id seq_id = ubatch.seq_id[i][0];
+
+        auto has_room = [&](uint32_t b) {
+            return block_use[b] > 0 && block_use[b] < n_block && block_seq[b] == seq_id;
+        };
+
+        uint32_t b = n_blocks;
+
+        // 1. the block the sequence is filling
+        auto it = seq_block.find(seq_id);
+        if (it != seq_block.end() && has_room(it->second)) {
+            b = it->second;
+        } else {
+            for (uint32_t j = 0; j < n_blocks; ++j) {
+                if (has_room(j)) {
+                    b = j;
+                    break;
+                }
+            }
+        }
+
+        // 2. a free block, starting from the head
+        if (b == n_blocks) {
+            for (uint32_t j = 0; j < n_blocks; ++j) {
+                const uint32_t k = (b_head + j) % n_blocks;
+                if (block_use[k] == 0) {
+                    b = k;
+                    block_seq[b] = seq_id;
+                    break;
+                }
+            }
+        }
+
+        uint32_t idx = cells.size();
+
+        if (b < n_blocks) {
+            for (uint32_t k = b*n_block; k < (b + 1)*n_block; ++k) {
+                if (cells.is_empty(k) && !taken[k]) {
+                    idx = k;
+                    break;
+                }
+            }
+
+            seq_block[seq_id] = b;
+        } else {
+            // 3. no free block left - use any free cell, as the unpaged cache would
+            for (uint32_t j = 0; j < cells.size(); ++j) {
+                const uint32_t k = (v_heads[strm] + j) % cells.size();
+                if (cells.is_empty(k) && !taken[k]) {
+                    idx = k;
+                    break;
+                }
+            }
+        }
+
+        if (idx == cells.size()) {
+            return false;
+        }
+
+        taken[idx] = true;
+        block_use[idx/n_block]++;
+
+        idxs.push_back(idx);
+    }
+
+    return true;
+}
+
+void llama_kv_cache::block_release(llama_seq_id seq_id) {
+    for (auto & block_seq : v_block_seq) {
+        for (auto & bs : block_seq) {
+            if (bs == seq_id) {
+                bs = -1;
+            }
+        }
+    }
+}
+
 void llama_kv_cache::apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch) {
     // keep track of the max sequence position that we would overwrite with this ubatch
     // for non-SWA cache, this would be always empty
@@ -878,6 +1196,34 @@ void llama_kv_cache::apply_ubatch(const slot_info & sinfo, const llama_ubatch &
 
     assert(ubatch.n_tokens == sinfo.n_stream()*sinfo.size());
 
+    if (n_block > 1) {
+        // the sequence of the first token placed in an empty block fills it from now on
+        for (uint32_t s = 0; s < sinfo.n_stream(); ++s) {
+            const auto & cells     = v_cells[sinfo.strm[s]];
+            auto       & block_seq = v_block_seq[sinfo.strm[s]];
+
+            std::vector<bool> seen(block_seq.size(), false);
+
+            for (uint32_t ii = 0; ii < sinfo.size(); ++ii) {
+                const uint32_t b = sinfo.idxs[s][ii]/n_block;
+                if (seen[b]) {
+                    continue;
+                }
+
+                seen[b] = true;
+
+                bool empty = true;
+                for (uint32_t k = b*n_block; k < (b + 1)*n_block && empty; ++k) {
+                    empty = cells.is_empty(k);
+                }
+
+                if (empty) {
+                    block_seq[b] = ubatch.seq_id[s*sinfo.size() + ii][0];
+                }
+            }
+        }
+    }
+
     for (uint32_t s = 0; s < sinfo.n_stream(); ++s) {
         for (uint32_t ii = 0; ii < sinfo.size(); ++ii) {
             const uint32_t i = s*sinfo.size() + ii;
@@ -933,6 +1279,39 @@ void llama_kv_cache::apply_ubatch(const slot_info & sinfo, const llama_ubatch &
     }
 }
 
+bool llama_kv_cache::can_pad(const slot_info & sinfo) const {
+    if (sinfo.n_stream() != 1) {
+        return false;
+    }
+
+    const auto & cells = v_cells[sinfo.strm[0]];
+
+    // conservative: assume that every cell of the slot is still empty before the ubatch is applied
+    return cells.get_used() + sinfo.size() < cells.size();
+}
+
+void llama_kv_cache::stream_evict() {
+    if (n_window == 0) {
+        return;
+    }
+
+    for (llama_seq_id seq_id = 0; seq_id < (llama_seq_id) n_seq_max; ++seq_id) {
+        // the tokens after the sinks that the next token no longer attends to
+        const llama_pos n_evict = seq_pos_max(seq_id) + 1 - (llama_pos) (n_sink + n_window);
+
+        // wait until a full window is masked out, so that the keys are re-rotated once every n_window tokens instead
+        // of after each one - until then the masked cells are only reused by find_slot()
+        if (n_evict < (llama_pos) n_window) {
+            continue;
+        }
+
+        LLAMA_LOG_DEBUG("%s: seq %d: evicting positions [%d, %d)\n", __func__, seq_id, n_sink, n_sink + n_evict);
+
+        seq_rm (seq_id, n_sink, n_sink + n_evict);
+        seq_add(seq_id, n_sink + n_evict, -1, -n_evict);
+    }
+}
+
 bool llama_kv_cache::get_can_shift() const {
     return true;
 }
@@ -957,6 +1336,231 @@ bool llama_kv_cache::get_has_shift() const {
     return result;
 }
 
+llama_memory_kv_stats llama_kv_cache::get_stats() const {
+    llama_memory_kv_stats res = {};
+
+    for (uint32_t s = 0; s < n_stream; ++s) {
+        const auto & cells = v_cells[s];
+
+        const uint32_t n_span = cells.used_max_p1();
+
+        res.n_cells += cells.size();
+        res.n_used  += cells.get_used();
+        res.n_span  += n_span;
+
+        for (uint32_t i = 0; i < n_span; ++i) {
+            if (cells.is_empty(i) && (i == 0 || !cells.is_empty(i - 1))) {
+                res.n_holes++;
+            }
+        }
+    }
+
+    res.frag    = res.n_span > 0 ? 1.0f - (float) res.n_used/res.n_span : 0.0f;
+    res.n_moved = n_defrag_moved;
+
+    return res;
+}
+
+bool llama_kv_cache::prefix_init(llama_seq_id seq_id_cache, uint32_t n_cells_max) {
+    if (n_stream != 1 || swa_type != LLAMA_SWA_TYPE_NONE || n_window > 0) {
+        LLAMA_LOG_WARN("%s: the prefix cache requires a unified KV cache without SWA or StreamingLLM eviction\n", __func__);
+        return false;
+    }
+
+    if (seq_id_cache < 0 || (uint32_t) seq_id_cache >= n_seq_max) {
+        LLAMA_LOG_WARN("%s: invalid seq_id_cache = %d, n_seq_max = %u\n", __func__, seq_id_cache, n_seq_max);
+        return false;
+    }
+
+    if (prefix) {
+        // drop the previous tree together with the cells it kept alive
+        seq_rm(prefix_seq, -1, -1);
+    }
+
+    prefix = std::make_unique<llama_kv_prefix_cache>();
+
+    prefix_seq         = seq_id_cache;
+    prefix_n_cells_max = n_cells_max;
+
+    return true;
+}
+
+uint32_t llama_kv_cache::prefix_attach(llama_seq_id seq_id, const llama_token * tokens, uint32_t n_tokens) {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+
+    if (!prefix || seq_id == prefix_seq) {
+        return 0;
+    }
+
+    seq_rm(seq_id, -1, -1);
+
+    if (n_tokens < 2) {
+        return 0;
+    }
+
+    auto & cells = v_cells[0];
+
+    std::vector<uint32_t> idxs;
+    std::vector<llama_kv_prefix_cache::node *> path;
+
+    // keep at least one token for the caller to process, so that it gets the logits of the last one
+    const uint32_t n = prefix->match(tokens, n_tokens - 1, idxs, path);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint32_t idx = idxs[i];
+
+        GGML_ASSERT(cells.seq_has(idx, prefix_seq) && cells.pos_get(idx) == (llama_pos) i);
+
+        cells.seq_add(idx, seq_id);
+    }
+
+    prefix->ref(seq_id, path);
+
+    LLAMA_LOG_DEBUG("%s: seq_id = %d, attached %u / %u tokens\n", __func__, seq_id, n, n_tokens);
+
+    return n;
+}
+
+void llama_kv_cache::prefix_store(llama_seq_id seq_id, const llama_token * tokens, uint32_t n_tokens) {
+    GGML_ASSERT(seq_id >= 0 && (size_t) seq_id < seq_to_stream.size());
+
+    if (!prefix || seq_id == prefix_seq || n_tokens == 0) {
+        return;
+    }
+
+    auto & cells = v_cells[0];
+
+    // the cells of seq_id at positions [0, n_tokens)
+    std::vector<uint32_t> idxs(n_tokens, UINT32_MAX);
+
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (cells.is_empty(i) || !cells.seq_has(i, seq_id)) {
+            continue;
+        }
+
+        const llama_pos p = cells.pos_get(i);
+        if (p >= 0 && (uint32_t) p < n_tokens && idxs[p] == UINT32_MAX) {
+            idxs[p] = i;
+        }
+    }
+
+    // only the positions before the first gap can be shared
+    uint32_t n = 0;
+    while (n < n_tokens && idxs[n] != UINT32_MAX) {
+        n++;
+    }
+
+    std::vector<llama_kv_prefix_cache::node *> path;
+    std::vector<uint32_t> added;
+
+    prefix->insert(tokens, idxs.data(), n, path, added);
+
+    for (const uint32_t idx : added) {
+        if (!cells.seq_has(idx, prefix_seq)) {
+            cells.seq_add(idx, prefix_seq);
+        }
+    }
+
+    prefix->ref(seq_id, path);
+
+    if (prefix_n_cells_max > 0) {
+        while (prefix->get_n_cells() > prefix_n_cells_max) {
+            auto * nd = prefix->lru_leaf();
+            if (nd == nullptr) {
+                break;
+            }
+
+            prefix_drop(nd);
+        }
+    }
+
+    LLAMA_LOG_DEBUG("%s: seq_id = %d, stored %u / %u tokens, %u new cells, %u cells in the tree\n",
+            __func__, seq_id, n, n_tokens, (uint32_t) added.size(), prefix->get_n_cells());
+}
+
+void llama_kv_cache::prefix_release(llama_seq_id seq_id) {
+    if (prefix) {
+        prefix->release(seq_id);
+    }
+}
+
+bool llama_kv_cache::prefix_evict(uint32_t n_free) {
+    if (!prefix) {
+        return false;
+    }
+
+    const auto & cells = v_cells[0];
+
+    bool res = false;
+
+    while (cells.size() - cells.get_used() < n_free) {
+        auto * nd = prefix->lru_leaf();
+        if (nd == nullptr) {
+            break;
+        }
+
+        prefix_drop(nd);
+
+        res = true;
+    }
+
+    return res;
+}
+
+void llama_kv_cache::prefix_drop(llama_kv_prefix_cache::node * nd) {
+    auto & cells = v_cells[0];
+    auto & head  = v_heads[0];
+
+    std::vector<uint32_t> idxs;
+    prefix->remove(nd, idxs);
+
+    for (const uint32_t idx : idxs) {
+        if (idx < cells.size() && !cells.is_empty(idx) && cells.seq_has(idx, prefix_seq)) {
+            if (cells.seq_rm(idx, prefix_seq) && idx < head) {
+                head = idx;
+            }
+        }
+    }
+}
+
+void llama_kv_cache::prefix_validate() {
+    if (!prefix) {
+        return;
+    }
+
+    const auto & cells = v_cells[0];
+
+    std::vector<llama_kv_prefix_cache::node *> invalid;
+
+    std::vector<llama_kv_prefix_cache::node *> stack = { prefix->get_root() };
+    while (!stack.empty()) {
+        auto * nd = stack.back();
+        stack.pop_back();
+
+        bool ok = true;
+        for (size_t i = 0; i < nd->cells.size() && ok; ++i) {
+            const uint32_t idx = nd->cells[i];
+
+            ok = idx < cells.size() && !cells.is_empty(idx) && cells.seq_has(idx, prefix_seq) &&
+                 cells.pos_get(idx) == nd->pos0 + (llama_pos) i;
+        }
+
+        if (!ok) {
+            // the whole branch goes, the nodes below depend on this one
+            invalid.push_back(nd);
+            continue;
+        }
+
+        for (auto & it : nd->children) {
+            stack.push_back(it.second.get());
+        }
+    }
+
+    for (auto * nd : invalid) {
+        prefix_drop(nd);
+    }
+}
+
 uint32_t llama_kv_cache::get_n_kv(const slot_info & sinfo) const {
     uint32_t result = 0;
 
@@ -1140,7 +1744,10 @@ ggml_tensor * llama_kv_cache::build_input_v_idxs(ggml_context * ctx, const llama
 
 void llama_kv_cache::set_input_k_idxs(ggml_tensor * dst, const llama_ubatch * ubatch, const slot_info & sinfo) const {
     const uint32_t n_tokens = ubatch->n_tokens;
-    GGML_ASSERT(n_tokens == (int64_t) sinfo.size()*sinfo.n_stream());
+
+    // a padded ubatch (see can_pad()) has more tokens than cells in the slot
+    const bool padded = n_tokens > sinfo.size()*sinfo.n_stream();
+    GGML_ASSERT(n_tokens == (int64_t) sinfo.size()*sinfo.n_stream() || (padded && sinfo.n_stream() == 1));
 
     GGML_ASSERT(ggml_backend_buffer_is_host(dst->buffer));
     int64_t * data = (int64_t *) dst->data;
@@ -1152,15 +1759,27 @@ void llama_kv_cache::set_input_k_idxs(ggml_tensor * dst, const llama_ubatch * ub
             data[s*sinfo.size() + i] = offs + sinfo.idxs[s][i];
         }
     }
+
+    if (padded) {
+        const int64_t idx = sinfo.strm[0]*get_size() + pad_cell(sinfo);
+
+        for (uint32_t i = sinfo.size(); i < n_tokens; ++i) {
+            data[i] = idx;
+        }
+    }
 }
 
 void llama_kv_cache::set_input_v_idxs(ggml_tensor * dst, const llama_ubatch * ubatch, const slot_info & sinfo) const {
     const uint32_t n_tokens = ubatch->n_tokens;
-    GGML_ASSERT(n_tokens == (int64_t) sinfo.size()*sinfo.n_stream());
+
+    const bool padded = n_tokens > sinfo.size()*sinfo.n_stream();
+    GGML_ASSERT(n_tokens == (int64_t) sinfo.size()*sinfo.n_stream() || (padded && sinfo.n_stream() == 1));
 
     GGML_ASSERT(ggml_backend_buffer_is_host(dst->buffer));
     int64_t * data = (int64_t *) dst->data;
 
+    const uint32_t i_pad = padded ? pad_cell(sinfo) : 0;
+
     if (!v_trans) {
         for (uint32_t s = 0; s < sinfo.n_stream(); ++s) {
             const int64_t offs = sinfo.strm[s]*get_size();
@@ -1169,6 +1788,10 @@ void llama_kv_cache::set_input_v_idxs(ggml_tensor * dst, const llama_ubatch * ub
                 data[s*sinfo.size() + i] = offs + sinfo.idxs[s][i];
             }
         }
+
+        for (uint32_t i = sinfo.size(); padded && i < n_tokens; ++i) {
+            data[i] = sinfo.strm[0]*get_size() + i_pad;
+        }
     } else {
         // note: the V cache is transposed when not using flash attention
         const int64_t kv_size = get_size();
@@ -1184,6 +1807,56 @@ void llama_kv_cache::set_input_v_idxs(ggml_tensor * dst, const llama_ubatch * ub
                 }
             }
         }
+
+        for (uint32_t i = sinfo.size(); padded && i < n_tokens; ++i) {
+            const int64_t offs = sinfo.strm[0]*kv_size*n_embd_v_gqa;
+
+            for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
+                data[i*n_embd_v_gqa + j] = offs + j*kv_size + i_pad;
+            }
+        }
+    }
+}
+
+uint32_t llama_kv_cache::pad_cell(const slot_info & sinfo) const {
+    const auto & cells = v_cells[sinfo.strm[0]];
+
+    // prefer a cell in the attended view, so that the dummy tokens can attend to it alone
+    const uint32_t n_kv = get_n_kv(sinfo);
+
+    for (uint32_t i = n_kv; i > 0; --i) {
+        if (cells.is_empty(i - 1)) {
+            return i - 1;
+        }
+    }
+
+    for (uint32_t i = n_kv; i < cells.size(); ++i) {
+        if (cells.is_empty(i)) {
+            return i;
+        }
+    }
+
+    GGML_ABORT("no empty cell for the padding of the ubatch - can_pad() should have prevented this");
+}
+
+void llama_kv_cache::set_input_kq_mask_pad(ggml_tensor * dst, const llama_ubatch * ubatch, const slot_info & sinfo) const {
+    GGML_ASSERT(sinfo.n_stream() == 1);
+
+    const int64_t n_kv  = dst->ne[0];
+    const int64_t i_pad = pad_cell(sinfo);
+
+    // otherwise the dummy tokens keep the row of the token they copy
+    if (i_pad >= n_kv) {
+        return;
+    }
+
+    float * data = (float *) dst->data;
+
+    for (uint32_t i = sinfo.size(); i < ubatch->n_tokens; ++i) {
+        float * row = data + i*n_kv;
+
+        std::fill(row, row + n_kv, -INFINITY);
+        row[i_pad] = 0.0f;
     }
 }
 
@@ -1216,8 +1889,6 @@ void llama_kv_cache::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * u
     const int64_t n_tps     = n_tokens/n_stream;
     const int64_t n_tps_pad = GGML_PAD(n_tps, GGML_KQ_MASK_PAD);
 
-    std::fill(data, data + ggml_nelements(dst), -INFINITY);
-
     // Use only the previous KV cells of the correct sequence for each token of the ubatch.
     // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
     // Example with a cache of 10 tokens, 2 tokens populated in cache and 3 tokens in batch:
@@ -1230,46 +1901,68 @@ void llama_kv_cache::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * u
     //      xxxxx-----
     //      xxxxx-----
     // To visualize the mask, see https://github.com/ggml-org/llama.cpp/pull/12615
-    // TODO: optimize this section
-    for (uint32_t h = 0; h < 1; ++h) {
-        for (uint32_t s = 0; s < n_stream; ++s) {
-            for (uint32_t ii = 0; ii < n_tps; ++ii) {
-                const uint32_t i = s*n_tps + ii;
+    //
+    // The cell metadata (emptiness, sequence set, position) is reduced once per sequence of the ubatch to a row of
+    // positions, with pos_hidden for the cells the sequence cannot see. Each mask row is then a single comparison per
+    // cell against the position of its token, instead of a walk over the cell metadata for every token.
+    constexpr llama_pos pos_hidden = std::numeric_limits<llama_pos>::max();
 
-                const llama_seq_id seq_id = ubatch->seq_id[i][0];
+    const uint32_t n_seqs_unq = ubatch->n_seqs_unq;
 
-                const auto & cells = v_cells[seq_to_stream[seq_id]];
+    auto & seq_cell_pos = kq_mask_cell_pos;
+    seq_cell_pos.resize(n_seqs_unq*n_kv);
 
-                const llama_pos p1 = ubatch->pos[i];
+    for (uint32_t k = 0; k < n_seqs_unq; ++k) {
+        const llama_seq_id seq_id = ubatch->seq_id_unq[k];
 
-                const uint64_t idst = n_kv*(h*n_stream*n_tps_pad + s*n_tps_pad + ii);
+        const auto & cells = v_cells[seq_to_stream[seq_id]];
 
-                for (uint32_t j = 0; j < n_kv; ++j) {
-                    if (cells.is_empty(j)) {
-                        continue;
-                    }
+        llama_pos * row = seq_cell_pos.data() + k*n_kv;
 
-                    // mask the token if not the same sequence
-                    if (!cells.seq_has(j, seq_id)) {
-                        continue;
-                    }
+        for (int64_t j = 0; j < n_kv; ++j) {
+            row[j] = !cells.is_empty(j) && cells.seq_has(j, seq_id) ? cells.pos_get(j) : pos_hidden;
+        }
+    }
 
-                    const llama_pos p0 = cells.pos_get(j);
+    // SWA, the StreamingLLM window and ALiBi need the position of each visible cell, the rest only a threshold
+    const bool pos_only = !hparams.use_alibi && swa_type == LLAMA_SWA_TYPE_NONE && n_window == 0;
 
-                    // mask future tokens
-                    if (causal_attn && p0 > p1) {
-                        continue;
-                    }
+    for (int64_t s = 0; s < n_stream; ++s) {
+        for (int64_t ii = 0; ii < n_tps; ++ii) {
+            const int64_t i = s*n_tps + ii;
 
-                    // apply SWA if any
-                    if (is_masked_swa(p0, p1)) {
-                        continue;
-                    }
+            const llama_seq_id seq_id = ubatch->seq_id[i][0];
+
+            const llama_pos * cpos = seq_cell_pos.data() + ubatch->seq_idx[seq_id]*n_kv;
+
+            const llama_pos p1 = ubatch->pos[i];
+
+            // mask future tokens
+            const llama_pos p_max = causal_attn ? p1 : pos_hidden - 1;
+
+            float * row = data + n_kv*(s*n_tps_pad + ii);
+
+            if (pos_only) {
+                for (int64_t j = 0; j < n_kv; ++j) {
+                    row[j] = cpos[j] <= p_max ? 0.0f : -INFINITY;
+                }
+                continue;
+            }
+
+            for (int64_t j = 0; j < n_kv; ++j) {
+                const llama_pos p0 = cpos[j];
 
-                    data[idst + j] = hparams.use_alibi ? -std::abs(p0 - p1) : 0.0f;
+                if (p0 > p_max || is_masked_swa(p0, p1)) {
+                    row[j] = -INFINITY;
+                    continue;
                 }
+
+                row[j] = hparams.use_alibi ? -std::abs(p0 - p1) : 0.0f;
             }
         }
+
+        // padding rows
+        std::fill(data + n_kv*(s*n_tps_pad + n_tps), data + n_kv*(s + 1)*n_tps_pad, -INFINITY);
     }
 }
 
@@ -1440,7 +2133,55 @@ ggml_cgraph * llama_kv_cache::build_graph_shift(llm_graph_result * res, llama_co
     return gf;
 }
 
+ggml_cgraph * llama_kv_cache::build_graph_defrag(
+        llm_graph_result * res,
+           llama_context * lctx,
+       const defrag_info & dinfo) const {
+    GGML_UNUSED(lctx);
+
+    auto * ctx = res->get_ctx();
+    auto * gf  = res->get_gf();
+
+    const uint64_t kv_size = get_size();
+
+    for (const auto & layer : layers) {
+        ggml_tensor * k = layer.k;
+        ggml_tensor * v = layer.v;
+
+        for (const auto & mv : dinfo.moves) {
+            // the runs never overlap, so the copies are independent of each other
+            ggml_tensor * k_src = ggml_view_2d(ctx, k, k->ne[0], mv.n, k->nb[1], k->nb[2]*mv.strm + k->nb[1]*mv.src);
+            ggml_tensor * k_dst = ggml_view_2d(ctx, k, k->ne[0], mv.n, k->nb[1], k->nb[2]*mv.strm + k->nb[1]*mv.dst);
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, k_src, k_dst));
+
+            ggml_tensor * v_src;
+            ggml_tensor * v_dst;
+
+            if (!v_trans) {
+                v_src = ggml_view_2d(ctx, v, v->ne[0], mv.n, v->nb[1], v->nb[2]*mv.strm + v->nb[1]*mv.src);
+                v_dst = ggml_view_2d(ctx, v, v->ne[0], mv.n, v->nb[1], v->nb[2]*mv.strm + v->nb[1]*mv.dst);
+            } else {
+                // transposed V: the cells are columns
+                const size_t el = ggml_element_size(v);
+
+                v_src = ggml_view_2d(ctx, v, mv.n, v->ne[0], el*kv_size, v->nb[2]*mv.strm + el*mv.src);
+                v_dst = ggml_view_2d(ctx, v, mv.n, v->ne[0], el*kv_size, v->nb[2]*mv.strm + el*mv.dst);
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, v_src, v_dst));
+        }
+    }
+
+    return gf;
+}
+
 bool llama_kv_cache::is_masked_swa(llama_pos p0, llama_pos p1) const {
+    // StreamingLLM: past the sinks, only the window is visible - like SWA, the masked cells can be reused by find_slot()
+    if (n_window > 0 && p0 >= (llama_pos) n_sink && p1 - p0 >= (llama_pos) n_window) {
+        return true;
+    }
+
     return llama_hparams::is_masked_swa(n_swa, swa_type, p0, p1);
 }
 
@@ -1531,6 +2272,8 @@ void llama_kv_cache::state_read(llama_io_read_i & io, llama_seq_id seq_id, llama
             throw std::runtime_error("failed to restore kv cache");
         }
     }
+
+    prefix_validate();
 }
 
 void llama_kv_cache::state_write_meta(llama_io_write_i & io, const cell_ranges_t & cr, llama_seq_id seq_id) const {
@@ -1916,8 +2659,9 @@ llama_kv_cache_context::llama_kv_cache_context(
         llama_kv_cache * kv,
         llama_context * lctx,
         bool do_shift,
-        stream_copy_info sc_info) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv), lctx(lctx), do_shift(do_shift), sc_info(std::move(sc_info)) {
-    if (!do_shift && this->sc_info.empty()) {
+        defrag_info dinfo,
+        stream_copy_info sc_info) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv), lctx(lctx), do_shift(do_shift), dinfo(std::move(dinfo)), sc_info(std::move(sc_info)) {
+    if (!do_shift && this->dinfo.empty() && this->sc_info.empty()) {
         status = LLAMA_MEMORY_STATUS_NO_UPDATE;
     }
 }
@@ -1934,6 +2678,9 @@ bool llama_kv_cache_context::next() {
     assert(status == LLAMA_MEMORY_STATUS_SUCCESS);
 
     if (++i_cur >= ubatches.size()) {
+        // the whole batch is in the cache
+        kv->stream_evict();
+
         return false;
     }
 
@@ -1945,7 +2692,7 @@ bool llama_kv_cache_context::apply() {
 
     // no ubatches -> this is a KV cache update
     if (ubatches.empty()) {
-        kv->update(lctx, do_shift, sc_info);
+        kv->update(lctx, do_shift, dinfo, sc_info);
 
         return true;
     }
@@ -1966,10 +2713,19 @@ const llama_ubatch & llama_kv_cache_context::get_ubatch() const {
     return ubatches[i_cur];
 }
 
+bool llama_kv_cache_context::update_needs_reserve() const {
+    // the defrag graph and the stream copies only copy between cache buffers, nothing lands in the compute buffers
+    return do_shift;
+}
+
 uint32_t llama_kv_cache_context::get_n_kv() const {
     return n_kv;
 }
 
+bool llama_kv_cache_context::can_pad() const {
+    return kv->can_pad(sinfos[i_cur]);
+}
+
 ggml_tensor * llama_kv_cache_context::get_k(ggml_context * ctx, int32_t il) const {
     return kv->get_k(ctx, il, n_kv, sinfos[i_cur]);
 }
@@ -2008,6 +2764,10 @@ void llama_kv_cache_context::set_input_v_idxs(ggml_tensor * dst, const llama_uba
 
 void llama_kv_cache_context::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
     kv->set_input_kq_mask(dst, ubatch, causal_attn);
+
+    if (ubatch->n_tokens > sinfos[i_cur].size()*sinfos[i_cur].n_stream()) {
+        kv->set_input_kq_mask_pad(dst, ubatch, sinfos[i_cur]);
+    }
 }
 
 void llama_kv_cache_context::set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const {
@@ -3,8 +3,10 @@
 #include "llama-batch.h"
 #include "llama-graph.h"
 #include "llama-kv-cells.h"
+#include "llama-kv-prefix-cache.h"
 #include "llama-memory.h"
 
+#include <memory>
 #include <unordered_map>
 #include <vector>
 
@@ -31,6 +33,22 @@ public:
         std::vector<uint32_t> sdst;
     };
 
+    // cells moved by a defragmentation step, in runs: cells [src, src + n) of stream strm move to [dst, dst + n)
+    struct defrag_info {
+        bool empty() const {
+            return moves.empty();
+        }
+
+        struct move {
+            uint32_t strm;
+            uint32_t src;
+            uint32_t dst;
+            uint32_t n;
+        };
+
+        std::vector<move> moves;
+    };
+
     // for each ubatch, create a slot_info that contains information about where the ubatch should be inserted in the
     //   KV cells. for example, cell indices for each token, such that: token[i] -> goes to cells[idxs[i]]
     struct slot_info {
@@ -88,6 +106,9 @@ public:
                      uint32_t   kv_size,
                      uint32_t   n_seq_max,
                      uint32_t   n_pad,
+                     uint32_t   n_block,
+                     uint32_t   n_sink,
+                     uint32_t   n_window,
                      uint32_t   n_swa,
                llama_swa_type   swa_type,
         const layer_filter_cb & filter,
@@ -137,6 +158,27 @@ public:
 
     bool get_has_shift() const;
 
+    llama_memory_kv_stats get_stats() const;
+
+    //
+    // prefix cache API (see llama_kv_prefix_cache)
+    //
+
+    // keep the cells of stored prefixes alive under seq_id_cache, which must not be used for decoding
+    // n_cells_max bounds the cells held by the tree (0 - no bound, the tree is only evicted when a batch does not fit)
+    // only supported for unified caches without SWA
+    bool prefix_init(llama_seq_id seq_id_cache, uint32_t n_cells_max);
+
+    // clear seq_id and attach to it the cells of the longest stored prefix of tokens[0, n_tokens - 1)
+    // returns the length of the prefix - the caller only has to process the remaining tokens
+    uint32_t prefix_attach(llama_seq_id seq_id, const llama_token * tokens, uint32_t n_tokens);
+
+    // store positions [0, n_tokens) of seq_id, holding tokens, in the tree
+    void prefix_store(llama_seq_id seq_id, const llama_token * tokens, uint32_t n_tokens);
+
+    // seq_id no longer uses its stored prefix, which can be evicted
+    void prefix_release(llama_seq_id seq_id);
+
     //
     // graph_build API
     //
@@ -159,7 +201,7 @@ public:
     // return empty vector on failure
     slot_info_vec_t prepare(const std::vector<llama_ubatch> & ubatches);
 
-    bool update(llama_context * lctx, bool do_shift, const stream_copy_info & sc_info);
+    bool update(llama_context * lctx, bool do_shift, const defrag_info & dinfo, const stream_copy_info & sc_info);
 
     // find a slot of kv cells that can hold the ubatch
     // if cont == true, then the slot must be continuous
@@ -169,6 +211,14 @@ public:
     // emplace the ubatch context into slot: [sinfo.idxs[0...ubatch.n_tokens - 1]]
     void apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch);
 
+    // true if the ubatch placed in sinfo can be padded with dummy tokens: their K/V rows are written to a cell that is
+    // still empty once the ubatch is applied, which no query attends to (see set_input_k_idxs())
+    bool can_pad(const slot_info & sinfo) const;
+
+    // StreamingLLM: drop the tokens between the sinks and the window of the sequences that outgrew them and shift the
+    // window down next to the sinks, called once a batch is in the cache
+    void stream_evict();
+
     //
     // input API
     //
@@ -184,6 +234,9 @@ public:
     void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
+    // let the dummy tokens of a padded ubatch attend only to the cell they write to, which keeps them cheap
+    void set_input_kq_mask_pad(ggml_tensor * dst, const llama_ubatch * ubatch, const slot_info & sinfo) const;
+
 private:
     const llama_model & model;
     const llama_hparams & hparams;
@@ -208,6 +261,15 @@ private:
     // required padding
     const uint32_t n_pad = 1;
 
+    // paged allocation: the cells are grouped in blocks of n_block cells and each block is filled by a single
+    // sequence (see find_slot_paged()), 1 - no blocks
+    const uint32_t n_block = 1;
+
+    // StreamingLLM eviction: each token attends to the first n_sink tokens of its sequence and to the n_window most
+    // recent ones (see is_masked_swa()), the tokens in between are evicted by stream_evict(), 0 - disabled
+    const uint32_t n_sink   = 0;
+    const uint32_t n_window = 0;
+
     // SWA
     const uint32_t n_swa = 0;
 
@@ -229,6 +291,10 @@ private:
     // maps from a sequence id to a stream id
     std::vector<uint32_t> seq_to_stream;
 
+    // block tables: the sequence that appends to each block of each stream, -1 if none
+    // only meaningful while the block is not empty - empty blocks are free for any sequence
+    std::vector<std::vector<llama_seq_id>> v_block_seq;
+
     // pending stream copies that will be applied during the next update
     stream_copy_info sc_info;
 
@@ -237,6 +303,32 @@ private:
     // model layer id -> KV cache layer id
     std::unordered_map<int32_t, int32_t> map_layer_ids;
 
+    // prefix cache, nullptr if not enabled
+    std::unique_ptr<llama_kv_prefix_cache> prefix;
+
+    llama_seq_id prefix_seq         = -1; // the sequence that keeps the cells of the tree alive
+    uint32_t     prefix_n_cells_max =  0;
+
+    // evict unused branches of the tree until n_free cells are free, returns false if nothing could be evicted
+    bool prefix_evict(uint32_t n_free);
+
+    // remove nd from the tree and release its cells
+    void prefix_drop(llama_kv_prefix_cache::node * nd);
+
+    // remove the branches whose cells no longer hold their tokens at the expected positions
+    // called after the cells were edited by other means than decoding (shifts, seq_keep, state loads, ...)
+    void prefix_validate();
+
+    // cells moved by the defragmentation so far
+    uint64_t n_defrag_moved = 0;
+
+    // scratch for set_input_kq_mask(): the cell positions visible to each sequence of the ubatch
+    mutable std::vector<llama_pos> kq_mask_cell_pos;
+
+    // plan the next defragmentation step: move the last used cells of each stream into the first free ones
+    // full == false: only if the fragmentation is above cparams.defrag_thold, and at most a few runs of cells
+    defrag_info defrag_prepare(const llama_context * lctx, bool full) const;
+
     size_t total_size() const;
 
     size_t size_k_bytes() const;
@@ -244,6 +336,16 @@ private:
 
     bool is_masked_swa(llama_pos p0, llama_pos p1) const;
 
+    // the cell that receives the K/V of the dummy tokens of a padded ubatch, an empty one - in the n_kv view if possible
+    uint32_t pad_cell(const slot_info & sinfo) const;
+
+    // find cells for the tokens [i0, i0 + n_tokens) of the ubatch in stream strm, block by block
+    // return false on failure
+    bool find_slot_paged(const llama_ubatch & ubatch, uint32_t i0, uint32_t n_tokens, uint32_t strm, slot_info::idx_vec_t & idxs) const;
+
+    // seq_id no longer appends to the blocks it owns
+    void block_release(llama_seq_id seq_id);
+
     ggml_tensor * build_rope_shift(
             const llama_cparams & cparams,
                    ggml_context * ctx,
@@ -257,6 +359,11 @@ private:
                llm_graph_result * res,
                   llama_context * lctx) const;
 
+    ggml_cgraph * build_graph_defrag(
+               llm_graph_result * res,
+                  llama_context * lctx,
+              const defrag_info & dinfo) const;
+
     struct cell_ranges_t {
         uint32_t strm;
 
@@ -275,6 +382,7 @@ public:
     // some shorthands
     using slot_info_vec_t  = llama_kv_cache::slot_info_vec_t;
     using stream_copy_info = llama_kv_cache::stream_copy_info;
+    using defrag_info      = llama_kv_cache::defrag_info;
 
     // used for errors
     llama_kv_cache_context(llama_memory_status status);
@@ -288,6 +396,7 @@ public:
             llama_kv_cache * kv,
             llama_context * lctx,
             bool do_shift,
+            defrag_info dinfo,
             stream_copy_info sc_info);
 
     // used to create a batch procesing context from a batch
@@ -308,12 +417,17 @@ public:
     llama_memory_status  get_status() const override;
     const llama_ubatch & get_ubatch() const override;
 
+    bool update_needs_reserve() const override;
+
     //
     // llama_kv_cache_context specific API
     //
 
     uint32_t get_n_kv() const;
 
+    // see llama_kv_cache::can_pad()
+    bool can_pad() const;
+
     // get views of the current state of the cache
     ggml_tensor * get_k(ggml_context * ctx, int32_t il) const;
     ggml_tensor * get_v(ggml_context * ctx, int32_t il) const;
@@ -352,6 +466,8 @@ private:
 
     bool do_shift = false;
 
+    defrag_info dinfo;
+
     stream_copy_info sc_info;
 
     //
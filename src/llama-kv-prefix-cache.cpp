@@ -0,0 +1,237 @@
+#include "llama-kv-prefix-cache.h"
+
+#include <algorithm>
+#include <cassert>
+
+//
+// llama_kv_prefix_cache
+//
+
+llama_kv_prefix_cache::llama_kv_prefix_cache() : root(std::make_unique<node>()) {
+}
+
+uint32_t llama_kv_prefix_cache::match(const llama_token * tokens, uint32_t n_tokens, std::vector<uint32_t> & cells, std::vector<node *> & path) {
+    t_now++;
+
+    uint32_t n = 0;
+
+    node * cur = root.get();
+
+    while (n < n_tokens) {
+        auto it = cur->children.find(tokens[n]);
+        if (it == cur->children.end()) {
+            break;
+        }
+
+        node * child = it->second.get();
+
+        uint32_t k = 0;
+        while (k < child->tokens.size() && n + k < n_tokens && child->tokens[k] == tokens[n + k]) {
+            k++;
+        }
+
+        cells.insert(cells.end(), child->cells.begin(), child->cells.begin() + k);
+        path.push_back(child);
+
+        child->t_used = t_now;
+
+        n += k;
+
+        if (k < child->tokens.size()) {
+            break;
+        }
+
+        cur = child;
+    }
+
+    return n;
+}
+
+void llama_kv_prefix_cache::insert(const llama_token * tokens, const uint32_t * cells, uint32_t n_tokens, std::vector<node *> & path, std::vector<uint32_t> & added) {
+    t_now++;
+
+    uint32_t n = 0;
+
+    node * cur = root.get();
+
+    while (n < n_tokens) {
+        auto it = cur->children.find(tokens[n]);
+        if (it == cur->children.end()) {
+            auto child = std::make_unique<node>();
+
+            child->tokens.assign(tokens + n, tokens + n_tokens);
+            child->cells .assign(cells  + n, cells  + n_tokens);
+            child->pos0   = n;
+            child->parent = cur;
+            child->t_used = t_now;
+
+            added.insert(added.end(), cells + n, cells + n_tokens);
+            n_cells += n_tokens - n;
+
+            path.push_back(child.get());
+            cur->children[tokens[n]] = std::move(child);
+
+            break;
+        }
+
+        node * child = it->second.get();
+
+        uint32_t k = 0;
+        while (k < child->tokens.size() && n + k < n_tokens && child->tokens[k] == tokens[n + k]) {
+            k++;
+        }
+
+        if (k < child->tokens.size()) {
+            child = split(child, k);
+        }
+
+        child->t_used = t_now;
+        path.push_back(child);
+
+        n  += k;
+        cur = child;
+    }
+}
+
+void llama_kv_prefix_cache::ref(llama_seq_id seq_id, const std::vector<node *> & path) {
+    release(seq_id);
+
+    for (node * nd : path) {
+        nd->n_ref++;
+    }
+
+    seq_refs[seq_id] = path;
+}
+
+void llama_kv_prefix_cache::release(llama_seq_id seq_id) {
+    auto it = seq_refs.find(seq_id);
+    if (it == seq_refs.end()) {
+        return;
+    }
+
+    for (node * nd : it->second) {
+        assert(nd->n_ref > 0);
+        nd->n_ref--;
+    }
+
+    seq_refs.erase(it);
+}
+
+llama_kv_prefix_cache::node * llama_kv_prefix_cache::lru_leaf() const {
+    node * res = nullptr;
+
+    std::vector<node *> stack = { root.get() };
+
+    while (!stack.empty()) {
+        node * nd = stack.back();
+        stack.pop_back();
+
+        if (nd->children.empty()) {
+            if (nd != root.get() && nd->n_ref == 0 && (!res || nd->t_used < res->t_used)) {
+                res = nd;
+            }
+            continue;
+        }
+
+        for (auto & it : nd->children) {
+            stack.push_back(it.second.get());
+        }
+    }
+
+    return res;
+}
+
+void llama_kv_prefix_cache::remove(node * nd, std::vector<uint32_t> & cells) {
+    assert(nd != root.get());
+
+    std::vector<node *> removed;
+
+    std::vector<node *> stack = { nd };
+    while (!stack.empty()) {
+        node * cur = stack.back();
+        stack.pop_back();
+
+        removed.push_back(cur);
+        cells.insert(cells.end(), cur->cells.begin(), cur->cells.end());
+        n_cells -= cur->cells.size();
+
+        for (auto & it : cur->children) {
+            stack.push_back(it.second.get());
+        }
+    }
+
+    // sequences keep their cells, they only lose the references to the removed nodes
+    for (auto & it : seq_refs) {
+        auto & refs = it.second;
+        refs.erase(std::remove_if(refs.begin(), refs.end(), [&](node * r) {
+            return std::find(removed.begin(), removed.end(), r) != removed.end();
+        }), refs.end());
+    }
+
+    nd->parent->children.erase(nd->tokens[0]);
+}
+
+void llama_kv_prefix_cache::clear() {
+    root = std::make_unique<node>();
+
+    n_cells = 0;
+
+    seq_refs.clear();
+}
+
+void llama_kv_prefix_cache::remap(const std::vector<uint32_t> & ids) {
+    std::vector<node *> stack = { root.get() };
+
+    while (!stack.empty()) {
+        node * nd = stack.back();
+        stack.pop_back();
+
+        for (auto & c : nd->cells) {
+            c = ids[c];
+        }
+
+        for (auto & it : nd->children) {
+            stack.push_back(it.second.get());
+        }
+    }
+}
+
+llama_kv_prefix_cache::node * llama_kv_prefix_cache::split(node * nd, uint32_t n) {
+    assert(n > 0 && n < nd->tokens.size());
+
+    node * parent = nd->parent;
+
+    std::unique_ptr<node> & slot = parent->children[nd->tokens[0]];
+    std::unique_ptr<node>   own  = std::move(slot);
+
+    auto top = std::make_unique<node>();
+
+    top->tokens.assign(nd->tokens.begin(), nd->tokens.begin() + n);
+    top->cells .assign(nd->cells .begin(), nd->cells .begin() + n);
+    top->pos0   = nd->pos0;
+    top->parent = parent;
+    top->n_ref  = nd->n_ref;
+    top->t_used = nd->t_used;
+
+    nd->tokens.erase(nd->tokens.begin(), nd->tokens.begin() + n);
+    nd->cells .erase(nd->cells .begin(), nd->cells .begin() + n);
+    nd->pos0  += n;
+    nd->parent = top.get();
+
+    top->children[nd->tokens[0]] = std::move(own);
+
+    node * res = top.get();
+
+    slot = std::move(top);
+
+    // the sequences that went through nd also go through the new node
+    for (auto & it : seq_refs) {
+        auto & refs = it.second;
+        auto pos = std::find(refs.begin(), refs.end(), nd);
+        if (pos != refs.end()) {
+            refs.insert(pos, res);
+        }
+    }
+
+    return res;
+}
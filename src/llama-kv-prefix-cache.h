@@ -0,0 +1,77 @@
+#pragma once
+
+#include "llama.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+//
+// llama_kv_prefix_cache
+//
+
+// radix tree of token sequences that were processed into the KV cells of a llama_kv_cache
+// every node holds a run of tokens together with the cells that store them - the cells of a path from the
+// root are the KV state of the prefix spelled by the path, at positions 0, 1, ...
+//
+// the tree only does the bookkeeping: llama_kv_cache keeps the cells of the tree alive (see prefix_init())
+// and attaches them to the sequences that start with a cached prefix
+class llama_kv_prefix_cache {
+public:
+    struct node {
+        std::vector<llama_token> tokens;
+        std::vector<uint32_t>    cells; // cells[i] stores tokens[i] at position pos0 + i
+
+        llama_pos pos0 = 0;
+
+        node * parent = nullptr;
+
+        std::map<llama_token, std::unique_ptr<node>> children;
+
+        int32_t  n_ref  = 0; // sequences currently using the node
+        uint64_t t_used = 0; // last match or insert through the node, for LRU eviction
+    };
+
+    llama_kv_prefix_cache();
+
+    // longest cached prefix of tokens[0, n_tokens)
+    // appends the cells of the prefix to cells and the nodes it goes through to path (the last one possibly matched
+    // only partially), returns the length of the prefix
+    uint32_t match(const llama_token * tokens, uint32_t n_tokens, std::vector<uint32_t> & cells, std::vector<node *> & path);
+
+    // add tokens[0, n_tokens) stored in cells[0, n_tokens), sharing the longest existing prefix
+    // the nodes the sequence goes through are appended to path, the cells that were not in the tree yet to added
+    void insert(const llama_token * tokens, const uint32_t * cells, uint32_t n_tokens, std::vector<node *> & path, std::vector<uint32_t> & added);
+
+    // the references of seq_id are replaced by path
+    void ref    (llama_seq_id seq_id, const std::vector<node *> & path);
+    void release(llama_seq_id seq_id);
+
+    // the least recently used leaf that no sequence uses, nullptr if there is none
+    node * lru_leaf() const;
+
+    // remove nd and everything below it, the cells they held are appended to cells
+    void remove(node * nd, std::vector<uint32_t> & cells);
+
+    void clear();
+
+    // the cells were moved: cell i is now ids[i]
+    void remap(const std::vector<uint32_t> & ids);
+
+    uint32_t get_n_cells() const { return n_cells; }
+
+    node * get_root() const { return root.get(); }
+
+private:
+    std::unique_ptr<node> root;
+
+    uint32_t n_cells = 0;
+    uint64_t t_now   = 0;
+
+    // nodes referenced by each sequence
+    std::map<llama_seq_id, std::vector<node *>> seq_refs;
+
+    // split nd after its first n tokens, the new node with these tokens takes the place of nd in the tree
+    node * split(node * nd, uint32_t n);
+};
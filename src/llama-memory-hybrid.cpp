@@ -40,6 +40,9 @@ llama_memory_hybrid::llama_memory_hybrid(
         kv_size,
         n_seq_max,
         n_pad,
+        1,
+        0,
+        0,
         n_swa,
         swa_type,
         filter_attn == nullptr ?
@@ -20,6 +20,13 @@ struct llama_memory_params {
 
     // use full-size SWA cache
     bool swa_full;
+
+    // KV cache block size in cells (0 or 1 - no blocks)
+    uint32_t n_block;
+
+    // StreamingLLM eviction: sink tokens and window of recent tokens (n_window == 0 - disabled)
+    uint32_t n_sink;
+    uint32_t n_window;
 };
 
 enum llama_memory_status {
@@ -59,6 +66,10 @@ struct llama_memory_context_i {
 
     // get the status of the memory context - used for error handling and checking if any updates would be applied
     virtual llama_memory_status get_status() const = 0;
+
+    // after apply() of a memory update: true if the update computed graphs that can change the compute buffers, so
+    // that the worst-case graph has to be reserved again
+    virtual bool update_needs_reserve() const { return true; }
 };
 
 using llama_memory_context_ptr = std::unique_ptr<llama_memory_context_i>;
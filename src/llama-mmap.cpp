@@ -9,6 +9,11 @@
 #include <stdexcept>
 #include <cerrno>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 #ifdef __has_include
     #if __has_include(<unistd.h>)
@@ -595,6 +600,156 @@ const bool llama_mlock::SUPPORTED = true;
 const bool llama_mlock::SUPPORTED = false;
 #endif
 
+// llama_prefetcher
+
+struct llama_prefetcher::impl {
+    impl(int n_layer, int n_ahead, bool evict) : n_layer(n_layer), n_ahead(n_ahead), evict(evict), ranges(n_layer + 1) {}
+
+    ~impl() {
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            cv.notify_one();
+            worker.join();
+        }
+    }
+
+    void add_range(int il, const void * addr, size_t size) {
+        GGML_ASSERT(il >= 0 && il <= n_layer);
+        ranges[il].emplace_back((uintptr_t) addr, (uintptr_t) addr + size);
+    }
+
+    void begin() {
+        if (!worker.joinable()) {
+            finalize_ranges();
+            worker = std::thread([this]() { run(); });
+        }
+
+        cur_layer.store(0, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int il = 0; il < std::min(n_ahead, n_layer + 1); ++il) {
+            queue.emplace_back(il, false);
+        }
+        cv.notify_one();
+    }
+
+    void layer_done(int il) {
+        if (il < 0 || il >= n_layer) {
+            return;
+        }
+
+        cur_layer.store(il + 1, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (il + n_ahead <= n_layer) {
+            queue.emplace_back(il + n_ahead, false);
+        }
+        // the first layers are prefetched again by the next begin(), keep them
+        if (evict && il >= n_ahead) {
+            queue.emplace_back(il, true);
+        }
+        cv.notify_one();
+    }
+
+    // merge the ranges of each layer into page-aligned, non-overlapping ranges
+    void finalize_ranges() {
+#ifdef _POSIX_MAPPED_FILES
+        const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+#else
+        const uintptr_t page_size = 4096;
+#endif
+        for (auto & rs : ranges) {
+            for (auto & r : rs) {
+                r.first  &= ~(page_size - 1);
+                r.second  = (r.second + page_size - 1) & ~(page_size - 1);
+            }
+            std::sort(rs.begin(), rs.end());
+
+            std::vector<std::pair<uintptr_t, uintptr_t>> merged;
+            for (const auto & r : rs) {
+                if (!merged.empty() && r.first <= merged.back().second) {
+                    merged.back().second = std::max(merged.back().second, r.second);
+                } else {
+                    merged.push_back(r);
+                }
+            }
+            rs = std::move(merged);
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this]() { return stop || !queue.empty(); });
+            if (stop) {
+                return;
+            }
+
+            const auto [il, is_evict] = queue.front();
+            queue.pop_front();
+
+            // a prefetch that the compute has already overtaken is useless
+            if (!is_evict && il < cur_layer.load(std::memory_order_relaxed)) {
+                continue;
+            }
+
+            lock.unlock();
+            for (const auto & r : ranges[il]) {
+                advise(r.first, r.second - r.first, is_evict);
+            }
+            lock.lock();
+        }
+    }
+
+    static void advise(uintptr_t addr, size_t size, bool is_evict) {
+#ifdef _POSIX_MAPPED_FILES
+#if defined(MADV_COLD)
+        const int advice = is_evict ? MADV_COLD : MADV_WILLNEED;
+#else
+        const int advice = is_evict ? MADV_DONTNEED : MADV_WILLNEED;
+#endif
+        if (madvise((void *) addr, size, advice)) {
+            LLAMA_LOG_DEBUG("%s: madvise(.., %s) failed: %s\n", __func__, is_evict ? "evict" : "MADV_WILLNEED", strerror(errno));
+        }
+#else
+        GGML_UNUSED(addr);
+        GGML_UNUSED(size);
+        GGML_UNUSED(is_evict);
+#endif
+    }
+
+    const int  n_layer;
+    const int  n_ahead;
+    const bool evict;
+
+    std::vector<std::vector<std::pair<uintptr_t, uintptr_t>>> ranges;
+
+    std::atomic<int> cur_layer { 0 };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<int, bool>> queue;
+    bool stop = false;
+
+    std::thread worker;
+};
+
+llama_prefetcher::llama_prefetcher(int n_layer, int n_ahead, bool evict) : pimpl(std::make_unique<impl>(n_layer, n_ahead, evict)) {}
+llama_prefetcher::~llama_prefetcher() = default;
+
+void llama_prefetcher::add_range(int il, const void * addr, size_t size) { pimpl->add_range(il, addr, size); }
+void llama_prefetcher::begin() { pimpl->begin(); }
+void llama_prefetcher::layer_done(int il) { pimpl->layer_done(il); }
+
+#ifdef _POSIX_MAPPED_FILES
+const bool llama_prefetcher::SUPPORTED = true;
+#else
+const bool llama_prefetcher::SUPPORTED = false;
+#endif
+
 size_t llama_path_max() {
     return PATH_MAX;
 }
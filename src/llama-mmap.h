@@ -51,6 +51,28 @@ private:
     std::unique_ptr<impl> pimpl;
 };
 
+// background madvise of the mmap-backed weights of the next layers while the current layer is computed
+// layers are indexed in graph order, 0..n_layer-1 for the repeating blocks and n_layer for the output
+struct llama_prefetcher {
+    llama_prefetcher(int n_layer, int n_ahead, bool evict);
+    ~llama_prefetcher();
+
+    // register the weight bytes [addr, addr + size) of layer il, before the first begin()
+    void add_range(int il, const void * addr, size_t size);
+
+    // a graph is about to be computed: prefetch its first layers
+    void begin();
+
+    // layer il has been computed: prefetch the next layer of the window, optionally evict layer il
+    void layer_done(int il);
+
+    static const bool SUPPORTED;
+
+private:
+    struct impl;
+    std::unique_ptr<impl> pimpl;
+};
+
 struct llama_mlock {
     llama_mlock();
     ~llama_mlock();
@@ -6022,12 +6022,64 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    // anonymous weight buffers are faulted in by now (GGML_HUGEPAGES)
+    for (auto & buf : pimpl->bufs) {
+        if (const size_t size_huge = ggml_backend_cpu_buffer_hugepage_size(buf.get())) {
+            LLAMA_LOG_INFO("%s: %12s model buffer on huge pages = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf.get()), size_huge / 1024.0 / 1024.0);
+        }
+    }
+
+    // spread the rows of the weights over the NUMA nodes of the threads that multiply them
+    if (ggml_is_numa()) {
+        size_t n_sharded = 0;
+        for (auto & ctx : pimpl->ctxs) {
+            for (auto * cur = ggml_get_first_tensor(ctx.get()); cur != NULL; cur = ggml_get_next_tensor(ctx.get(), cur)) {
+                if (cur->buffer && ggml_backend_buffer_is_host(cur->buffer) && ggml_numa_shard_tensor(cur)) {
+                    n_sharded += ggml_nbytes(cur);
+                }
+            }
+        }
+        if (n_sharded > 0) {
+            LLAMA_LOG_INFO("%s: distributed %.2f MiB of weights over the NUMA nodes\n", __func__, n_sharded / 1024.0 / 1024.0);
+        }
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             pimpl->mappings.emplace_back(std::move(mapping));
         }
     }
 
+    if (params.n_prefetch_layers > 0 && !pimpl->mappings.empty() && llama_prefetcher::SUPPORTED) {
+        prefetcher = std::make_unique<llama_prefetcher>(hparams.n_layer, params.n_prefetch_layers, params.prefetch_evict);
+
+        size_t n_bytes = 0;
+        for (const auto & [name, t] : tensors_by_name) {
+            // only weights that live in a file mapping, evicting anonymous memory would lose it
+            const bool mapped = std::any_of(pimpl->mappings.begin(), pimpl->mappings.end(), [&](const auto & mapping) {
+                const char * addr = (const char *) mapping->addr();
+                return (const char *) t->data >= addr && (const char *) t->data + ggml_nbytes(t) <= addr + mapping->size();
+            });
+            if (!mapped) {
+                continue;
+            }
+
+            int il = -1;
+            if (sscanf(name.c_str(), "blk.%d.", &il) != 1) {
+                il = name.rfind("output", 0) == 0 ? (int) hparams.n_layer : -1;
+            }
+            if (il < 0 || il > (int) hparams.n_layer) {
+                continue;
+            }
+
+            prefetcher->add_range(il, t->data, ggml_nbytes(t));
+            n_bytes += ggml_nbytes(t);
+        }
+
+        LLAMA_LOG_INFO("%s: prefetching %d layers ahead (%.2f MiB of mapped weights)%s\n", __func__,
+                params.n_prefetch_layers, n_bytes/1024.0/1024.0, params.prefetch_evict ? ", evicting computed layers" : "");
+    }
+
     return true;
 }
 
@@ -19351,6 +19403,9 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                                 n_ctx_per_stream,
                                 cparams.n_seq_max,
                                 padding,
+                                params.n_block,
+                                params.n_sink,
+                                params.n_window,
                                 hparams.n_swa,
                                 hparams.swa_type,
                                 nullptr,
@@ -19760,6 +19815,9 @@ ggml_cgraph * llama_model::build_graph(const llm_graph_params & params) const {
     // add on pooling layer
     llm->build_pooling(cls, cls_b, cls_out, cls_out_b);
 
+    // add on in-graph top-k of the logits
+    llm->build_logits_top_k();
+
     return llm->res->get_gf();
 }
 
@@ -19779,11 +19837,13 @@ llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.n_prefetch_layers           =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
         /*.use_extra_bufts             =*/ true,
+        /*.prefetch_evict              =*/ false,
     };
 
     return result;
@@ -16,6 +16,7 @@
 struct llama_cparams;
 struct llama_ubatch;
 struct llama_model_loader;
+struct llama_prefetcher;
 
 // available models
 enum llm_type {
@@ -448,6 +449,9 @@ struct llama_model {
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
+    // background prefetch of mmap-backed weights, null when disabled
+    std::unique_ptr<llama_prefetcher> prefetcher;
+
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
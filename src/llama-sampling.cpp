@@ -405,25 +405,50 @@ void llama_sampler_free(struct llama_sampler * smpl) {
 }
 
 llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
-    const auto * logits = llama_get_logits_ith(ctx, idx);
+    // TODO: do not allocate each time
+    std::vector<llama_token_data> cur;
 
-    const llama_model * model = llama_get_model(ctx);
-    const llama_vocab * vocab = llama_model_get_vocab(model);
+    // the context may have selected the candidates in-graph, see llama_set_logits_top_k
+    const llama_token * top_k_ids    = nullptr;
+    const float       * top_k_logits = nullptr;
 
-    const int n_vocab = llama_vocab_n_tokens(vocab);
+    const int32_t n_top_k = llama_get_logits_top_k_ith(ctx, idx, &top_k_ids, &top_k_logits);
 
-    // TODO: do not allocate each time
-    std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    // or the output may be restricted to a set of allowed tokens, see llama_set_logits_subset
+    const llama_token * subset_ids    = nullptr;
+    const float       * subset_logits = nullptr;
+
+    const int32_t n_subset = n_top_k > 0 ? 0 : llama_get_logits_subset_ith(ctx, idx, &subset_ids, &subset_logits);
+
+    if (n_top_k > 0) {
+        cur.reserve(n_top_k);
+        for (int32_t i = 0; i < n_top_k; i++) {
+            cur.emplace_back(llama_token_data{top_k_ids[i], top_k_logits[i], 0.0f});
+        }
+    } else if (n_subset > 0) {
+        cur.reserve(n_subset);
+        for (int32_t i = 0; i < n_subset; i++) {
+            cur.emplace_back(llama_token_data{subset_ids[i], subset_logits[i], 0.0f});
+        }
+    } else {
+        const auto * logits = llama_get_logits_ith(ctx, idx);
+
+        const llama_model * model = llama_get_model(ctx);
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+
+        cur.reserve(n_vocab);
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+        }
     }
 
     llama_token_data_array cur_p = {
         /* .data       = */ cur.data(),
         /* .size       = */ cur.size(),
         /* .selected   = */ -1,
-        /* .sorted     = */ false,
+        /* .sorted     = */ n_top_k > 0,
     };
 
     llama_sampler_apply(smpl, &cur_p);
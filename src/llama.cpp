@@ -75,7 +75,11 @@ void llama_backend_init(void) {
     }
 }
 
-void llama_numa_init(enum ggml_numa_strategy) { /* no-op in CPU-only build */ }
+void llama_numa_init(enum ggml_numa_strategy numa) {
+    if (numa != GGML_NUMA_STRATEGY_DISABLED) {
+        ggml_numa_init(numa);
+    }
+}
 
 void llama_backend_free(void) {
     ggml_quantize_free();
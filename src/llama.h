@@ -290,12 +290,16 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // with use_mmap, prefetch the weights of this many layers ahead of the computation in a background thread (0 = disabled)
+        int32_t n_prefetch_layers;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;      // only load the vocabulary, no weights
         bool use_mmap;        // use mmap if possible
         bool use_mlock;       // force system to keep model in RAM
         bool check_tensors;   // validate model tensor data
         bool use_extra_bufts; // use extra buffer types (used for weight repacking)
+        bool prefetch_evict;  // with n_prefetch_layers, mark the weights of computed layers as cold to bound the resident set
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -321,7 +325,7 @@ extern "C" {
         float    yarn_beta_fast;   // YaRN low correction dim
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
-        float    defrag_thold;     // [DEPRECATED] defragment the KV cache if holes/size > thold, <= 0 disabled (default)
+        float    defrag_thold;     // defragment the KV cache a few cells per decode while holes/span > thold, <= 0 - only when a batch does not fit (default)
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -329,6 +333,21 @@ extern "C" {
         enum ggml_type type_k; // data type for K cache [EXPERIMENTAL]
         enum ggml_type type_v; // data type for V cache [EXPERIMENTAL]
 
+        uint32_t n_kv_block; // allocate the KV cache in blocks of this many cells per sequence, 0 = per cell [EXPERIMENTAL]
+
+        // StreamingLLM eviction [EXPERIMENTAL]: each token attends to the first n_kv_sink tokens of its sequence and
+        // to the n_kv_window most recent ones; the tokens in between are dropped from the KV cache and the positions
+        // of the rest are shifted down, so memory and per-token cost stay bounded however long the sequence grows
+        // the positions of a sequence are compacted after a batch: continue it from llama_memory_seq_pos_max() + 1
+        // n_kv_window = 0 disables it, not supported for models with SWA layers or for sequences that share cells
+        uint32_t n_kv_sink;
+        uint32_t n_kv_window;
+
+        // pad the ubatches of up to n_ubatch_pad tokens to the next power of two with masked dummy tokens and keep the
+        // graphs of a few of these sizes, so that decoding a varying number of sequences does not rebuild the graph at
+        // every step, 0 = disabled [EXPERIMENTAL]
+        uint32_t n_ubatch_pad;
+
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
         // currently works only with CPU execution
@@ -696,6 +715,50 @@ extern "C" {
     // Check if the memory supports shifting
     LLAMA_API bool llama_memory_can_shift(llama_memory_t mem);
 
+    // Occupancy of the KV cells, summed over the streams of the cache
+    struct llama_memory_kv_stats {
+        uint32_t n_cells;  // size of the cache
+        uint32_t n_used;   // cells in use
+        uint32_t n_span;   // cells up to the last used one - the range that attention reads
+        uint32_t n_holes;  // runs of free cells inside the span
+        float    frag;     // fragmentation: 1 - n_used/n_span
+        uint64_t n_moved;  // cells moved by the defragmentation so far
+    };
+
+    // Returns zeros if the memory is not a KV cache
+    LLAMA_API struct llama_memory_kv_stats llama_memory_get_kv_stats(llama_memory_t mem);
+
+    // Prefix cache: a radix tree of processed token prefixes whose KV cells are shared by the sequences that start
+    // with them. Only supported by unified KV caches without SWA.
+    // seq_id_cache is reserved to keep the cells of the tree alive and must not be used for decoding
+    // n_cells_max bounds the cells held by the tree (0 - evict only when a batch does not fit)
+    // Returns false if the memory does not support it
+    LLAMA_API bool llama_memory_prefix_init(
+            llama_memory_t mem,
+              llama_seq_id seq_id_cache,
+                  uint32_t n_cells_max);
+
+    // Clear seq_id and attach the longest stored prefix of tokens (at most n_tokens - 1 of them)
+    // Returns the number of attached tokens - decode the remaining ones starting at that position
+    LLAMA_API int32_t llama_memory_prefix_attach(
+            llama_memory_t mem,
+              llama_seq_id seq_id,
+       const llama_token * tokens,
+                   int32_t n_tokens);
+
+    // Store the first n_tokens positions of seq_id, which hold tokens, in the tree
+    LLAMA_API void llama_memory_prefix_store(
+            llama_memory_t mem,
+              llama_seq_id seq_id,
+       const llama_token * tokens,
+                   int32_t n_tokens);
+
+    // seq_id no longer needs its stored prefix, which becomes evictable
+    // (implied by removing the whole sequence with llama_memory_seq_rm)
+    LLAMA_API void llama_memory_prefix_release(
+            llama_memory_t mem,
+              llama_seq_id seq_id);
+
     //
     // State / sessions
     //
@@ -895,6 +958,21 @@ extern "C" {
     // If set to true, the model will only attend to the past tokens
     LLAMA_API void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn);
 
+    // Select the k largest logits of every output inside the graph (k > 0) instead of copying out all n_vocab of them (k = 0, default)
+    // While enabled, llama_get_logits() and llama_get_logits_ith() return NULL, llama_get_logits_top_k_ith() returns the candidates
+    // and llama_sampler_sample() samples from them
+    // This is exact only for sampler chains that never look past the k best tokens (greedy, or top-k <= k as the first sampler)
+    LLAMA_API void llama_set_logits_top_k(struct llama_context * ctx, int32_t k);
+
+    // Restrict the logits of the outputs of sequence seq_id to the n_ids tokens in ids (a grammar, a label set, a whitelist)
+    // n_ids = 0 lifts the restriction. The restriction applies to the outputs of the following llama_decode() calls, by the
+    // first sequence of each output token, and is ignored while llama_set_logits_top_k() is enabled
+    // When all the outputs of a ubatch are restricted, only the rows of the output projection for their allowed tokens
+    // are computed. For restricted outputs, llama_get_logits_ith() returns NULL and llama_get_logits_subset_ith() returns
+    // the logits of the allowed tokens, which llama_sampler_sample() samples from. llama_get_logits() returns NULL while
+    // any output of the last llama_decode() is restricted
+    LLAMA_API void llama_set_logits_subset(struct llama_context * ctx, llama_seq_id seq_id, const llama_token * ids, int32_t n_ids);
+
     // Set whether the model is in warmup mode or not
     // If true, all model tensors are activated during llama_decode() to load and cache their weights.
     LLAMA_API void llama_set_warmup(struct llama_context * ctx, bool warmup);
@@ -912,6 +990,7 @@ extern "C" {
     // in the order they have appeared in the batch.
     // Rows: number of tokens for which llama_batch.logits[i] != 0
     // Cols: n_vocab
+    // Returns NULL while in-graph top-k is enabled or any of the outputs is restricted, see llama_set_logits_subset()
     // TODO: deprecate in favor of llama_get_logits_ith() (ref: https://github.com/ggml-org/llama.cpp/pull/14853#issuecomment-3113143522)
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
@@ -921,6 +1000,16 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // The k best (token, logit) pairs of the ith output, in descending order of logit, see llama_set_logits_top_k()
+    // Indices are interpreted as in llama_get_logits_ith()
+    // Returns k, or 0 if top-k logits are not enabled or the id is invalid
+    LLAMA_API int32_t llama_get_logits_top_k_ith(struct llama_context * ctx, int32_t i, const llama_token ** ids, const float ** logits);
+
+    // The allowed (token, logit) pairs of the ith output, in ascending order of token id, see llama_set_logits_subset()
+    // Indices are interpreted as in llama_get_logits_ith()
+    // Returns the number of allowed tokens, or 0 if the output is not restricted or the id is invalid
+    LLAMA_API int32_t llama_get_logits_subset_ith(struct llama_context * ctx, int32_t i, const llama_token ** ids, const float ** logits);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -4,11 +4,16 @@
 #include "ggml-impl.h"
 #include "binary-ops.h"
 #include "ggml.h"
+#include "quants.h"
 #include "unary-ops.h"
 #include "vec.h"
 
 #include <float.h>
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 // ggml_compute_forward_dup
 
@@ -3587,6 +3592,93 @@ void ggml_compute_forward_rms_norm(
     }
 }
 
+// ggml_compute_forward_rms_norm_mul_fused
+
+// fused [add ->] rms_norm -> mul
+// the result of the add (if any) is still written, since it is typically reused as the residual,
+// but the normalized row is only ever kept in registers/cache and never written to the rms_norm tensor
+void ggml_compute_forward_rms_norm_mul_fused(
+        const ggml_compute_params * params,
+        ggml_tensor * add,
+        const ggml_tensor * norm,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = norm->src[0];
+    const ggml_tensor * w    = dst->src[0] == norm ? dst->src[1] : dst->src[0];
+
+    GGML_ASSERT(add == NULL || src0 == add);
+    GGML_ASSERT(src0->type == GGML_TYPE_F32 && w->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(w->ne[0] == dst->ne[0]);
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(w->nb[0]    == sizeof(float));
+    GGML_ASSERT(dst->nb[0]  == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps >= 0.0f);
+
+    const ggml_tensor * a = add ? add->src[0] : NULL;
+    const ggml_tensor * b = add ? add->src[1] : NULL;
+
+    if (add) {
+        GGML_ASSERT(a->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32);
+        GGML_ASSERT(ggml_are_same_shape(a, add));
+        GGML_ASSERT(b->ne[0] == ne00);
+        GGML_ASSERT(a->nb[0] == sizeof(float) && b->nb[0] == sizeof(float));
+    }
+
+    const int64_t nr = ne01*ne02*ne03;
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+
+        if (add) {
+            const float * pa = (const float *) ((const char *) a->data + i01*a->nb[1] + i02*a->nb[2] + i03*a->nb[3]);
+            const float * pb = (const float *) ((const char *) b->data + (i01%b->ne[1])*b->nb[1] + (i02%b->ne[2])*b->nb[2] + (i03%b->ne[3])*b->nb[3]);
+
+            ggml_vec_add_f32(ne00, x, pa, pb);
+        }
+
+        ggml_float sum = 0.0;
+        for (int64_t i00 = 0; i00 < ne00; i00++) {
+            sum += (ggml_float)(x[i00] * x[i00]);
+        }
+
+        const float mean = sum/ne00;
+
+        const float scale = 1.0f/sqrtf(mean + eps);
+
+        // if you hit this, likely you got an inf somewhere earlier
+        assert(scale > 0.0f);
+
+        const float * pw = (const float *) ((const char *) w->data + (i01%w->ne[1])*w->nb[1] + (i02%w->ne[2])*w->nb[2] + (i03%w->ne[3])*w->nb[3]);
+
+        float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+        ggml_vec_mul_f32  (ne00, y, x, pw);
+        ggml_vec_scale_f32(ne00, y, scale);
+    }
+}
+
 static void ggml_compute_forward_rms_norm_back_f32(
         const ggml_compute_params * params,
         ggml_tensor * dst) {
@@ -5073,6 +5165,27 @@ void ggml_compute_forward_diag_mask_zero(
 
 // ggml_compute_forward_soft_max
 
+static inline float soft_max_scale_max_f32(const int64_t n, float * y, const float * x, const float scale) {
+    float max = -INFINITY;
+    for (int64_t i = 0; i < n; ++i) {
+        y[i] = x[i]*scale;
+        max = MAX(max, y[i]);
+    }
+    return max;
+}
+
+template <typename mask_t>
+static inline float soft_max_scale_mask_max_f32(const int64_t n, float * y, const float * x, const float scale, const float slope, const mask_t * mp) {
+    constexpr auto mask_to_f32 = type_conversion_table<mask_t>::to_f32;
+
+    float max = -INFINITY;
+    for (int64_t i = 0; i < n; ++i) {
+        y[i] = x[i]*scale + slope*mask_to_f32(mp[i]);
+        max = MAX(max, y[i]);
+    }
+    return max;
+}
+
 static void ggml_compute_forward_soft_max_f32(
         const ggml_compute_params * params,
               ggml_tensor * dst) {
@@ -5110,8 +5223,6 @@ static void ggml_compute_forward_soft_max_f32(
     const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
     const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
 
-    float * wp = (float *) params->wdata + (ne00 + CACHE_LINE_SIZE_F32) * ith;
-
     const bool use_f16 = (src1 && src1->type == GGML_TYPE_F16);
 
     // sinks
@@ -5135,36 +5246,29 @@ static void ggml_compute_forward_soft_max_f32(
                 ggml_fp16_t * mp_f16 = src1 ? (ggml_fp16_t *)((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13) : NULL;
                 float       * mp_f32 = src1 ? (float       *)((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13) : NULL;
 
-                ggml_vec_cpy_f32  (ne00, wp, sp);
-                ggml_vec_scale_f32(ne00, wp, scale);
-                if (mp_f32) {
-                    if (use_f16) {
-                        for (int i = 0; i < ne00; ++i) {
-                            wp[i] += slope*GGML_CPU_FP16_TO_FP32(mp_f16[i]);
-                        }
-                    } else {
-                        for (int i = 0; i < ne00; ++i) {
-                            wp[i] += slope*mp_f32[i];
-                        }
-                    }
+                // scale, ALiBi mask and max in one pass, written straight to dst
+                float max;
+                if (!mp_f32) {
+                    max = soft_max_scale_max_f32(ne00, dp, sp, scale);
+                } else if (use_f16) {
+                    max = soft_max_scale_mask_max_f32(ne00, dp, sp, scale, slope, mp_f16);
+                } else {
+                    max = soft_max_scale_mask_max_f32(ne00, dp, sp, scale, slope, mp_f32);
                 }
 
 #ifndef NDEBUG
                 for (int i = 0; i < ne00; ++i) {
                     //printf("p[%d] = %f\n", i, p[i]);
-                    assert(!isnan(wp[i]));
+                    assert(!isnan(dp[i]));
                 }
 #endif
 
-                float max = -INFINITY;
-                ggml_vec_max_f32(ne00, &max, wp);
-
                 // if we have sinks, make a correction as if they were included in the softmax
                 if (sk) {
                     max = MAX(max, sk[i02]);
                 }
 
-                ggml_float sum = ggml_vec_soft_max_f32(ne00, dp, wp, max);
+                ggml_float sum = ggml_vec_soft_max_f32(ne00, dp, dp, max);
                 assert(sum > 0.0);
 
                 if (sk) {
@@ -5535,6 +5639,173 @@ static void ggml_mrope_cache_init(
     }
 }
 
+// the sin/cos rows of ggml_rope_cache_init only depend on the position and the rope parameters, which are
+// the same for every layer (and for Q and K), so they are kept in a process-wide table that grows as new
+// positions appear instead of being recomputed by every thread of every rope op
+// mrope and positions outside [0, GGML_ROPE_CACHE_MAX_POS) (e.g. the negative deltas of a K-shift) bypass it
+
+#define GGML_ROPE_CACHE_BLOCK      256     // positions per allocation
+#define GGML_ROPE_CACHE_MAX_POS    (1<<18)
+#define GGML_ROPE_CACHE_MAX_ENTRIES 16
+
+struct ggml_rope_cache_entry {
+    // key
+    int   n_dims;
+    int   n_ctx_orig;
+    float freq_base;
+    float freq_scale;
+    float ext_factor;
+    float attn_factor;
+    float beta_fast;
+    float beta_slow;
+    float sin_sign;
+    std::vector<float> freq_factors; // empty when the op has no src2
+
+    // rows of n_dims floats (cos, sin interleaved) for positions [0, n_pos)
+    std::atomic<int64_t> n_pos { 0 };
+    std::unique_ptr<float[]> blocks[GGML_ROPE_CACHE_MAX_POS/GGML_ROPE_CACHE_BLOCK];
+
+    const float * row(int64_t p) const {
+        return blocks[p/GGML_ROPE_CACHE_BLOCK].get() + (p%GGML_ROPE_CACHE_BLOCK)*n_dims;
+    }
+};
+
+static struct {
+    std::mutex mutex;
+    std::atomic<int> n_entries { 0 };
+    std::unique_ptr<ggml_rope_cache_entry> entries[GGML_ROPE_CACHE_MAX_ENTRIES];
+} g_rope_cache;
+
+static bool ggml_rope_cache_match(
+        const ggml_rope_cache_entry & e, int n_dims, int n_ctx_orig, float freq_base, float freq_scale, float ext_factor,
+        float attn_factor, float beta_fast, float beta_slow, float sin_sign, const float * freq_factors) {
+    if (e.n_dims != n_dims || e.n_ctx_orig != n_ctx_orig || e.freq_base != freq_base || e.freq_scale != freq_scale ||
+        e.ext_factor != ext_factor || e.attn_factor != attn_factor || e.beta_fast != beta_fast || e.beta_slow != beta_slow ||
+        e.sin_sign != sin_sign) {
+        return false;
+    }
+    if (freq_factors == NULL) {
+        return e.freq_factors.empty();
+    }
+    return !e.freq_factors.empty() && memcmp(e.freq_factors.data(), freq_factors, (n_dims/2)*sizeof(float)) == 0;
+}
+
+// returns the table for these parameters, filled at least up to position p_max, or NULL if the table is full
+static const ggml_rope_cache_entry * ggml_rope_cache_get(
+        int n_dims, int n_ctx_orig, float freq_base, float freq_scale, float ext_factor, float attn_factor,
+        float beta_fast, float beta_slow, float sin_sign, const float * freq_factors, float corr_dims[2], float theta_scale,
+        int64_t p_max) {
+    GGML_ASSERT(p_max < GGML_ROPE_CACHE_MAX_POS);
+
+    ggml_rope_cache_entry * e = NULL;
+
+    // entries are never removed and their keys never change, so lookups of published entries need no lock
+    const int n_entries = g_rope_cache.n_entries.load(std::memory_order_acquire);
+    for (int i = 0; i < n_entries; ++i) {
+        if (ggml_rope_cache_match(*g_rope_cache.entries[i], n_dims, n_ctx_orig, freq_base, freq_scale, ext_factor,
+                    attn_factor, beta_fast, beta_slow, sin_sign, freq_factors)) {
+            e = g_rope_cache.entries[i].get();
+            break;
+        }
+    }
+
+    if (e != NULL && p_max < e->n_pos.load(std::memory_order_acquire)) {
+        return e;
+    }
+
+    std::lock_guard<std::mutex> lock(g_rope_cache.mutex);
+
+    if (e == NULL) {
+        // another thread may have added it in the meantime
+        const int n = g_rope_cache.n_entries.load(std::memory_order_relaxed);
+        for (int i = n_entries; i < n; ++i) {
+            if (ggml_rope_cache_match(*g_rope_cache.entries[i], n_dims, n_ctx_orig, freq_base, freq_scale, ext_factor,
+                        attn_factor, beta_fast, beta_slow, sin_sign, freq_factors)) {
+                e = g_rope_cache.entries[i].get();
+                break;
+            }
+        }
+        if (e == NULL) {
+            if (n == GGML_ROPE_CACHE_MAX_ENTRIES) {
+                return NULL;
+            }
+            std::unique_ptr<ggml_rope_cache_entry> entry(new ggml_rope_cache_entry);
+            entry->n_dims      = n_dims;
+            entry->n_ctx_orig  = n_ctx_orig;
+            entry->freq_base   = freq_base;
+            entry->freq_scale  = freq_scale;
+            entry->ext_factor  = ext_factor;
+            entry->attn_factor = attn_factor;
+            entry->beta_fast   = beta_fast;
+            entry->beta_slow   = beta_slow;
+            entry->sin_sign    = sin_sign;
+            if (freq_factors != NULL) {
+                entry->freq_factors.assign(freq_factors, freq_factors + n_dims/2);
+            }
+            e = entry.get();
+            g_rope_cache.entries[n] = std::move(entry);
+            g_rope_cache.n_entries.store(n + 1, std::memory_order_release);
+        }
+    }
+
+    // fill the missing positions; readers only look at rows below n_pos, so existing rows stay valid
+    const int64_t n_pos = e->n_pos.load(std::memory_order_relaxed);
+    for (int64_t p = n_pos; p <= p_max; ++p) {
+        std::unique_ptr<float[]> & block = e->blocks[p/GGML_ROPE_CACHE_BLOCK];
+        if (!block) {
+            block.reset(new float[GGML_ROPE_CACHE_BLOCK*n_dims]);
+        }
+        float * row = block.get() + (p%GGML_ROPE_CACHE_BLOCK)*n_dims;
+        ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, n_dims, ext_factor, attn_factor, row, sin_sign, theta_scale);
+    }
+    if (p_max >= n_pos) {
+        e->n_pos.store(p_max + 1, std::memory_order_release);
+    }
+
+    return e;
+}
+
+// highest position in [0, GGML_ROPE_CACHE_MAX_POS), or -1 if there is none
+static int64_t ggml_rope_cache_max_pos(const int32_t * pos, int64_t n) {
+    int64_t p_max = -1;
+    for (int64_t i = 0; i < n; ++i) {
+        if (pos[i] < GGML_ROPE_CACHE_MAX_POS) {
+            p_max = MAX(p_max, (int64_t) pos[i]);
+        }
+    }
+    return p_max;
+}
+
+// rotate the first n_dims values of a contiguous row by the (cos, sin) pairs of a cache row
+// x and y may alias (in-place rope), but each iteration reads its pair before writing it
+
+static inline void rope_rotate_neox_f32(const int64_t n_dims, const float * cache, const float * x, float * y) {
+    const int64_t n = n_dims/2;
+    for (int64_t ic = 0; ic < n; ic++) {
+        const float cos_theta = cache[2*ic + 0];
+        const float sin_theta = cache[2*ic + 1];
+
+        const float x0 = x[ic];
+        const float x1 = x[ic + n];
+
+        y[ic]     = x0*cos_theta - x1*sin_theta;
+        y[ic + n] = x0*sin_theta + x1*cos_theta;
+    }
+}
+
+static inline void rope_rotate_norm_f32(const int64_t n_dims, const float * cache, const float * x, float * y) {
+    for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
+        const float cos_theta = cache[i0 + 0];
+        const float sin_theta = cache[i0 + 1];
+
+        const float x0 = x[i0 + 0];
+        const float x1 = x[i0 + 1];
+
+        y[i0 + 0] = x0*cos_theta - x1*sin_theta;
+        y[i0 + 1] = x0*sin_theta + x1*cos_theta;
+    }
+}
+
 static void ggml_compute_forward_rope_f32(
         const ggml_compute_params * params,
         ggml_tensor * dst,
@@ -5567,6 +5838,7 @@ static void ggml_compute_forward_rope_f32(
     //printf("n_past = %d, ne2 = %d\n", n_past, ne2);
 
     GGML_ASSERT(nb00 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(float));
 
     const int ith = params->ith;
     const int nth = params->nth;
@@ -5617,22 +5889,45 @@ static void ggml_compute_forward_rope_f32(
 
     const int32_t * pos = (const int32_t *) src1->data;
 
+    const ggml_rope_cache_entry * rope_cache = NULL;
+    if (!is_mrope) {
+        const int64_t p_max = ggml_rope_cache_max_pos(pos, ne2);
+        if (p_max >= 0) {
+            rope_cache = ggml_rope_cache_get(n_dims, n_ctx_orig, freq_base, freq_scale, ext_factor, attn_factor,
+                    beta_fast, beta_slow, sin_sign, freq_factors, corr_dims, theta_scale, p_max);
+        }
+    }
+
     for (int64_t i3 = 0; i3 < ne3; i3++) { // batch
         for (int64_t i2 = 0; i2 < ne2; i2++) { // seq-len
+            // all heads of this position belong to other threads
+            if (ir + ne1 <= ir0) {
+                ir += ne1;
+                continue;
+            }
+            if (ir >= ir1) {
+                break;
+            }
 
-            float * cache = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
-            if (!is_mrope) {
+            const float * cache = NULL;
+            if (rope_cache != NULL && pos[i2] >= 0 && pos[i2] < GGML_ROPE_CACHE_MAX_POS) {
+                cache = rope_cache->row(pos[i2]);
+            } else if (!is_mrope) {
+                float * tmp = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
                 const int64_t p = pos[i2];
-                ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+                ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, tmp, sin_sign, theta_scale);
+                cache = tmp;
             }
             else {
+                float * tmp = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
                 const int64_t p_t = pos[i2];
                 const int64_t p_h = pos[i2 + ne2];
                 const int64_t p_w = pos[i2 + ne2 * 2];
                 const int64_t p_e = pos[i2 + ne2 * 3];
                 ggml_mrope_cache_init(
                     p_t, p_h, p_w, p_e, sections, is_vision,
-                    freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+                    freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, tmp, sin_sign, theta_scale);
+                cache = tmp;
             }
 
             for (int64_t i1 = 0; i1 < ne1; i1++) { // attn-heads
@@ -5657,36 +5952,14 @@ static void ggml_compute_forward_rope_f32(
                             dst_data[n_dims] = x0*sin_theta + x1*cos_theta;
                         }
                     } else {
-                        for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
-                            const int64_t ic = i0/2;
-
-                            const float cos_theta = cache[i0 + 0];
-                            const float sin_theta = cache[i0 + 1];
-
-                            const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + ic*nb00);
-                            float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + ic*nb0);
-
-                            const float x0 = src[0];
-                            const float x1 = src[n_dims/2];
-
-                            dst_data[0]        = x0*cos_theta - x1*sin_theta;
-                            dst_data[n_dims/2] = x0*sin_theta + x1*cos_theta;
-                        }
+                        rope_rotate_neox_f32(n_dims, cache,
+                                (const float *)((const char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01),
+                                (float *)((char *) dst->data + i3*nb3 + i2*nb2 + i1*nb1));
                     }
                 } else {
-                    for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
-                        const float cos_theta = cache[i0 + 0];
-                        const float sin_theta = cache[i0 + 1];
-
-                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
-
-                        const float x0 = src[0];
-                        const float x1 = src[1];
-
-                        dst_data[0] = x0*cos_theta - x1*sin_theta;
-                        dst_data[1] = x0*sin_theta + x1*cos_theta;
-                    }
+                    rope_rotate_norm_f32(n_dims, cache,
+                            (const float *)((const char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01),
+                            (float *)((char *) dst->data + i3*nb3 + i2*nb2 + i1*nb1));
                 }
 
                 if (is_vision) {
@@ -5803,22 +6076,45 @@ static void ggml_compute_forward_rope_f16(
 
     const int32_t * pos = (const int32_t *) src1->data;
 
+    const ggml_rope_cache_entry * rope_cache = NULL;
+    if (!is_mrope) {
+        const int64_t p_max = ggml_rope_cache_max_pos(pos, ne2);
+        if (p_max >= 0) {
+            rope_cache = ggml_rope_cache_get(n_dims, n_ctx_orig, freq_base, freq_scale, ext_factor, attn_factor,
+                    beta_fast, beta_slow, sin_sign, freq_factors, corr_dims, theta_scale, p_max);
+        }
+    }
+
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = 0; i2 < ne2; i2++) {
+            // all heads of this position belong to other threads
+            if (ir + ne1 <= ir0) {
+                ir += ne1;
+                continue;
+            }
+            if (ir >= ir1) {
+                break;
+            }
 
-            float * cache = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
-            if (!is_mrope) {
+            const float * cache = NULL;
+            if (rope_cache != NULL && pos[i2] >= 0 && pos[i2] < GGML_ROPE_CACHE_MAX_POS) {
+                cache = rope_cache->row(pos[i2]);
+            } else if (!is_mrope) {
+                float * tmp = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
                 const int64_t p = pos[i2];
-                ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+                ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, tmp, sin_sign, theta_scale);
+                cache = tmp;
             }
             else {
+                float * tmp = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
                 const int64_t p_t = pos[i2];
                 const int64_t p_h = pos[i2 + ne2];
                 const int64_t p_w = pos[i2 + ne2 * 2];
                 const int64_t p_e = pos[i2 + ne2 * 3];
                 ggml_mrope_cache_init(
                     p_t, p_h, p_w, p_e, sections, is_vision,
-                    freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+                    freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, tmp, sin_sign, theta_scale);
+                cache = tmp;
             }
 
             for (int64_t i1 = 0; i1 < ne1; i1++) {
@@ -7911,17 +8207,184 @@ void ggml_compute_forward_argsort(
     }
 }
 
+// ggml_compute_forward_top_k
+
+struct ggml_top_k_item {
+    float   v;
+    int32_t i;
+};
+
+// higher value first, lower index first on ties, so that the result does not depend on the thread count
+static inline bool ggml_top_k_better(const ggml_top_k_item & a, const ggml_top_k_item & b) {
+    return a.v > b.v || (a.v == b.v && a.i < b.i);
+}
+
+// offers an item to the heap h of the n best items seen so far (the worst of them on top), returns the new n
+static inline int64_t ggml_top_k_push(ggml_top_k_item * h, int64_t n, const int64_t k, const ggml_top_k_item & item) {
+    if (n < k) {
+        h[n++] = item;
+        std::push_heap(h, h + n, ggml_top_k_better);
+    } else if (ggml_top_k_better(item, h[0])) {
+        std::pop_heap(h, h + n, ggml_top_k_better);
+        h[n - 1] = item;
+        std::push_heap(h, h + n, ggml_top_k_better);
+    }
+    return n;
+}
+
+static int64_t ggml_top_k_select(const float * x, const int64_t i0, const int64_t i1, const int64_t k, ggml_top_k_item * h) {
+    int64_t n = 0;
+    for (int64_t i = i0; i < i1; ++i) {
+        // most of a large row is below the current k-th value
+        if (n == k && x[i] < h[0].v) {
+            continue;
+        }
+        n = ggml_top_k_push(h, n, k, { x[i], (int32_t) i });
+    }
+    return n;
+}
+
+static void ggml_compute_forward_top_k_f32(
+    const ggml_compute_params * params,
+    ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = dst->src[0];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    GGML_ASSERT(nb00 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(int32_t));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t k  = ne0;
+    const int64_t nr = ggml_nrows(src0);
+
+    // per thread heap, see ggml_graph_plan
+    const size_t heap_size = k*sizeof(ggml_top_k_item) + CACHE_LINE_SIZE;
+    ggml_top_k_item * heap = (ggml_top_k_item *) ((char *) params->wdata + ith*heap_size);
+
+    // few long rows (logits of a decode step): every thread selects from a part of the row and thread 0 merges
+    const bool split_row = nr < nth && ne00 >= 4096 && ne00/nth >= 4*k;
+
+    for (int64_t ir = split_row ? 0 : ith; ir < nr; ir += split_row ? 1 : nth) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const float * src_data = (const float *) ((const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+              int32_t * dst_data = (int32_t *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+        int64_t n;
+        if (split_row) {
+            const int64_t i0 = (ne00*ith)/nth;
+            const int64_t i1 = (ne00*(ith + 1))/nth;
+
+            n = ggml_top_k_select(src_data, i0, i1, k, heap);
+            for (int64_t j = n; j < k; ++j) {
+                heap[j] = { -INFINITY, -1 };
+            }
+
+            ggml_barrier(params->threadpool);
+
+            if (ith == 0) {
+                for (int t = 1; t < nth; ++t) {
+                    const ggml_top_k_item * other = (const ggml_top_k_item *) ((const char *) params->wdata + t*heap_size);
+                    for (int64_t j = 0; j < k; ++j) {
+                        if (other[j].i >= 0) {
+                            n = ggml_top_k_push(heap, n, k, other[j]);
+                        }
+                    }
+                }
+            }
+        } else {
+            n = ggml_top_k_select(src_data, 0, ne00, k, heap);
+        }
+
+        if (!split_row || ith == 0) {
+            GGML_ASSERT(n == k);
+
+            std::sort_heap(heap, heap + n, ggml_top_k_better);
+            for (int64_t j = 0; j < k; ++j) {
+                dst_data[j] = heap[j].i;
+            }
+        }
+
+        if (split_row && ir + 1 < nr) {
+            // the heaps are reused for the next row
+            ggml_barrier(params->threadpool);
+        }
+    }
+}
+
+void ggml_compute_forward_top_k(
+    const ggml_compute_params * params,
+    ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_top_k_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
 // ggml_compute_forward_flash_attn_ext
 
-static void ggml_compute_forward_flash_attn_ext_f16(
-        const ggml_compute_params * params,
-        ggml_tensor * dst) {
+// minimum number of KV cells per chunk when the KV dimension is split across threads
+static const int64_t GGML_FA_SPLIT_KV_MIN_CHUNK = 256;
+
+// number of chunks to split the KV dimension of a flash attention op into
+// with few q rows (single-token decode) most threads would otherwise sit idle while
+// a single thread scans the whole KV cache, so the KV sequence is split instead
+static int64_t ggml_flash_attn_ext_n_kv_chunks(const ggml_tensor * dst, int nth) {
+    const ggml_tensor * q = dst->src[0];
+    const ggml_tensor * k = dst->src[1];
+
+    const int64_t nr  = q->ne[1]*q->ne[2]*q->ne[3];
+    const int64_t nkv = k->ne[1];
+
+    if (nth <= 1 || nr >= nth) {
+        return 1;
+    }
+
+    return MAX(1, MIN((nth + nr - 1)/nr, nkv/GGML_FA_SPLIT_KV_MIN_CHUNK));
+}
+
+typedef void (*ggml_vec_mad_q_t)(int n, float * GGML_RESTRICT y, const void * GGML_RESTRICT vx, float v);
+
+// multiply-add that dequantizes V on the fly, nullptr if the type has none
+static ggml_vec_mad_q_t ggml_flash_attn_ext_v_mad(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_Q4_0: return ggml_vec_mad_q4_0;
+        case GGML_TYPE_Q5_1: return ggml_vec_mad_q5_1;
+        case GGML_TYPE_Q8_0: return ggml_vec_mad_q8_0;
+        default:             return nullptr;
+    }
+}
+
+// online softmax over the KV cells [ic0, ic1) for q row ir
+// on return VKQ32 holds the (unnormalized) FP32 accumulator and *pM, *pS the running max and sum
+static void ggml_compute_forward_flash_attn_ext_f16_row(
+        const ggml_tensor * dst,
+        int64_t ir,
+        int64_t ic0,
+        int64_t ic1,
+        float * VKQ32,
+        float * pM,
+        float * pS) {
 
     const ggml_tensor * q     = dst->src[0];
     const ggml_tensor * k     = dst->src[1];
     const ggml_tensor * v     = dst->src[2];
     const ggml_tensor * mask  = dst->src[3];
-    const ggml_tensor * sinks = dst->src[4];
 
     GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
     GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
@@ -7929,35 +8392,9 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
     GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
     GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
-    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
-    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
-
-    const int ith = params->ith;
-    const int nth = params->nth;
 
     const int64_t DK = nek0;
     const int64_t DV = nev0;
-    const int64_t N  = neq1;
-
-    GGML_ASSERT(ne0 == DV);
-    GGML_ASSERT(ne2 == N);
-
-    // input tensor rows must be contiguous
-    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
-    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
-    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
-
-    GGML_ASSERT(neq0 == DK);
-    GGML_ASSERT(nek0 == DK);
-    GGML_ASSERT(nev0 == DV);
-
-    GGML_ASSERT(neq1 == N);
-
-    // dst cannot be transposed or permuted
-    GGML_ASSERT(nb0 == sizeof(float));
-    GGML_ASSERT(nb0 <= nb1);
-    GGML_ASSERT(nb1 <= nb2);
-    GGML_ASSERT(nb2 <= nb3);
 
     // broadcast factors
     const int64_t rk2 = neq2/nek2;
@@ -7966,18 +8403,6 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     const int64_t rv2 = neq2/nev2;
     const int64_t rv3 = neq3/nev3;
 
-    // parallelize by q rows using ggml_vec_dot_f32
-
-    // total rows in q
-    const int nr = neq1*neq2*neq3;
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
     float scale         = 1.0f;
     float max_bias      = 0.0f;
     float logit_softcap = 0.0f;
@@ -8000,154 +8425,304 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     ggml_from_float_t const q_to_vec_dot   = ggml_get_type_traits_cpu(k_vec_dot_type)->from_float;
     ggml_vec_dot_t    const kq_vec_dot     = ggml_get_type_traits_cpu(k->type)->vec_dot;
     ggml_to_float_t   const v_to_float     = ggml_get_type_traits(v->type)->to_float;
+    ggml_vec_mad_q_t  const v_mad          = ggml_flash_attn_ext_v_mad(v->type);
 
-    GGML_ASSERT((                            q_to_vec_dot) && "fattn: unsupported K-type");
-    GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
+    // q indices
+    const int iq3 = ir/(neq2*neq1);
+    const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+    const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
-    // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+    const uint32_t h = iq2; // head index
+    const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
 
-        const uint32_t h = iq2; // head index
-        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+    float S = 0.0f;      // sum
+    float M = -INFINITY; // maximum KQ value
 
-        float S = 0.0f;      // sum
-        float M = -INFINITY; // maximum KQ value
+    float       * V32   =                 (VKQ32 + 1*DV); // (temporary) FP32 V buffer
+    ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*DV); // (temporary) FP16 VKQ accumulator
+    ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*DV); // (temporary) buffer for Q converted to quantized/FP16
 
-        float       * VKQ32 = (float       *) params->wdata + ith*(1*DK + 2*DV + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
-        float       * V32   =                 (VKQ32 + 1*DV); // (temporary) FP32 V buffer
-        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*DV); // (temporary) FP16 VKQ accumulator
-        ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*DV); // (temporary) buffer for Q converted to quantized/FP16
+    if (v->type == GGML_TYPE_F16) {
+        memset(VKQ16, 0, DV*sizeof(ggml_fp16_t));
+    } else {
+        memset(VKQ32, 0, DV*sizeof(float));
+    }
 
-        if (v->type == GGML_TYPE_F16) {
-            memset(VKQ16, 0, DV*sizeof(ggml_fp16_t));
-        } else {
-            memset(VKQ32, 0, DV*sizeof(float));
+    const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1] + (iq2%mask->ne[2])*mask->nb[2] + (iq3%mask->ne[3])*mask->nb[3]) : NULL;
+
+    // k indices
+    const int ik3 = iq3 / rk3;
+    const int ik2 = iq2 / rk2;
+
+    // v indices
+    const int iv3 = iq3 / rv3;
+    const int iv2 = iq2 / rv2;
+
+    const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+    q_to_vec_dot(pq, Q_q, DK);
+
+    // online softmax / attention
+    // loop over n_kv and n_head_kv
+    // ref: https://arxiv.org/pdf/2112.05682.pdf
+    for (int64_t ic = ic0; ic < ic1; ++ic) {
+        const float mv = mp ? slope*GGML_CPU_FP16_TO_FP32(mp[ic]) : 0.0f;
+        if (mv == -INFINITY) {
+            continue;
         }
 
-        const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1] + (iq2%mask->ne[2])*mask->nb[2] + (iq3%mask->ne[3])*mask->nb[3]) : NULL;
+        float s; // KQ value
 
-        // k indices
-        const int ik3 = iq3 / rk3;
-        const int ik2 = iq2 / rk2;
+        const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
+        kq_vec_dot(DK, &s, 0, k_data, 0, Q_q, 0, 1);
 
-        // v indices
-        const int iv3 = iq3 / rv3;
-        const int iv2 = iq2 / rv2;
+        s = s*scale; // scale KQ value
 
-        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-        q_to_vec_dot(pq, Q_q, DK);
+        if (logit_softcap != 0.0f) {
+            s = logit_softcap*tanhf(s);
+        }
 
-        // online softmax / attention
-        // loop over n_kv and n_head_kv
-        // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*GGML_CPU_FP16_TO_FP32(mp[ic]) : 0.0f;
-            if (mv == -INFINITY) {
-                continue;
-            }
+        s += mv; // apply mask
+
+        const float Mold = M;
 
-            float s; // KQ value
+        float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
+        float vs = 1.0f; // post-softmax KQ value, expf(s - M)
 
-            const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
-            kq_vec_dot(DK, &s, 0, k_data, 0, Q_q, 0, 1);
+        const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
 
-            s = s*scale; // scale KQ value
+        if (v->type == GGML_TYPE_F16) {
+            if (s > M) {
+                // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                M = s;
+                ms = ggml_expf_approx(Mold - M);
 
-            if (logit_softcap != 0.0f) {
-                s = logit_softcap*tanhf(s);
+                // V = V*expf(Mold - M)
+                ggml_vec_scale_f16(DV, VKQ16, ms);
+            } else {
+                // no new maximum, ms == 1.0f, vs != 1.0f
+                vs = ggml_expf_approx(s - M);
             }
 
-            s += mv; // apply mask
+            // V += v*expf(s - M)
+            ggml_vec_mad_f16(DV, VKQ16, (const ggml_fp16_t *) v_data, vs);
+        } else {
+            if (s > M) {
+                // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                M = s;
+                ms = ggml_expf_approx(Mold - M);
 
-            const float Mold = M;
+                // V = V*expf(Mold - M)
+                ggml_vec_scale_f32(DV, VKQ32, ms);
+            } else {
+                // no new maximum, ms == 1.0f, vs != 1.0f
+                vs = ggml_expf_approx(s - M);
+            }
 
-            float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
-            float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+            // V += v*expf(s - M)
+            if (v_mad) {
+                v_mad(DV, VKQ32, v_data, vs);
+            } else if (v_to_float) {
+                v_to_float(v_data, V32, DV);
+                ggml_vec_mad_f32(DV, VKQ32, V32, vs);
+            } else {
+                // V is F32
+                ggml_vec_mad_f32(DV, VKQ32, (const float *) v_data, vs);
+            }
+        }
 
-            const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+        S = S*ms + vs; // scale and increment sum with partial sum
+    }
 
-            if (v->type == GGML_TYPE_F16) {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+    if (v->type == GGML_TYPE_F16) {
+        for (int64_t d = 0; d < DV; ++d) {
+            VKQ32[d] = GGML_CPU_FP16_TO_FP32(VKQ16[d]);
+        }
+    }
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f16(DV, VKQ16, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
-                }
+    *pM = M;
+    *pS = S;
+}
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f16(DV, VKQ16, (const ggml_fp16_t *) v_data, vs);
-            } else {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+// apply the attention sinks, normalize and write q row ir of the result
+static void ggml_compute_forward_flash_attn_ext_f16_store(
+        ggml_tensor * dst,
+        int64_t ir,
+        float * VKQ32,
+        float M,
+        float S) {
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f32(DV, VKQ32, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
-                }
+    const ggml_tensor * q     = dst->src[0];
+    const ggml_tensor * sinks = dst->src[4];
 
-                // V += v*expf(s - M)
-                if (v_to_float) {
-                    v_to_float(v_data, V32, DV);
-                    ggml_vec_mad_f32(DV, VKQ32, V32, vs);
-                } else {
-                    // V is F32
-                    ggml_vec_mad_f32(DV, VKQ32, (const float *) v_data, vs);
-                }
-            }
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int64_t DV = ne0;
 
-            S = S*ms + vs; // scale and increment sum with partial sum
+    // dst indices
+    const int i3 = ir/(neq2*neq1);
+    const int i2 = (ir - i3*neq2*neq1)/neq1;
+    const int i1 = (ir - i3*neq2*neq1 - i2*neq1);
+
+    // sinks
+    if (sinks) {
+        const float s = ((float *)((char *) sinks->data))[i2];
+
+        float ms = 1.0f;
+        float vs = 1.0f;
+
+        if (s > M) {
+            ms = expf(M - s);
+            ggml_vec_scale_f32(DV, VKQ32, ms);
+        } else {
+            vs = expf(s - M);
         }
 
-        if (v->type == GGML_TYPE_F16) {
-            for (int64_t d = 0; d < DV; ++d) {
-                VKQ32[d] = GGML_CPU_FP16_TO_FP32(VKQ16[d]);
-            }
+        S = S*ms + vs;
+    }
+
+    // V /= S
+    const float S_inv = 1.0f/S;
+    ggml_vec_scale_f32(DV, VKQ32, S_inv);
+
+    // original
+    //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+
+    // permute(0, 2, 1, 3)
+    memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+}
+
+static void ggml_compute_forward_flash_attn_ext_f16(
+        const ggml_compute_params * params,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * q     = dst->src[0];
+    const ggml_tensor * k     = dst->src[1];
+    const ggml_tensor * v     = dst->src[2];
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t DK = nek0;
+    const int64_t DV = nev0;
+    const int64_t N  = neq1;
+
+    GGML_ASSERT(ne0 == DV);
+    GGML_ASSERT(ne2 == N);
+
+    // input tensor rows must be contiguous
+    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+
+    GGML_ASSERT(neq0 == DK);
+    GGML_ASSERT(nek0 == DK);
+    GGML_ASSERT(nev0 == DV);
+
+    GGML_ASSERT(neq1 == N);
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    ggml_type         const k_vec_dot_type = ggml_get_type_traits_cpu(k->type)->vec_dot_type;
+    ggml_from_float_t const q_to_vec_dot   = ggml_get_type_traits_cpu(k_vec_dot_type)->from_float;
+    ggml_to_float_t   const v_to_float     = ggml_get_type_traits(v->type)->to_float;
+
+    GGML_ASSERT((                            q_to_vec_dot) && "fattn: unsupported K-type");
+    GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
+
+    // total rows in q
+    const int64_t nr = neq1*neq2*neq3;
+
+    float * VKQ32 = (float *) params->wdata + ith*(1*DK + 2*DV + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator + scratch
+
+    const int64_t n_chunks = ggml_flash_attn_ext_n_kv_chunks(dst, nth);
+
+    if (n_chunks == 1) {
+        // parallelize by q rows using ggml_vec_dot_f32
+
+        // rows per thread
+        const int64_t dr = (nr + nth - 1)/nth;
+
+        // row range for this thread
+        const int64_t ir0 = dr*ith;
+        const int64_t ir1 = MIN(ir0 + dr, nr);
+
+        // loop over n_batch and n_head
+        for (int64_t ir = ir0; ir < ir1; ++ir) {
+            float M;
+            float S;
+
+            ggml_compute_forward_flash_attn_ext_f16_row(dst, ir, 0, nek1, VKQ32, &M, &S);
+            ggml_compute_forward_flash_attn_ext_f16_store(dst, ir, VKQ32, M, S);
         }
 
-        // sinks
-        if (sinks) {
-            const float s = ((float *)((char *) sinks->data))[h];
+        return;
+    }
+
+    // split-KV (flash-decoding): each (q row, KV chunk) pair produces a partial max, sum and
+    // accumulator, which are then merged with a log-sum-exp reduction
+    // partials are stored after the per-thread scratch as [M, S, VKQ[DV]] per work item
+    float * partials = (float *) params->wdata + nth*(1*DK + 2*DV + CACHE_LINE_SIZE_F32);
 
-            float ms = 1.0f;
-            float vs = 1.0f;
+    const int64_t n_items = nr*n_chunks;
+    const int64_t dc      = (nek1 + n_chunks - 1)/n_chunks;
 
-            if (s > M) {
-                ms = expf(M - s);
-                ggml_vec_scale_f32(DV, VKQ32, ms);
-            } else {
-                vs = expf(s - M);
-            }
+    for (int64_t item = ith; item < n_items; item += nth) {
+        const int64_t ir = item/n_chunks;
+        const int64_t ic = item%n_chunks;
+
+        const int64_t ic0 = dc*ic;
+        const int64_t ic1 = MIN(ic0 + dc, nek1);
 
-            S = S*ms + vs;
+        float * part = partials + item*(DV + 2);
+
+        ggml_compute_forward_flash_attn_ext_f16_row(dst, ir, ic0, ic1, VKQ32, &part[0], &part[1]);
+        memcpy(part + 2, VKQ32, DV*sizeof(float));
+    }
+
+    ggml_barrier(params->threadpool);
+
+    for (int64_t ir = ith; ir < nr; ir += nth) {
+        const float * part = partials + ir*n_chunks*(DV + 2);
+
+        float M = -INFINITY;
+        for (int64_t ic = 0; ic < n_chunks; ++ic) {
+            M = MAX(M, part[ic*(DV + 2)]);
         }
 
-        // V /= S
-        const float S_inv = 1.0f/S;
-        ggml_vec_scale_f32(DV, VKQ32, S_inv);
+        float S = 0.0f;
+        memset(VKQ32, 0, DV*sizeof(float));
 
-        // dst indices
-        const int i1 = iq1;
-        const int i2 = iq2;
-        const int i3 = iq3;
+        for (int64_t ic = 0; ic < n_chunks; ++ic) {
+            const float Mc = part[ic*(DV + 2) + 0];
+            const float Sc = part[ic*(DV + 2) + 1];
+
+            if (Mc == -INFINITY) {
+                // fully masked chunk
+                continue;
+            }
+
+            const float ms = expf(Mc - M);
 
-        // original
-        //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+            S += Sc*ms;
+            ggml_vec_mad_f32(DV, VKQ32, part + ic*(DV + 2) + 2, ms);
+        }
 
-        // permute(0, 2, 1, 3)
-        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+        ggml_compute_forward_flash_attn_ext_f16_store(dst, ir, VKQ32, M, S);
     }
 }
 
@@ -110,6 +110,81 @@ void quantize_row_q8_K_generic(const float * GGML_RESTRICT x, void * GGML_RESTRI
     quantize_row_q8_K_ref(x, y, k);
 }
 
+//===================================== Multiply-add ================================
+
+// the loops over a block are plain float arithmetic on independent lanes, so they vectorize on every target
+
+void ggml_vec_mad_q4_0(int n, float * GGML_RESTRICT y, const void * GGML_RESTRICT vx, float v) {
+    const int qk = QK4_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0 * GGML_RESTRICT x = vx;
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const float d = GGML_CPU_FP16_TO_FP32(x[ib].d)*v;
+
+        float * GGML_RESTRICT y0 = y + ib*qk;
+        float * GGML_RESTRICT y1 = y + ib*qk + qk/2;
+
+        for (int j = 0; j < qk/2; ++j) {
+            y0[j] += ((x[ib].qs[j] & 0x0F) - 8)*d;
+            y1[j] += ((x[ib].qs[j] >>   4) - 8)*d;
+        }
+    }
+}
+
+void ggml_vec_mad_q5_1(int n, float * GGML_RESTRICT y, const void * GGML_RESTRICT vx, float v) {
+    const int qk = QK5_1;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q5_1 * GGML_RESTRICT x = vx;
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const float d = GGML_CPU_FP16_TO_FP32(x[ib].d)*v;
+        const float m = GGML_CPU_FP16_TO_FP32(x[ib].m)*v;
+
+        uint32_t qh;
+        memcpy(&qh, x[ib].qh, sizeof(qh));
+
+        // spread the fifth bits to bytes first, the variable shifts keep the main loop from vectorizing
+        uint8_t xh[QK5_1];
+        for (int j = 0; j < qk; ++j) {
+            xh[j] = ((qh >> j) & 1) << 4;
+        }
+
+        float * GGML_RESTRICT y0 = y + ib*qk;
+        float * GGML_RESTRICT y1 = y + ib*qk + qk/2;
+
+        for (int j = 0; j < qk/2; ++j) {
+            y0[j] += ((x[ib].qs[j] & 0x0F) | xh[j       ])*d + m;
+            y1[j] += ((x[ib].qs[j] >>   4) | xh[j + qk/2])*d + m;
+        }
+    }
+}
+
+void ggml_vec_mad_q8_0(int n, float * GGML_RESTRICT y, const void * GGML_RESTRICT vx, float v) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0 * GGML_RESTRICT x = vx;
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const float d = GGML_CPU_FP16_TO_FP32(x[ib].d)*v;
+
+        float * GGML_RESTRICT yb = y + ib*qk;
+
+        for (int j = 0; j < qk; ++j) {
+            yb[j] += x[ib].qs[j]*d;
+        }
+    }
+}
+
 //===================================== Dot products =================================
 
 void ggml_vec_dot_q4_0_q8_0_generic(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc) {
@@ -0,0 +1,129 @@
+// test-softmax-accuracy.cpp — accuracy check of ggml_expf_approx and soft_max against double references
+//
+// not part of the package library; build and run it from src/ with: make -f Makevars check-accuracy
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+#include "vec.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// max relative error of ggml_expf_approx over the range where it neither flushes to zero nor to infinity
+static bool test_expf_approx() {
+    const double lo = -87.3;
+    const double hi =  88.3;
+    const int    n  = 4*1024*1024;
+
+    double max_err = 0.0;
+    float  max_x   = 0.0f;
+    for (int i = 0; i <= n; ++i) {
+        const float  x   = (float) (lo + (hi - lo)*i/n);
+        const double ref = std::exp((double) x);
+        const double err = std::fabs((double) ggml_expf_approx(x) - ref)/ref;
+        if (err > max_err) {
+            max_err = err;
+            max_x   = x;
+        }
+    }
+
+    const bool ok = max_err < 1e-6;
+    printf("expf_approx: max rel err %.3g at x = %g over [%g, %g] %s\n", max_err, max_x, lo, hi, ok ? "OK" : "FAIL");
+    return ok;
+}
+
+// soft_max_ext of [n_kv, n_rows, n_head] logits with a broadcast mask, against the same formula in double
+static bool test_soft_max_ext(ggml_type mask_type, float max_bias) {
+    const int   n_kv   = 67;
+    const int   n_rows = 5;
+    const int   n_head = 6;
+    const float scale  = 0.125f;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ 16*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * a    = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_kv, n_rows, n_head);
+    ggml_tensor * mask = ggml_new_tensor_2d(ctx, mask_type,     n_kv, n_rows);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist_a(-40.0f, 40.0f);
+    std::uniform_real_distribution<float> dist_m(-4.0f, 0.0f);
+
+    float * ad = (float *) a->data;
+    for (int i = 0; i < n_kv*n_rows*n_head; ++i) {
+        ad[i] = dist_a(rng);
+    }
+
+    // causal -inf part plus a finite bias, as used for ALiBi; the reference reads back the stored (rounded) values
+    std::vector<float> md(n_kv*n_rows);
+    for (int r = 0; r < n_rows; ++r) {
+        for (int c = 0; c < n_kv; ++c) {
+            const float v = c > n_kv - n_rows + r ? -INFINITY : dist_m(rng);
+            if (mask_type == GGML_TYPE_F16) {
+                ((ggml_fp16_t *) mask->data)[r*n_kv + c] = ggml_fp32_to_fp16(v);
+                md[r*n_kv + c] = ggml_fp16_to_fp32(ggml_fp32_to_fp16(v));
+            } else {
+                ((float *) mask->data)[r*n_kv + c] = v;
+                md[r*n_kv + c] = v;
+            }
+        }
+    }
+
+    ggml_tensor * out = ggml_soft_max_ext(ctx, a, mask, scale, max_bias);
+    ggml_cgraph * gf  = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    ggml_graph_compute_with_ctx(ctx, gf, 1);
+
+    const int    n_head_log2 = 1 << (int) std::floor(std::log2((double) n_head));
+    const double m0          = std::pow(2.0, -(double) max_bias/n_head_log2);
+    const double m1          = std::pow(2.0, -(double) max_bias/2.0/n_head_log2);
+
+    double max_err = 0.0;
+    std::vector<double> p(n_kv);
+    for (int h = 0; h < n_head; ++h) {
+        const double slope = max_bias > 0.0f ? (h < n_head_log2 ? std::pow(m0, h + 1) : std::pow(m1, 2*(h - n_head_log2) + 1)) : 1.0;
+        for (int r = 0; r < n_rows; ++r) {
+            const float * x = ad + (h*n_rows + r)*n_kv;
+            const float * y = (const float *) out->data + (h*n_rows + r)*n_kv;
+
+            double max = -INFINITY;
+            for (int c = 0; c < n_kv; ++c) {
+                p[c] = (double) x[c]*scale + slope*md[r*n_kv + c];
+                max  = std::fmax(max, p[c]);
+            }
+            double sum = 0.0;
+            for (int c = 0; c < n_kv; ++c) {
+                p[c] = std::exp(p[c] - max);
+                sum += p[c];
+            }
+            for (int c = 0; c < n_kv; ++c) {
+                max_err = std::fmax(max_err, std::fabs(y[c] - p[c]/sum));
+            }
+        }
+    }
+
+    ggml_free(ctx);
+
+    const bool ok = max_err < 1e-6;
+    printf("soft_max_ext: %s mask, max_bias %g: max abs err %.3g %s\n",
+            ggml_type_name(mask_type), max_bias, max_err, ok ? "OK" : "FAIL");
+    return ok;
+}
+
+int main() {
+    ggml_cpu_init();
+
+    bool ok = test_expf_approx();
+    ok = test_soft_max_ext(GGML_TYPE_F16, 0.0f) && ok;
+    ok = test_soft_max_ext(GGML_TYPE_F32, 0.0f) && ok;
+    ok = test_soft_max_ext(GGML_TYPE_F16, 8.0f) && ok;
+    ok = test_soft_max_ext(GGML_TYPE_F32, 8.0f) && ok;
+
+    return ok ? 0 : 1;
+}
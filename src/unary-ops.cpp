@@ -73,13 +73,29 @@ static inline float op_log(float x) {
     return logf(x);
 }
 
+// plain f32 loop, vectorized by the compiler for the ops that do not call libm
+template <float (*op)(float)>
+static inline void vec_unary_op_f32(int64_t n, float * y, const float * x) {
+    for (int64_t i = 0; i < n; i++) {
+        y[i] = op(x[i]);
+    }
+}
+
 template <float (*op)(float), typename src0_t, typename dst_t>
 static inline void vec_unary_op(int64_t n, dst_t * y, const src0_t * x) {
-    constexpr auto src0_to_f32 = type_conversion_table<src0_t>::to_f32;
-    constexpr auto f32_to_dst  = type_conversion_table<dst_t >::from_f32;
+    if constexpr (std::is_same_v<src0_t, float> && std::is_same_v<dst_t, float>) {
+        vec_unary_op_f32<op>(n, y, x);
+    } else {
+        float x_tile[GGML_ELEMENTWISE_TILE];
+        float y_tile[GGML_ELEMENTWISE_TILE];
 
-    for (int i = 0; i < n; i++) {
-        y[i] = f32_to_dst(op(src0_to_f32(x[i])));
+        for (int64_t i0 = 0; i0 < n; i0 += GGML_ELEMENTWISE_TILE) {
+            const int64_t nt = MIN(GGML_ELEMENTWISE_TILE, n - i0);
+
+            float * yf = tile_f32_dst(y + i0, y_tile);
+            vec_unary_op_f32<op>(nt, yf, tile_to_f32(x + i0, x_tile, nt));
+            tile_from_f32(yf, y + i0, nt);
+        }
     }
 }
 
@@ -467,10 +467,13 @@ ggml_float ggml_vec_soft_max_f32(const int n, float * y, const float * x, float
     }
     return (ggml_float)__riscv_vfmv_f_s_f64m1_f64(vsum);
 #endif
+    // two loops so that the exp one vectorizes without reassociating the sum
+    const int i0 = i;
     for (; i < n; ++i) {
-        float val = expf(x[i] - max);
-        sum += (ggml_float)val;
-        y[i] = val;
+        y[i] = ggml_expf_approx(x[i] - max);
+    }
+    for (i = i0; i < n; ++i) {
+        sum += (ggml_float)y[i];
     }
     return sum;
 }
@@ -961,6 +961,35 @@ inline static ggml_fp16_t ggml_silu_f16(ggml_fp16_t x) {
     return GGML_CPU_FP32_TO_FP16(v/(1.0f + expf(-v)));
 }
 
+// scalar form of ggml_v_expf that needs no intrinsics: written with selects instead of branches so
+// that loops over it vectorize with the compiler's default target (generic builds, SIMD tails)
+// the maximum error is 1.45358 plus 0.5 ulps
+// numbers above 88.37 will flush to infinity
+// numbers beneath -87.33 will flush to zero (no subnormal results)
+inline static float ggml_expf_approx(float x) {
+    const float lo = -87.33f;
+    const float hi =  88.37f;
+    const float xc = x < lo ? lo : (x > hi ? hi : x);
+
+    const float r = 0x1.8p23f;
+    const float z = xc*0x1.715476p+0f + r;
+    const float n = z - r;
+    const float b = xc - n*0x1.62e4p-1f - n*0x1.7f7d1cp-20f;
+
+    // 2^n from the low bits of z
+    uint32_t zi;
+    memcpy(&zi, &z, sizeof(zi));
+    const uint32_t ki = (zi << 23) + 0x3f800000u;
+    float k;
+    memcpy(&k, &ki, sizeof(k));
+
+    const float u = b*b;
+    const float j = ((0x1.0e4020p-7f*b + 0x1.573e2ep-5f)*u + (0x1.555e66p-3f*b + 0x1.fffdb6p-2f))*u + 0x1.ffffecp-1f*b;
+    const float y = k + k*j;
+
+    return x < lo ? 0.0f : (x > hi ? INFINITY : y);
+}
+
 #if __FINITE_MATH_ONLY__
 #error "some routines in ggml.c require non-finite math arithmetics -- pass -fno-finite-math-only to the compiler to fix"
 #error "ref: https://github.com/ggml-org/llama.cpp/pull/7154#issuecomment-2143844461"